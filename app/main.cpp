@@ -37,7 +37,15 @@ int main(int argc, char **argv) {
     ("out",        po::value<std::string>()->default_value("./image.ppm"), "path to the output file")
     ("input-file", po::value<std::string>()->required(),                   "path to the input scene description JSON file")
     ("samples",    po::value<int>()        ->required(),                   "number of samples per pixel")
-    ("threads",    po::value<int>()        ->default_value(1),             "number of threads to spawn when running in multithreaded mode");
+    ("threads",    po::value<int>()        ->default_value(1),             "number of threads to spawn when running in multithreaded mode")
+    ("accelerator", po::value<std::string>(),                              "acceleration structure, one of `bvh`, `grid`, or `auto` (overrides the scene file)")
+    ("bvh-split",  po::value<std::string>(),                               "BVH split method, one of `sah`, `middle`, `lbvh`, or `sbvh` (overrides the scene file)")
+    ("bvh-width",  po::value<int>(),                                       "BVH branching factor, either 2 or 8 (overrides the scene file)")
+    ("bvh-nodes",  po::value<std::string>(),                               "8-wide BVH node format, either `full` or `compressed` (overrides the scene file)")
+    ("bvh-cache",  po::value<std::string>(),                               "directory to cache the built 2-wide BVH in, keyed by the scene geometry")
+    ("bvh-stats",                                                          "print statistics about the 2-wide BVH of the scene instead of rendering")
+    ("bvh-dump",   po::value<std::string>(),                               "write the 2-wide BVH to the given file as JSON (implies --bvh-stats)")
+    ("triangle-test", po::value<std::string>(),                            "ray/triangle test, either `moller-trumbore` or `watertight` (overrides the scene file)");
   /* clang-format on */
 
   po::positional_options_description p;
@@ -100,7 +108,24 @@ int main(int argc, char **argv) {
 
   try {
     const auto aspect_r = (float)config.width / (float)config.height;
-    const auto scene = ronald::Scene::from_json(jv.as_object(), aspect_r);
+    const auto scene =
+        ronald::Scene::from_json(jv.as_object(), aspect_r, config);
+
+    if (config.bvh_stats) {
+      const auto &bvh =
+          dynamic_cast<const ronald::FlatBVH &>(scene.accelerator());
+      bvh.stats().print(std::cout);
+
+      if (!config.bvh_dump.empty()) {
+        std::ofstream dump(config.bvh_dump);
+        bvh.dump_json(dump);
+        if (!dump) {
+          std::cout << "Error: Failed to write " << config.bvh_dump << '\n';
+          return 1;
+        }
+      }
+      return 0;
+    }
 
     ronald::Image im;
     // Technically calling render_multi_threaded with one thread is fine, but
@@ -48,6 +48,13 @@ public:
   [[nodiscard]] AABB(const Vec3 &min_a, const Vec3 &max_a)
       : min(min_a), max(max_a){};
 
+  /**
+   * Construct an "empty" AABB with inverted infinite bounds. Taking the
+   * surrounding box of an empty AABB and any other box yields the other box,
+   * which makes it the identity for accumulating bounds
+   */
+  [[nodiscard]] static AABB empty();
+
   /**
    * Check whether the given Ray intersects the AABB.
    */
@@ -59,11 +66,32 @@ public:
    */
   [[nodiscard]] size_t largest_extent() const;
 
+  /**
+   * Return the total surface area of the box
+   */
+  [[nodiscard]] float surface_area() const;
+
+  /**
+   * Return the point at the center of the box
+   */
+  [[nodiscard]] Vec3 centroid() const;
+
   /**
    * Return a new AABB which completely contains the two provided bounding boxes
    */
   [[nodiscard]] static AABB surrounding_box(const AABB &a, const AABB &b);
 
+  /**
+   * Return the AABB of the region the two provided bounding boxes share. If
+   * the boxes don't overlap, the result is empty
+   */
+  [[nodiscard]] static AABB intersection(const AABB &a, const AABB &b);
+
+  /**
+   * Check whether the box is empty, i.e. its min is past its max on any axis
+   */
+  [[nodiscard]] bool is_empty() const;
+
   /**
    * Stream insertion operator
    */
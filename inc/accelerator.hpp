@@ -0,0 +1,115 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+
+#include "common.hpp"
+#include "ray.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ronald {
+
+struct BVHOptions;
+
+/**
+ * The kind of acceleration structure built over the objects of a scene.
+ * `Grid` is a uniform grid, which is built in linear time and suits scenes
+ * made of many similarly sized objects. `Auto` picks between the grid and
+ * the BVH with `prefer_grid`
+ */
+enum class AcceleratorType { BVH, Grid, Auto };
+
+/**
+ * Parse an accelerator type from its name in the scene description or the
+ * CLI
+ */
+[[nodiscard]] AcceleratorType
+accelerator_type_from_string(const std::string &str);
+
+/**
+ * Guess whether a uniform grid would trace rays through the objects faster
+ * than a BVH. Grids suffer when the objects differ a lot in size, since the
+ * cells are sized for the typical object and the large ones end up in many
+ * of them, and when there are too few objects for the simpler traversal to
+ * matter. They also suffer when the objects are clustered, since the cells
+ * are spread evenly over the bounds of the scene and most objects end up
+ * crowded into a few of them. So the grid is only picked for scenes with
+ * many objects where no object is much larger than the median, and where
+ * the cells of the grid built with `opts` would hold few objects each
+ */
+[[nodiscard]] bool prefer_grid(const std::vector<Object> &objs,
+                               const BVHOptions &opts);
+
+/**
+ * The number of bytes used by an acceleration structure, split into the
+ * nodes of the structure itself and the storage of the objects in its leaves
+ */
+struct AcceleratorMemory {
+  size_t nodes = 0;
+  size_t leaves = 0;
+};
+
+/**
+ * An acceleration structure finds the closest object hit by a ray without
+ * testing the ray against every object in the scene. The scene only talks to
+ * its acceleration structure through this interface, so the structure used
+ * for a given scene can be swapped out freely. The virtual call happens once
+ * per ray, never per primitive
+ */
+class Accelerator {
+public:
+  virtual ~Accelerator() = default;
+
+  /**
+   * Find the closest intersection between the ray and the objects in the
+   * acceleration structure at some point along the ray between `t_min` and
+   * `t_max`. If the ray doesn't hit anything, std::nullopt is returned.
+   */
+  [[nodiscard]] virtual std::optional<Hit> intersect(const Ray &r, float t_min,
+                                                     float t_max) const = 0;
+
+  /**
+   * Check whether the ray hits any object between `t_min` and `t_max`. This
+   * is the query for shadow rays: the traversal stops at the first hit it
+   * finds, in whatever order, and never computes the hit's surface
+   */
+  [[nodiscard]] virtual bool occluded(const Ray &r, float t_min,
+                                      float t_max) const = 0;
+
+  /**
+   * Get the memory used by the acceleration structure
+   */
+  [[nodiscard]] virtual AcceleratorMemory memory() const = 0;
+
+  /**
+   * Build the acceleration structure selected by `opts` over the given objects
+   * and report how long the build took and how much memory the structure
+   * uses on stderr. `opts.accelerator` picks between the BVH and the grid.
+   * If `cache_path` is given, the binary BVH is loaded from that file instead
+   * when it exists, and written to it after the build when it doesn't
+   */
+  [[nodiscard]] static std::unique_ptr<Accelerator>
+  build(std::vector<Object> &objs, const BVHOptions &opts,
+        const std::string &cache_path = "");
+};
+
+} // namespace ronald
+
+#endif // ACCELERATOR_H
@@ -17,40 +17,550 @@
 #ifndef BVH_H
 #define BVH_H
 
+#include "accelerator.hpp"
 #include "common.hpp"
+#include "sphere_block.hpp"
+#include "triangle_block.hpp"
+#include <new>
+#include <ostream>
+#include <span>
+#include <string>
+#include <variant>
 #include <vector>
 
 namespace ronald {
 
 class BVH;
 using BVHPair = std::pair<std::unique_ptr<BVH>, std::unique_ptr<BVH>>;
-using BVHData = std::variant<BVHPair, Object>;
+using BVHData = std::variant<BVHPair, std::vector<Object>>;
 
 enum class NodeType { Internal, Leaf };
 
+/**
+ * The method used to decide where to split the objects at each internal node
+ * of the BVH during construction. `LBVH` sorts the objects along a Morton
+ * curve instead of evaluating splits, trading some tree quality for a much
+ * faster build. `SBVH` extends the SAH with spatial splits, which can place
+ * a large object in several leaves
+ */
+enum class SplitMethod { Middle, SAH, LBVH, SBVH };
+
+/**
+ * Parse a split method from its name in the scene description or the CLI
+ */
+[[nodiscard]] SplitMethod split_method_from_string(const std::string &str);
+
+/**
+ * How the nodes of the 8-wide BVH store the bounds of their children. `Full`
+ * nodes keep the exact float bounds, `Compressed` nodes quantize them to 8
+ * bits relative to the bounds of the node itself, which makes the nodes about
+ * a third of the size at the cost of decoding the bounds on every visit and
+ * slightly looser boxes
+ */
+enum class NodeFormat { Full, Compressed };
+
+/**
+ * Parse a node format from its name in the scene description or the CLI
+ */
+[[nodiscard]] NodeFormat node_format_from_string(const std::string &str);
+
+/**
+ * The order the nodes of the binary FlatBVH are stored in. Either way the two
+ * children of a node are stored next to each other in one cache line.
+ * `DepthFirst` stores each subtree right after its root, so the far child of
+ * a node near the root ends up megabytes away from it in big scenes.
+ * `Treelet` stores each subtree of the nodes most likely to be visited
+ * together, picked greedily by surface area, as one run of consecutive pairs,
+ * so a ray walking down the tree stays within a few kilobytes of memory
+ */
+enum class NodeLayout { DepthFirst, Treelet };
+
+/**
+ * Parse a node layout from its name in the scene description
+ */
+[[nodiscard]] NodeLayout node_layout_from_string(const std::string &str);
+
+/**
+ * How rays walk the binary FlatBVH. `Stack` pushes the far child of every
+ * node it enters onto a fixed-size stack of node indices. `Stackless` follows
+ * links from each pair of siblings to their parent instead, so the state of
+ * a ray is just the node it's at and the direction it got there from, at the
+ * cost of reading the parents again on the way back up. Trees too deep for
+ * the stack always use the stackless traversal
+ */
+enum class Traversal { Stack, Stackless };
+
+/**
+ * Parse a traversal from its name in the scene description
+ */
+[[nodiscard]] Traversal traversal_from_string(const std::string &str);
+
+/**
+ * Options controlling the construction of the BVH. The costs are only
+ * meaningful relative to each other, they are used by the Surface Area
+ * Heuristic to estimate how expensive a given split will be to traverse
+ */
+struct BVHOptions {
+  // the acceleration structure `Accelerator::build` builds. the rest of the
+  // options only apply to the BVH, apart from `grid_density`
+  AcceleratorType accelerator = AcceleratorType::BVH;
+
+  SplitMethod split_method = SplitMethod::SAH;
+
+  // number of buckets the centroid bounds are divided into along each axis
+  // when evaluating candidate SAH splits
+  size_t sah_buckets = 12;
+
+  // estimated cost of visiting an internal node of the tree
+  float traversal_cost = 0.125f;
+
+  // estimated cost of intersecting a primitive stored in a leaf node
+  float intersection_cost = 1.0f;
+
+  // maximum number of objects in a leaf. with the SAH split method leaves
+  // may end up smaller when splitting them further is estimated to be cheaper
+  size_t max_leaf_size = 8;
+
+  // branching factor of the tree used for traversal. a width of 2 uses the
+  // binary FlatBVH, a width of 8 collapses it into a WideBVH
+  size_t width = 8;
+
+  // how the nodes of the 8-wide BVH store their child bounds. compressed
+  // nodes only exist for the 8-wide BVH, and limit leaves to 63 objects
+  NodeFormat node_format = NodeFormat::Full;
+
+  // order the nodes of the binary FlatBVH are stored in
+  NodeLayout node_layout = NodeLayout::Treelet;
+
+  // how rays walk the binary FlatBVH
+  Traversal traversal = Traversal::Stack;
+
+  // spatial splits are only considered when the children of the best object
+  // split overlap by more than this fraction of the surface area of the root
+  float spatial_split_alpha = 1e-5f;
+
+  // maximum number of extra object references spatial splits may create, as
+  // a fraction of the number of objects. this bounds the memory used by the
+  // duplicated references
+  float max_duplication = 0.3f;
+
+  // number of cells per object of the grid accelerator. the cells are as
+  // close to cubes as the bounds of the scene allow. fewer cells than objects
+  // works best, since the objects in a cell are intersected eight at a time
+  float grid_density = 0.5f;
+
+  // number of threads used to build the tree. subtrees that are large enough
+  // are handed off to other threads until all of the threads are busy
+  size_t build_threads = 1;
+
+  /**
+   * Construct the BVH options from the (optional) `bvh` object of the scene
+   * description. Any missing keys keep their default values
+   */
+  [[nodiscard]] static BVHOptions from_json(const object &obj);
+};
+
+/**
+ * Intersect a ray with the `count` contiguous objects of a BVH leaf starting
+ * at `objs`. The objects are all tested in one tight loop and the surface of
+ * the closest hit is only computed once at the end. If any object is hit
+ * closer than `*t_max`, `*t_max` is shrunk to the distance of the hit and the
+ * hit is written to `hit`
+ */
+inline void intersect_leaf(const Object *objs, const size_t count,
+                           const Ray &r, const float t_min, float *t_max,
+                           Hit *hit) {
+  std::optional<PrimitiveHit> closest = std::nullopt;
+  size_t closest_idx = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    const auto hit_result = objs[i].primitive->intersect(r, t_min, *t_max);
+    if (hit_result.has_value()) {
+      closest = hit_result;
+      closest_idx = i;
+      *t_max = hit_result->t;
+    }
+  }
+
+  if (closest.has_value()) {
+    hit->hit = objs[closest_idx].primitive->surface(r, *closest);
+    hit->material = objs[closest_idx].material;
+  }
+}
+
+/**
+ * The objects referenced by the leaves of a flattened BVH. The objects of
+ * each leaf are stored contiguously. Leaves made up entirely of triangles or
+ * entirely of spheres are packed into blocks, which are intersected eight
+ * primitives at a time. The objects of every other leaf are copied into
+ * arrays grouped by their type, and each entry of the leaf holds a small tag
+ * saying which array to look in. Since the primitive classes are final and
+ * their `intersect` functions are defined inline, this lets the compiler
+ * inline the tests into the leaf loop instead of making a virtual call per
+ * object. Primitive types that the storage doesn't know about still go
+ * through `Primitive::intersect`
+ */
+class BVHLeaves {
+public:
+  /**
+   * The type of a primitive stored in the leaves
+   */
+  enum class PrimitiveType : uint8_t {
+    Sphere,
+    Triangle,
+    WatertightTriangle,
+    MeshTriangle,
+    Quad,
+    Box,
+    Other,
+  };
+
+  /**
+   * How the objects of a leaf are stored
+   */
+  enum class LeafKind : uint8_t { Entries, Triangles, Spheres };
+
+  /**
+   * The closest hit found so far while traversing the leaves. `id` is the
+   * index of the entry that was hit, or the index of the lane across all of
+   * the blocks for the leaves packed into blocks. The primitive hit is all
+   * that's kept during traversal, `surface` turns it into a full hit once
+   * the traversal is done
+   */
+  struct LeafHit {
+    PrimitiveHit hit;
+    uint32_t id;
+    LeafKind kind;
+  };
+
+private:
+  /**
+   * An object of a leaf. `index` is the index of its primitive in the array
+   * for its type
+   */
+  struct Entry {
+    PrimitiveType type;
+    uint32_t index;
+    const Material *material;
+  };
+
+  std::vector<Entry> entries;
+  std::vector<Sphere> spheres;
+  std::vector<Triangle> triangles;
+  std::vector<WatertightTriangle> watertight_triangles;
+  std::vector<MeshTriangle> mesh_triangles;
+  std::vector<Quad> quads;
+  std::vector<Box> boxes;
+  std::vector<const Primitive *> others;
+
+  // blocks of the triangle leaves, and the materials of each of their lanes.
+  // the unused lanes at the end of a leaf have no material
+  std::vector<TriangleBlock> blocks;
+  std::vector<const Material *> block_materials;
+
+  // blocks of the sphere leaves
+  SphereBlocks sphere_blocks;
+
+  // the primitives each entry, triangle lane, and sphere lane were copied
+  // from, so the copies can be updated when the primitives move
+  std::vector<const Primitive *> entry_sources;
+  std::vector<const Primitive *> block_sources;
+  std::vector<const Primitive *> sphere_sources;
+
+  /**
+   * Intersect a ray with the primitive of a leaf entry
+   */
+  [[nodiscard]] std::optional<PrimitiveHit>
+  intersect_entry(const Entry &e, const Ray &r, const float t_min,
+                  const float t_max) const {
+    switch (e.type) {
+    case PrimitiveType::Sphere:
+      return spheres[e.index].intersect(r, t_min, t_max);
+    case PrimitiveType::Triangle:
+      return triangles[e.index].intersect(r, t_min, t_max);
+    case PrimitiveType::WatertightTriangle:
+      return watertight_triangles[e.index].intersect(r, t_min, t_max);
+    case PrimitiveType::MeshTriangle:
+      return mesh_triangles[e.index].intersect(r, t_min, t_max);
+    case PrimitiveType::Quad:
+      return quads[e.index].intersect(r, t_min, t_max);
+    case PrimitiveType::Box:
+      return boxes[e.index].intersect(r, t_min, t_max);
+    case PrimitiveType::Other:
+      break;
+    }
+    return others[e.index]->intersect(r, t_min, t_max);
+  }
+
+  /**
+   * Compute the surface of a hit on the primitive of a leaf entry
+   */
+  [[nodiscard]] Intersection surface_entry(const Entry &e, const Ray &r,
+                                           const PrimitiveHit &h) const;
+
+  /**
+   * Intersect a ray with the entries of a leaf that isn't packed into blocks.
+   * This is kept out of line so that the primitive intersect functions are
+   * only inlined here, rather than into every traversal loop
+   */
+  bool intersect_entries(uint32_t offset, size_t count, const Ray &r,
+                         float t_min, float *t_max, LeafHit *closest) const;
+
+  /**
+   * Check whether a ray hits any of the entries of a leaf that isn't packed
+   * into blocks. Out of line for the same reason as `intersect_entries`
+   */
+  [[nodiscard]] bool occluded_entries(uint32_t offset, size_t count,
+                                      const Ray &r, float t_min,
+                                      float t_max) const;
+
+public:
+  /**
+   * A leaf added to the storage. `offset` is the index of the first entry of
+   * the leaf, or the index of its first block if it was packed into blocks
+   */
+  struct Leaf {
+    uint32_t offset;
+    LeafKind kind;
+  };
+
+  /**
+   * Add the objects of a leaf, packing them into blocks if they are all
+   * triangles or all spheres
+   */
+  Leaf add(const std::vector<Object> &objs);
+
+  /**
+   * Get the number of stored primitives of the given type
+   */
+  [[nodiscard]] size_t count(PrimitiveType type) const;
+
+  /**
+   * Get the number of bytes used by the stored leaves
+   */
+  [[nodiscard]] size_t memory() const;
+
+  /**
+   * Copy the primitives of a leaf again from the objects the leaf was built
+   * from, after the primitives have moved. Returns the new bounds of the leaf
+   */
+  AABB refit(uint32_t offset, size_t count, LeafKind kind);
+
+  /**
+   * Get the bounds of the objects a leaf was built from. These are the
+   * bounds `refit` returns if nothing has moved, which can be larger than
+   * the clipped bounds the spatial split builder gives its leaves
+   */
+  [[nodiscard]] AABB source_bounds(uint32_t offset, size_t count,
+                                   LeafKind kind) const;
+
+  /**
+   * Get the objects a leaf was built from
+   */
+  [[nodiscard]] std::vector<Object> objects(uint32_t offset, size_t count,
+                                            LeafKind kind) const;
+
+  /**
+   * Get the number of entries, triangle blocks, or sphere blocks a leaf of
+   * `count` objects of the given kind takes up in the storage
+   */
+  [[nodiscard]] static size_t leaf_size(const LeafKind kind,
+                                        const size_t count) {
+    switch (kind) {
+    case LeafKind::Triangles:
+      return (count + TriangleBlock::WIDTH - 1) / TriangleBlock::WIDTH;
+    case LeafKind::Spheres:
+      return (count + SphereBlock::WIDTH - 1) / SphereBlock::WIDTH;
+    case LeafKind::Entries:
+      break;
+    }
+    return count;
+  }
+
+  /**
+   * Intersect a ray with the `count` objects of a leaf. If any object is hit
+   * closer than `*t_max`, `*t_max` is shrunk to the distance of the hit and
+   * the hit is written to `closest`. Returns whether any object was hit
+   */
+  bool intersect(const uint32_t offset, const size_t count,
+                 const LeafKind kind, const Ray &r, const float t_min,
+                 float *t_max, LeafHit *closest) const {
+    if (kind == LeafKind::Entries) {
+      return intersect_entries(offset, count, r, t_min, t_max, closest);
+    }
+
+    if (kind == LeafKind::Spheres) {
+      const auto n_blocks =
+          (count + SphereBlock::WIDTH - 1) / SphereBlock::WIDTH;
+      uint32_t id = 0;
+      if (!sphere_blocks.intersect(offset, n_blocks, r, t_min, t_max, &id)) {
+        return false;
+      }
+      *closest = {.hit = {.t = *t_max, .u = 0.0f, .v = 0.0f},
+                  .id = id,
+                  .kind = kind};
+      return true;
+    }
+
+    const auto n_blocks = (count + TriangleBlock::WIDTH - 1) /
+                          TriangleBlock::WIDTH;
+    bool found = false;
+    for (size_t i = offset; i < offset + n_blocks; ++i) {
+      const auto result = intersect_triangle_block(blocks[i], r, t_min, *t_max);
+      if (result.lane >= 0) {
+        found = true;
+        *t_max = result.t;
+        *closest = {.hit = {.t = result.t, .u = 0.0f, .v = 0.0f},
+                    .id = static_cast<uint32_t>(
+                        i * TriangleBlock::WIDTH +
+                        static_cast<size_t>(result.lane)),
+                    .kind = kind};
+      }
+    }
+    return found;
+  }
+
+  /**
+   * Check whether the ray hits any of the `count` objects of a leaf between
+   * `t_min` and `t_max`. Returns as soon as one hit is found
+   */
+  [[nodiscard]] bool occluded(const uint32_t offset, const size_t count,
+                              const LeafKind kind, const Ray &r,
+                              const float t_min, const float t_max) const {
+    if (kind == LeafKind::Entries) {
+      return occluded_entries(offset, count, r, t_min, t_max);
+    }
+
+    if (kind == LeafKind::Spheres) {
+      const auto n_blocks =
+          (count + SphereBlock::WIDTH - 1) / SphereBlock::WIDTH;
+      return sphere_blocks.occluded(offset, n_blocks, r, t_min, t_max);
+    }
+
+    const auto n_blocks = (count + TriangleBlock::WIDTH - 1) /
+                          TriangleBlock::WIDTH;
+    for (size_t i = offset; i < offset + n_blocks; ++i) {
+      if (intersect_triangle_block(blocks[i], r, t_min, t_max).lane >= 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Compute the full hit (point, normal, and material) of the closest hit
+   * found by `intersect`
+   */
+  [[nodiscard]] Hit surface(const Ray &r, const LeafHit &closest) const;
+};
+
+/**
+ * A reference to one of the objects being built into the BVH. The bounds and
+ * centroid of each object are computed once before the build starts, and the
+ * builder partitions these refs in place rather than copying the objects into
+ * a new vector for every level of the tree
+ */
+struct BVHBuildRef {
+  AABB bounds;
+  Vec3 centroid;
+  uint32_t index; // index of the object in the vector given to the builder
+};
+
+/**
+ * Partition the refs around the median centroid along the axis where the
+ * objects are the most spread out. Returns the number of refs in the first
+ * half
+ */
+size_t partition_middle(std::span<BVHBuildRef> refs, size_t *split_axis);
+
+/**
+ * A bucket of the binned SAH builder. Each bucket tracks how many object
+ * centroids fall into its slice of the bounds being binned and the box
+ * enclosing those objects
+ */
+struct SAHBucket {
+  size_t count = 0;
+  AABB bounds = AABB::empty();
+};
+
+/**
+ * The best SAH object split found for a set of refs. The refs whose centroids
+ * fall into buckets up to and including `bucket` along `axis` go to the left
+ * child. `cost` is infinite when no split can separate the refs
+ */
+struct SAHSplit {
+  float cost;
+  size_t axis = 0;
+  size_t bucket = 0;
+  AABB centroid_bounds;
+  AABB left_bounds;
+  AABB right_bounds;
+};
+
+/**
+ * Find the cheapest binned SAH object split of the refs
+ */
+[[nodiscard]] SAHSplit find_sah_split(std::span<const BVHBuildRef> refs,
+                                      const BVHOptions &opts);
+
+/**
+ * Partition the refs according to a split from `find_sah_split`. Returns the
+ * number of refs in the first half
+ */
+size_t apply_sah_split(std::span<BVHBuildRef> refs, const SAHSplit &split,
+                       const BVHOptions &opts);
+
+/**
+ * Partition the refs using the binned Surface Area Heuristic. Returns the
+ * number of refs in the first half, or `refs.size()` if the refs should not
+ * be split
+ */
+size_t partition_sah(std::span<BVHBuildRef> refs, const BVHOptions &opts,
+                     size_t *split_axis);
+
 class BVH {
 private:
+  friend class LBVHBuilder;
+  friend class SBVHBuilder;
+
   NodeType type;
   AABB bbox;
   BVHData data = {};
 
+  // The axis along which the objects were split for internal nodes
+  size_t axis = 0;
+
   /**
-   * Construct a BVH with the given node type, bbox, and child nodes
+   * Construct a BVH with the given node type, bbox, child nodes, and the axis
+   * the children were split along
    */
   [[nodiscard]] BVH(const NodeType type, const AABB &bbox,
-                    const BVHPair children);
+                    const BVHPair children, size_t axis);
 
   /**
-   * Construct a BVH with the given node type, bbox, and object leaf node
+   * Construct a BVH with the given node type, bbox, and leaf node objects
    */
-  [[nodiscard]] BVH(const NodeType type, const AABB &bbox, const Object &obj);
+  [[nodiscard]] BVH(const NodeType type, const AABB &bbox,
+                    const std::vector<Object> &objs);
+
+  /**
+   * Recursively build the subtree for the given range of refs, spreading the
+   * work over up to `threads` threads. The number of nodes created is added
+   * to `total_nodes`
+   */
+  [[nodiscard]] static BVH build_range(std::span<BVHBuildRef> refs,
+                                       const std::vector<Object> &objs,
+                                       const BVHOptions &opts, size_t threads,
+                                       size_t *total_nodes);
 
 public:
   /**
-   * Construct a BVH from the given vector of objects
+   * Construct a BVH from the given vector of objects, using
+   * `opts.build_threads` threads
    */
   [[nodiscard]] static BVH build_bvh(std::vector<Object> &objs,
-                                     size_t *total_nodes);
+                                     size_t *total_nodes,
+                                     const BVHOptions &opts = {});
 
   /**
    * Test if a ray intersects the BVH
@@ -68,38 +578,545 @@ public:
    */
   [[nodiscard]] NodeType node_type() const { return this->type; }
 
+  /**
+   * Get the axis the children of this node were split along
+   */
+  [[nodiscard]] size_t split_axis() const { return this->axis; }
+
   /**
    * Get the node data
    */
   [[nodiscard]] BVHData const &get_data() const { return this->data; }
 };
 
-class FlatBVH {
-  struct FlatBVHNode {
-    NodeType type;
+/**
+ * Build a BVH over the given refs with the linear BVH builder. The refs are
+ * sorted by the Morton codes of their centroids and split into treelets on
+ * the high bits of the codes, which are emitted in parallel by splitting on
+ * successive bits. The treelets are then joined using the SAH, which recovers
+ * most of the quality of a full SAH build at the top of the tree where it
+ * matters the most.
+ *
+ * https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies#LinearBoundingVolumeHierarchies
+ */
+[[nodiscard]] BVH build_lbvh(std::span<BVHBuildRef> refs,
+                             const std::vector<Object> &objs,
+                             const BVHOptions &opts, size_t *total_nodes);
+
+/**
+ * Build a BVH over the given refs with the spatial split builder. At every
+ * node the best SAH object split is compared against the best spatial split,
+ * which bins the clipped pieces of the objects rather than their centroids.
+ * References to objects straddling a spatial split are clipped and sent to
+ * both children, which keeps large objects from inflating the bounds of
+ * every node they touch. Spatial splits are only tried while the children of
+ * the object split overlap and the duplication budget isn't used up.
+ *
+ * https://www.nvidia.com/docs/IO/77714/sbvh.pdf
+ */
+[[nodiscard]] BVH build_sbvh(std::span<const BVHBuildRef> refs,
+                             const std::vector<Object> &objs,
+                             const BVHOptions &opts, size_t *total_nodes);
+
+/**
+ * An allocator that starts every allocation on a cache line, so that the
+ * layout of the nodes within the cache lines is under our control
+ */
+template <typename T> struct CacheLineAllocator {
+  using value_type = T;
+  static constexpr std::align_val_t ALIGNMENT{64};
+
+  CacheLineAllocator() = default;
+  template <typename U>
+  constexpr CacheLineAllocator(
+      const CacheLineAllocator<U> & /*unused*/) noexcept {}
+
+  [[nodiscard]] T *allocate(const size_t n) {
+    return static_cast<T *>(::operator new(n * sizeof(T), ALIGNMENT));
+  }
+
+  void deallocate(T *p, const size_t /*unused*/) noexcept {
+    ::operator delete(p, ALIGNMENT);
+  }
+
+  friend bool operator==(const CacheLineAllocator & /*unused*/,
+                         const CacheLineAllocator & /*unused*/) {
+    return true;
+  }
+};
+
+/**
+ * Statistics about the quality of a built binary BVH, for comparing the
+ * builders and explaining differences in traversal performance between
+ * scenes. The SAH cost and the sibling overlap are both relative to the
+ * surface area of the root, so they don't depend on the size of the scene
+ */
+struct BVHStats {
+  size_t internal_nodes = 0;
+  size_t leaves = 0;
+
+  // the depth of the root is zero. the average is over the leaves
+  size_t max_depth = 0;
+  double average_depth = 0.0;
+
+  // the number of leaves holding each number of objects
+  std::vector<size_t> leaf_sizes;
+
+  // the cost of the tree estimated with the same cost model as the builders
+  double sah_cost = 0.0;
+
+  // the total surface area of the overlap between the bounds of siblings.
+  // a ray passing through the overlap has to visit both of them
+  double sibling_overlap = 0.0;
+
+  AcceleratorMemory memory;
+
+  /**
+   * Print the statistics, one per line
+   */
+  void print(std::ostream &out) const;
+};
+
+class FlatBVH : public Accelerator {
+  /**
+   * A node of the flattened BVH, packed into 32 bytes so that two nodes fit
+   * exactly in one cache line. The two children of an internal node are
+   * stored next to each other starting at an even index, so they share a
+   * cache line and whichever child is visited first brings in the other one.
+   * The root is on its own, followed by an unused node. Leaves don't store
+   * their objects inline, they reference a contiguous range of the `objects`
+   * array instead
+   */
+  struct alignas(32) FlatBVHNode {
     AABB bbox;
-    std::variant<size_t, Object> data;
-    size_t secondChildOffset;
+    union {
+      uint32_t objectsOffset; // leaf: index of the first object
+      uint32_t childOffset;   // internal: index of the first child
+    };
+    uint16_t nObjects; // zero for internal nodes
+    uint8_t axis;      // split axis for internal nodes
+    uint8_t kind;      // leaf: the BVHLeaves::LeafKind of its objects
+  };
+  static_assert(sizeof(FlatBVHNode) == 32);
+
+  // the number of pairs of children in one treelet, 4 KiB of nodes. the node
+  // storage is only aligned to a cache line, so treelets don't line up with
+  // the pages and most of them straddle two
+  static constexpr size_t TREELET_PAIRS = 4096 / (2 * sizeof(FlatBVHNode));
+
+  // the depth of the stack of the stack-based traversal
+  static constexpr size_t STACK_SIZE = 64;
+
+  // bumped whenever the layout of the cache files changes, see `save`
+  static constexpr uint32_t CACHE_VERSION = 1;
+
+  /**
+   * The start of a cache file. The nodes follow the header, and then the
+   * object indices the leaves refer to
+   */
+  struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size;
+    uint64_t n_objects;
+    uint64_t n_nodes;
+    uint64_t n_refs;
   };
 
-  std::vector<FlatBVHNode> nodes;
+  std::vector<FlatBVHNode, CacheLineAllocator<FlatBVHNode>> nodes;
+  BVHLeaves leaves;
+
+  // kept for rebuilding subtrees while refitting
+  BVHOptions opts;
+
+  // the parent of each pair of siblings, indexed by the index of the first
+  // sibling divided by two. only used by the stackless traversal
+  std::vector<uint32_t> parents;
+
+  // whether the rays use the stackless traversal, see `Traversal`
+  bool stackless = false;
+
+  // the relative SAH cost of each subtree when it was built, see
+  // `update_costs`
+  std::vector<float> built_cost;
+
+  /**
+   * Copy a node of the binary BVH to the given index, adding its objects to
+   * the leaf storage if it is a leaf. The children of internal nodes are
+   * linked up by the layout functions
+   */
+  void store_node(const BVH &node, uint32_t index);
+
+  /**
+   * Store the descendants of the given node, which is already stored at
+   * `index`, starting at `*next` in the layout selected by the options
+   */
+  void layout(const BVH &root, uint32_t index, uint32_t *next);
+
+  /**
+   * Store the children of the given node at `*next` and then recursively lay
+   * out their subtrees, depth first
+   */
+  void layout_depth_first(const BVH &node, uint32_t index, uint32_t *next);
+
+  /**
+   * Store the descendants of the given node in treelets, runs of up to
+   * `TREELET_PAIRS` consecutive pairs of siblings. Each treelet is grown from
+   * its root by repeatedly storing the children of the node with the largest
+   * surface area, since a ray is the most likely to pass through the largest
+   * boxes. The nodes left over when a treelet is full become the roots of the
+   * next treelets
+   */
+  void layout_treelets(const BVH &root, uint32_t index, uint32_t *next);
+
+  /**
+   * Compute the relative SAH cost of the subtree at `index` and all of its
+   * subtrees, optionally refitting their bounds first. The relative cost is
+   * the SAH cost of the subtree divided by its own surface area, so it
+   * doesn't change when the subtree only moves, but it grows as the boxes
+   * in the subtree get larger and overlap more. The costs always come from
+   * the bounds of the objects in the leaves rather than the stored bounds,
+   * so a tree with clipped leaves costs the same before and after a refit
+   * that moved nothing. Sets `*bounds` to the bounds of the subtree and
+   * returns its SAH cost without the division
+   */
+  float update_costs(uint32_t index, bool refit_bounds,
+                     std::vector<float> *cost, AABB *bounds);
+
+  /**
+   * Record the relative SAH cost of the subtree at `index` and all of its
+   * subtrees as they are built, for `refit` to compare against later
+   */
+  void update_built_costs(uint32_t index);
+
+  /**
+   * Rebuild the subtrees below `index` whose relative SAH cost grew by more
+   * than `threshold` times since they were built. Returns the number of
+   * subtrees rebuilt
+   */
+  size_t rebuild_degraded(uint32_t index, float threshold,
+                          const std::vector<float> &cost);
+
+  /**
+   * Rebuild the subtree at `index` from scratch over the objects in its
+   * leaves. The new subtree root replaces the old one, and its descendants
+   * are added at the end of the nodes
+   */
+  void rebuild_subtree(uint32_t index);
+
+  /**
+   * Append the objects of every leaf below `index` to `objs`
+   */
+  void collect_objects(uint32_t index, std::vector<Object> *objs) const;
+
+  /**
+   * Fill in the parent links of the nodes, and pick the traversal for the
+   * tree. This has to be called whenever the shape of the tree changes
+   */
+  void update_links();
+
+  /**
+   * Walk the tree without a stack, calling `leaf` with every leaf node whose
+   * bounds are hit before `*t_max`. The walk stops early if `leaf` returns
+   * true. `leaf` may shrink `*t_max` to cull the rest of the tree
+   */
+  template <typename Leaf>
+  void traverse_stackless(const Ray &r, float t_min, const float *t_max,
+                          const Leaf &leaf) const;
+
+  /**
+   * Closest hit traversal, calling `visit` with the index of every node
+   * whose bounds are tested
+   */
+  template <typename Visit>
+  [[nodiscard]] std::optional<Hit> traverse(const Ray &r, float t_min,
+                                            float t_max,
+                                            const Visit &visit) const;
+
+  /**
+   * Add the subtree at `index`, which is `depth` levels below the root, to
+   * the statistics. The surface areas are summed as they are, and only
+   * divided by the area of the root at the end
+   */
+  void add_stats(uint32_t index, size_t depth, BVHStats *stats) const;
+
+  /**
+   * Write the subtree at `index` as a JSON object
+   */
+  void write_json(uint32_t index, std::ostream &out) const;
 
   /**
-   * Recursively flatten the given BVH into a FlatBVH
+   * An empty BVH for `load` to fill in
    */
-  size_t recursive_flatten(const BVH &node, size_t *offset);
+  explicit FlatBVH(const BVHOptions &_opts) : opts(_opts) {}
+
+  /**
+   * Fill in the nodes and leaves of an empty BVH from the contents of a cache
+   * file. Everything read from the file is checked before it's used, so a
+   * corrupted file can't make the traversal go out of bounds. Returns false
+   * if the file isn't a valid cache for the objects
+   */
+  bool read_cache(std::span<const std::byte> file,
+                  const std::vector<Object> &objs);
 
 public:
   /**
    * Construct a new FlatBVH from the given scene objects
    */
-  [[nodiscard]] explicit FlatBVH(std::vector<Object> &objs);
+  [[nodiscard]] explicit FlatBVH(std::vector<Object> &objs,
+                                 const BVHOptions &opts = {});
 
   /**
    * Test if a ray intersects the BVH
    */
   [[nodiscard]] std::optional<Hit> intersect(const Ray &r, float t_min,
-                                             float t_max) const;
+                                             float t_max) const override;
+
+  /**
+   * Test if a ray hits anything in the BVH between `t_min` and `t_max`
+   */
+  [[nodiscard]] bool occluded(const Ray &r, float t_min,
+                              float t_max) const override;
+
+  /**
+   * Same as `intersect`, but also appends the index of every node whose
+   * bounds are tested to `visited`, in order. This is for measuring the
+   * memory access pattern of the traversal, not for rendering
+   */
+  [[nodiscard]] std::optional<Hit> trace(const Ray &r, float t_min,
+                                         float t_max,
+                                         std::vector<uint32_t> *visited) const;
+
+  /**
+   * Update the BVH after the primitives it was built over have moved, by
+   * copying the primitives into the leaves again and recomputing the bounds
+   * of every node bottom-up, which is linear in the size of the tree. The
+   * topology of the tree stays the same, so its quality degrades as the
+   * primitives move further from where they were when it was built. With a
+   * non-zero `rebuild_threshold`, the largest subtrees whose relative SAH
+   * cost grew by more than that factor are rebuilt from scratch. The nodes
+   * and leaves of the replaced subtrees are not reclaimed until the whole
+   * BVH is rebuilt. Returns the number of subtrees rebuilt
+   */
+  size_t refit(float rebuild_threshold = 0.0f);
+
+  /**
+   * Compute statistics about the quality of the BVH. Only the nodes that are
+   * still part of the tree are counted, see `refit`
+   */
+  [[nodiscard]] BVHStats stats() const;
+
+  /**
+   * Write the tree to `out` as JSON. Each node is an object with its
+   * `bounds`, and either its two `children` or the number of `objects` in
+   * the leaf and how they are stored (`kind`)
+   */
+  void dump_json(std::ostream &out) const;
+
+  /**
+   * Write the BVH to a cache file at `path`. The file stores the nodes as they
+   * are, but the leaves only store the indices of their objects in `objs`,
+   * which must be the objects in the order they were given to the
+   * constructor (before it reordered them). That keeps the file free of
+   * pointers, and lets the materials of the objects change without
+   * invalidating it
+   */
+  void save(const std::string &path, const std::vector<Object> &objs) const;
+
+  /**
+   * Load a BVH written by `save` over the same objects, in the same order.
+   * The file is memory-mapped and the nodes are copied straight out of it,
+   * so only the leaves have to be filled in again. Returns nullptr if the
+   * file doesn't exist, or doesn't match the objects or this version of the
+   * cache
+   */
+  [[nodiscard]] static std::unique_ptr<FlatBVH>
+  load(const std::string &path, const std::vector<Object> &objs,
+       const BVHOptions &opts);
+
+  /**
+   * Get the memory used by the nodes and leaves of the BVH
+   */
+  [[nodiscard]] AcceleratorMemory memory() const override;
+};
+
+/**
+ * The bounds of the eight children of a node of the wide BVH, one register
+ * per plane
+ */
+struct WideBounds {
+  __m256 min_x;
+  __m256 min_y;
+  __m256 min_z;
+  __m256 max_x;
+  __m256 max_y;
+  __m256 max_z;
+};
+
+/**
+ * An 8-wide BVH, built by collapsing the binary BVH so that each node has up
+ * to eight children. The bounds of all eight children are stored in
+ * structure-of-arrays form, which lets a single AVX slab test check the ray
+ * against every child of a node at once. Compared to the binary tree this
+ * makes the tree roughly three times shallower, and every node visit does
+ * eight box tests worth of useful work. The nodes can be stored with full
+ * precision bounds or with compressed 8-bit bounds, see `NodeFormat`
+ */
+class WideBVH : public Accelerator {
+public:
+  static constexpr size_t WIDTH = 8;
+
+private:
+  /**
+   * A child of a wide node while it is being built, before it is stored in
+   * one of the node formats
+   */
+  struct WideChild {
+    AABB bounds;
+    uint32_t offset;
+    uint16_t count;
+    BVHLeaves::LeafKind kind;
+  };
+
+  /**
+   * A node of the wide BVH. Child `i` is a leaf when `nObjects[i]` is
+   * non-zero, in which case `offset[i]` and `kind[i]` locate its objects in
+   * the leaf storage. Otherwise `offset[i]` is the index of the
+   * child node. Unused child slots have inverted infinite bounds so that they
+   * are never hit
+   */
+  struct alignas(32) WideBVHNode {
+    float min_x[WIDTH];
+    float min_y[WIDTH];
+    float min_z[WIDTH];
+    float max_x[WIDTH];
+    float max_y[WIDTH];
+    float max_z[WIDTH];
+    uint32_t offset[WIDTH];
+    uint16_t nObjects[WIDTH];
+    uint8_t kind[WIDTH];
+
+    // the accessors shared with the compressed nodes by the traversal
+    [[nodiscard]] WideBounds bounds() const;
+    [[nodiscard]] uint32_t child_offset(uint32_t child) const;
+    [[nodiscard]] uint32_t count(uint32_t child) const;
+    [[nodiscard]] BVHLeaves::LeafKind leaf_kind(uint32_t child) const;
+  };
+
+  /**
+   * A node of the wide BVH with the bounds of its children quantized to 8
+   * bits, which packs it into 88 bytes instead of 256. Along each axis, the
+   * bounds of the children are `origin + q * 2^exponent`. The scale is a
+   * power of two so the bounds decode exactly, and the quantized values are
+   * rounded outwards so the decoded boxes always contain the real ones.
+   *
+   * There is no room for an offset per child. Instead the internal children
+   * of a node are stored next to each other in slot order starting at
+   * `child_base`, and the leaves of all of the children of a node are added
+   * to the leaf storage together, so the leaf of a child starts at the base
+   * for its kind plus the size of the leaves of the same kind before it.
+   * `meta` holds the kind of a leaf in its top two bits and the number of
+   * objects in the rest. It is zero for internal children and unused slots,
+   * which are always at the end and have inverted bounds
+   */
+  struct alignas(8) CompressedWideBVHNode {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t unused;
+    uint32_t child_base;
+    uint32_t leaf_base[3];
+    uint8_t q_min_x[WIDTH];
+    uint8_t q_min_y[WIDTH];
+    uint8_t q_min_z[WIDTH];
+    uint8_t q_max_x[WIDTH];
+    uint8_t q_max_y[WIDTH];
+    uint8_t q_max_z[WIDTH];
+    uint8_t meta[WIDTH];
+
+    static constexpr uint32_t COUNT_BITS = 6;
+    static constexpr uint32_t MAX_COUNT = (1u << COUNT_BITS) - 1;
+
+    // decoding the bounds and offsets costs a few extra instructions per
+    // visit compared to the full nodes
+    [[nodiscard]] WideBounds bounds() const;
+    [[nodiscard]] uint32_t child_offset(uint32_t child) const;
+    [[nodiscard]] uint32_t count(uint32_t child) const;
+    [[nodiscard]] BVHLeaves::LeafKind leaf_kind(uint32_t child) const;
+  };
+  static_assert(sizeof(CompressedWideBVHNode) == 88);
+
+  // only the vector for the format the tree was built with is used
+  NodeFormat format;
+  std::vector<WideBVHNode> nodes;
+  std::vector<CompressedWideBVHNode> compressed_nodes;
+  BVHLeaves leaves;
+
+  // the number of nodes on the longest path down from the root. the
+  // traversal stacks hold at most `WIDTH - 1` entries per level of the tree
+  size_t max_depth = 0;
+
+  // the capacity of the traversal stacks kept on the call stack. deeper trees
+  // get their stacks from the heap
+  static constexpr size_t STACK_SIZE = 64 * (WIDTH - 1);
+
+  /**
+   * Add `count` new nodes to the end of the nodes of the tree, returning the
+   * index of the first one
+   */
+  uint32_t allocate_nodes(size_t count);
+
+  /**
+   * Recursively collapse the children of the given binary BVH node into the
+   * wide node at `index`. The leaves of the children are added to the leaf
+   * storage and their internal children are allocated next to each other
+   * before recursing, which is the layout the compressed nodes rely on.
+   * `depth` is the level of the new node, starting from one at the root
+   */
+  void recursive_collapse(const BVH &node, uint32_t index, size_t depth);
+
+  /**
+   * Write the children of the node at `index` in the format of the tree
+   */
+  void store_node(uint32_t index, std::span<const WideChild> children);
+
+  /**
+   * Closest hit traversal of the nodes of either format
+   */
+  template <typename Node>
+  [[nodiscard]] std::optional<Hit> intersect_nodes(const std::vector<Node> &ns,
+                                                   const Ray &r, float t_min,
+                                                   float t_max) const;
+
+  /**
+   * Any hit traversal of the nodes of either format
+   */
+  template <typename Node>
+  [[nodiscard]] bool occluded_nodes(const std::vector<Node> &ns, const Ray &r,
+                                    float t_min, float t_max) const;
+
+public:
+  /**
+   * Construct a new WideBVH from the given scene objects
+   */
+  [[nodiscard]] explicit WideBVH(std::vector<Object> &objs,
+                                 const BVHOptions &opts = {});
+
+  /**
+   * Test if a ray intersects the BVH
+   */
+  [[nodiscard]] std::optional<Hit> intersect(const Ray &r, float t_min,
+                                             float t_max) const override;
+
+  /**
+   * Test if a ray hits anything in the BVH between `t_min` and `t_max`
+   */
+  [[nodiscard]] bool occluded(const Ray &r, float t_min,
+                              float t_max) const override;
+
+  /**
+   * Get the memory used by the nodes and leaves of the BVH
+   */
+  [[nodiscard]] AcceleratorMemory memory() const override;
 };
 
 } // namespace ronald
@@ -29,11 +29,14 @@ namespace ronald {
 using material_map = std::unordered_map<std::string, std::shared_ptr<Material>>;
 
 /**
- * An object is a primitive with an associated material
+ * An object is a primitive with an associated material. Objects don't own
+ * their primitive or material (both are owned by the scene), so copying an
+ * object around during BVH traversal never touches a reference count shared
+ * between the render threads
  */
 struct Object {
-  std::shared_ptr<Primitive> primitive;
-  std::shared_ptr<Material> material;
+  const Primitive *primitive;
+  const Material *material;
 };
 
 /**
@@ -41,7 +44,7 @@ struct Object {
  */
 struct Hit {
   Intersection hit;
-  std::shared_ptr<Material> material;
+  const Material *material;
 };
 
 /**
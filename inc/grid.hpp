@@ -0,0 +1,155 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef GRID_H
+#define GRID_H
+
+#include "accelerator.hpp"
+#include "bvh.hpp"
+#include "common.hpp"
+
+#include <array>
+#include <vector>
+
+namespace ronald {
+
+/**
+ * A uniform grid over the objects of a scene. The bounds of the scene are
+ * divided into equally sized cells, and each cell stores every object whose
+ * bounds overlap it, so an object spanning several cells is stored in each
+ * of them. The grid is built in linear time by counting the objects in each
+ * cell and then filling the cells in, with no sorting or splitting.
+ *
+ * Rays step from cell to cell in the order they pass through them with a 3D
+ * digital differential analyzer (3D-DDA), which only takes a comparison and
+ * an addition per cell. The closest hit search stops at the first cell that
+ * contains a hit, since no object in a later cell can be hit any closer.
+ * Like the BVHs, the objects of each cell are stored in a `BVHLeaves`, so
+ * cells of triangles or spheres are intersected eight at a time.
+ *
+ * http://www.cse.yorku.ca/~amana/research/grid.pdf
+ */
+class Grid : public Accelerator {
+public:
+  // the largest number of cells along any one axis
+  static constexpr size_t MAX_RESOLUTION = 512;
+
+private:
+  /**
+   * A cell of the grid. `offset` and `kind` locate the objects of the cell
+   * in the leaf storage. Empty cells have a `count` of zero
+   */
+  struct GridCell {
+    uint32_t offset;
+    uint32_t count;
+    BVHLeaves::LeafKind kind;
+  };
+
+  AABB bounds;
+  std::array<size_t, 3> resolution = {0, 0, 0};
+  Vec3 cell_size;
+  Vec3 inv_cell_size;
+
+  // the cells in x-major order: the index of cell (x, y, z) is
+  // x + resolution[0] * (y + resolution[1] * z)
+  std::vector<GridCell> cells;
+  BVHLeaves leaves;
+
+  /**
+   * Construct an empty grid, to be sized with `fit`
+   */
+  Grid() : bounds(AABB::empty()) {}
+
+  /**
+   * Fit the bounds of the grid around the objects and pick the number of
+   * cells along each axis, with `density` cells per object. Returns the
+   * bounds of each object
+   */
+  std::vector<AABB> fit(const std::vector<Object> &objs, float density);
+
+  /**
+   * Call `f` with the index of every cell the given bounds overlap
+   */
+  template <typename F> void for_each_cell(const AABB &b, const F &f) const;
+
+  /**
+   * Count the objects overlapping each cell. Returns the total of the counts
+   * of the cells before each one, followed by the total over all cells
+   */
+  [[nodiscard]] std::vector<size_t>
+  cell_starts(const std::vector<AABB> &obj_bounds) const;
+
+  /**
+   * Get the index of the cell along `axis` that contains the given
+   * coordinate. Coordinates outside of the grid are clamped to the cells on
+   * its boundary
+   */
+  [[nodiscard]] size_t cell_coord(float pos, size_t axis) const;
+
+  /**
+   * Walk the cells the ray passes through between `t_min` and `*t_max` in
+   * order, calling `cell` with every non-empty one. The walk stops early if
+   * `cell` returns true. `cell` may shrink `*t_max`, which ends the walk as
+   * soon as the ray leaves the cell it is in
+   */
+  template <typename Cell>
+  void traverse(const Ray &r, float t_min, const float *t_max,
+                const Cell &cell) const;
+
+public:
+  /**
+   * Construct a new Grid from the given scene objects, with
+   * `opts.grid_density` cells per object
+   */
+  [[nodiscard]] explicit Grid(const std::vector<Object> &objs,
+                              const BVHOptions &opts = {});
+
+  /**
+   * Get the mean number of objects in the non-empty cells of the grid that
+   * would be built over the given objects, without building it. This only
+   * takes the counting pass of the build
+   */
+  [[nodiscard]] static double mean_occupancy(const std::vector<Object> &objs,
+                                             const BVHOptions &opts = {});
+
+  /**
+   * Test if a ray intersects the grid
+   */
+  [[nodiscard]] std::optional<Hit> intersect(const Ray &r, float t_min,
+                                             float t_max) const override;
+
+  /**
+   * Test if a ray hits anything in the grid between `t_min` and `t_max`
+   */
+  [[nodiscard]] bool occluded(const Ray &r, float t_min,
+                              float t_max) const override;
+
+  /**
+   * Get the number of cells along each axis
+   */
+  [[nodiscard]] const std::array<size_t, 3> &dimensions() const {
+    return resolution;
+  }
+
+  /**
+   * Get the memory used by the cells and the objects stored in them
+   */
+  [[nodiscard]] AcceleratorMemory memory() const override;
+};
+
+} // namespace ronald
+
+#endif // GRID_H
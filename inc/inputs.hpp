@@ -35,6 +35,32 @@ public:
   size_t samples = 0;
   size_t threads = 0;
 
+  // Accelerator override. Empty if the scene description should decide
+  std::string accelerator;
+
+  // BVH split method override. Empty if the scene description should decide
+  std::string bvh_split;
+
+  // BVH width override. Zero if the scene description should decide
+  size_t bvh_width = 0;
+
+  // BVH node format override. Empty if the scene description should decide
+  std::string bvh_nodes;
+
+  // Directory the built BVH is cached in. Empty if it shouldn't be cached
+  std::string bvh_cache;
+
+  // Print statistics about the BVH instead of rendering. The statistics are
+  // for the 2-wide BVH, so this also sets the accelerator and the BVH width
+  bool bvh_stats = false;
+
+  // File to write the BVH to as JSON along with the statistics. Empty if the
+  // BVH shouldn't be written
+  std::string bvh_dump;
+
+  // Ray/triangle test override. Empty if the scene description should decide
+  std::string triangle_test;
+
   Config() = default;
 
   /**
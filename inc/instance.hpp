@@ -0,0 +1,132 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "accelerator.hpp"
+#include "bvh.hpp"
+#include "common.hpp"
+#include "primitive.hpp"
+#include "transform.hpp"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace ronald {
+
+/**
+ * Geometry that is shared between any number of instances. The prototype
+ * owns its primitives (and meshes) and the BVH built over them in its own
+ * object space, so the memory used by a scene grows with the amount of
+ * unique geometry rather than with the number of copies placed in it. The
+ * objects of a prototype have no material, the material of each instance
+ * comes from the scene object the instance belongs to
+ */
+class Prototype {
+  std::vector<std::shared_ptr<Primitive>> primitives;
+  std::vector<std::shared_ptr<TriangleMesh>> meshes;
+  std::vector<Object> objects;
+  std::unique_ptr<Accelerator> bvh;
+  AABB bounds;
+
+public:
+  /**
+   * Build the BVH of a prototype over the given objects, which must point
+   * into `primitives_a` or the triangles of `meshes_a`
+   */
+  [[nodiscard]] Prototype(
+      std::vector<std::shared_ptr<Primitive>> primitives_a,
+      std::vector<std::shared_ptr<TriangleMesh>> meshes_a,
+      std::vector<Object> objects_a, const BVHOptions &opts);
+
+  /**
+   * Find the closest hit between the ray and the prototype's geometry, with
+   * everything in the prototype's object space
+   */
+  [[nodiscard]] std::optional<Hit> intersect(const Ray &r, const float t_min,
+                                             const float t_max) const {
+    return bvh->intersect(r, t_min, t_max);
+  }
+
+  /**
+   * Check whether the ray hits any of the prototype's geometry, in the
+   * prototype's object space
+   */
+  [[nodiscard]] bool occluded(const Ray &r, const float t_min,
+                              const float t_max) const {
+    return bvh->occluded(r, t_min, t_max);
+  }
+
+  /**
+   * Get the bounds of the prototype's geometry in its object space
+   */
+  [[nodiscard]] const AABB &aabb() const { return bounds; }
+
+  /**
+   * Get the number of objects in the prototype
+   */
+  [[nodiscard]] size_t size() const { return objects.size(); }
+};
+
+/**
+ * A copy of a prototype placed in the scene by an affine transform. Rays are
+ * moved into the prototype's object space and traced through its BVH, so
+ * the BVH of the scene only has to store one object per instance. This makes
+ * the scene BVH the top level of a two-level structure, with the prototypes'
+ * BVHs as the bottom level
+ */
+class Instance final : public Primitive {
+  const Prototype *prototype;
+  Transform to_world;
+  Transform to_object;
+
+public:
+  /**
+   * Place the prototype in the scene with the given object-to-world
+   * transform. The prototype must outlive the instance
+   */
+  [[nodiscard]] Instance(const Prototype *prototype_a,
+                         const Transform &to_world_a);
+
+  /**
+   * The normal of the hit in object space is carried to `surface` in `u` and
+   * `v`, see `octahedral_encode`, so that the prototype doesn't have to be
+   * traced a second time to find it
+   */
+  [[nodiscard]] std::optional<PrimitiveHit>
+  intersect(const Ray &r, float t_min, float t_max) const override;
+  [[nodiscard]] Intersection surface(const Ray &r,
+                                     const PrimitiveHit &h) const override;
+  [[nodiscard]] bool occluded(const Ray &r, float t_min,
+                              float t_max) const override;
+  [[nodiscard]] virtual AABB aabb() const override;
+};
+
+using prototype_map =
+    std::unordered_map<std::string, std::shared_ptr<Prototype>>;
+
+/**
+ * Read the object-to-world transform of an instance from the optional
+ * `transform` field of its JSON description, which holds the three rows of
+ * the 3x4 matrix. Instances without one are placed with the identity
+ */
+[[nodiscard]] Transform instance_transform_from_json(const object &obj);
+
+} // namespace ronald
+
+#endif // INSTANCE_H
@@ -19,6 +19,8 @@
 
 #include "vec3.hpp"
 
+#include <utility>
+
 namespace ronald {
 
 /**
@@ -39,6 +41,23 @@ namespace ronald {
  */
 [[nodiscard]] Vec3 random_on_unit_sphere();
 
+/**
+ * Encode a unit vector as a point in [-1, 1]^2 by projecting it onto the
+ * octahedron |x| + |y| + |z| = 1 and unfolding the lower half of the
+ * octahedron over the upper half. Two floats keep nearly all of the
+ * precision of the three components
+ *
+ * https://jcgt.org/published/0003/02/01/
+ */
+[[nodiscard]] std::pair<float, float> octahedral_encode(const Vec3 &n);
+
+/**
+ * Decode a vector encoded by `octahedral_encode`. The result points in the
+ * right direction but isn't normalized, since callers that transform it
+ * have to normalize it afterwards anyway
+ */
+[[nodiscard]] Vec3 octahedral_decode(float u, float v);
+
 } // namespace ronald
 
 #endif // MATH_H
@@ -22,6 +22,8 @@
 #include "vec3.hpp"
 
 #include <boost/json.hpp>
+#include <cmath>
+#include <span>
 using namespace boost::json;
 
 namespace ronald {
@@ -32,6 +34,56 @@ struct Intersection {
   float t;
 };
 
+/**
+ * A ray/primitive hit before its surface attributes have been computed.
+ * During traversal only the closest hit so far matters, so the point and
+ * normal are left for `Primitive::surface` to compute once the closest hit
+ * is known. For triangles `u` and `v` are the barycentric coordinates of the
+ * hit (the weights of the second and third vertex), other primitives leave
+ * them at zero
+ */
+struct PrimitiveHit {
+  float t;
+  float u;
+  float v;
+};
+
+/**
+ * The data needed to intersect a ray with a triangle: one vertex, the two
+ * edges leaving it, and the normal of the front face. Quads use the same
+ * data, with `parallelogram` set so the hit may lie anywhere within the two
+ * edges instead of only on the near side of the diagonal
+ */
+struct TriangleData {
+  Vec3 v0;
+  Vec3 edge1;
+  Vec3 edge2;
+  Vec3 normal;
+  bool parallelogram = false;
+};
+
+/**
+ * The data needed to intersect a ray with a sphere. The radius may be
+ * negative, which flips the normals to point inwards
+ */
+struct SphereData {
+  Vec3 center;
+  float radius;
+};
+
+/**
+ * The ray/triangle test used for the triangles in a scene. `MollerTrumbore`
+ * is the fastest, and is intersected eight triangles at a time in BVH leaves.
+ * `Watertight` never lets a ray slip through the edge shared by two
+ * triangles, at the cost of being tested one triangle at a time
+ */
+enum class TriangleTest { MollerTrumbore, Watertight };
+
+/**
+ * Parse a triangle test from its name in the scene description or the CLI
+ */
+[[nodiscard]] TriangleTest triangle_test_from_string(const std::string &str);
+
 /**
  * The primitive class represents any fundamental piece of geometry that a ray
  * may intersect. The Primitive class specifies one required method, hit, which
@@ -44,10 +96,42 @@ public:
   /**
    * Check whether the given ray intersects with the primitive at some
    * point along the ray between `t_min` and `t_max`. If the ray and primitive
-   * do not intersect, std::nullopt is returned.
+   * do not intersect, std::nullopt is returned. Only the distance along the
+   * ray (and the barycentrics for triangles) is computed, see `surface`
    */
-  [[nodiscard]] virtual std::optional<Intersection>
-  hit(const Ray &r, float t_min, float t_max) const = 0;
+  [[nodiscard]] virtual std::optional<PrimitiveHit>
+  intersect(const Ray &r, float t_min, float t_max) const = 0;
+
+  /**
+   * Compute the point and normal of a hit returned by `intersect` for the
+   * same ray
+   */
+  [[nodiscard]] virtual Intersection surface(const Ray &r,
+                                             const PrimitiveHit &h) const = 0;
+
+  /**
+   * Intersect the ray with the primitive and compute the surface of the hit
+   * right away. This is convenient when there's only one primitive to test,
+   * when searching for the closest of many hits use `intersect` instead
+   */
+  [[nodiscard]] std::optional<Intersection> hit(const Ray &r, float t_min,
+                                                float t_max) const {
+    const auto h = intersect(r, t_min, t_max);
+    if (!h.has_value()) {
+      return std::nullopt;
+    }
+    return surface(r, *h);
+  }
+
+  /**
+   * Check whether the ray hits the primitive anywhere between `t_min` and
+   * `t_max`, without caring where. Primitives that can answer this faster
+   * than finding their closest hit override it
+   */
+  [[nodiscard]] virtual bool occluded(const Ray &r, const float t_min,
+                                      const float t_max) const {
+    return intersect(r, t_min, t_max).has_value();
+  }
 
   /**
    * Fetch the AABB that encloses this primitive
@@ -55,17 +139,207 @@ public:
   [[nodiscard]] virtual AABB aabb() const = 0;
 
   /**
-   * Construct a boxed Primitive from the given JSON value.
+   * Fetch the AABB that encloses the part of this primitive inside `box`. This
+   * is used by the spatial split BVH builder, which splits the references to
+   * large primitives between several leaves. The default implementation is
+   * conservative and just clips the primitive's AABB to `box`
+   */
+  [[nodiscard]] virtual AABB clipped_aabb(const AABB &box) const;
+
+  /**
+   * Get the vertex and edges of the primitive if it is a triangle or a quad.
+   * BVH leaves made up entirely of triangles and quads pack them into blocks
+   * that are intersected eight at a time, all other primitives are
+   * intersected with `hit`
+   */
+  [[nodiscard]] virtual std::optional<TriangleData> triangle_data() const;
+
+  /**
+   * Get the center and radius of the primitive if it is a sphere. Like the
+   * triangles, BVH leaves made up entirely of spheres pack them into blocks
+   * that are intersected eight at a time
+   */
+  [[nodiscard]] virtual std::optional<SphereData> sphere_data() const;
+
+  /**
+   * Construct a boxed Primitive from the given JSON value. Triangles use the
+   * given ray/triangle test
    */
   [[nodiscard]] static const std::shared_ptr<Primitive>
-  from_json(const object &obj);
+  from_json(const object &obj,
+            TriangleTest test = TriangleTest::MollerTrumbore);
 };
 
+/**
+ * Möller–Trumbore ray intersection with the triangle (or the parallelogram,
+ * if `Parallelogram` is set) with the vertex `v0` and edges `edge1` and
+ * `edge2` leaving it. `u` and `v` are the coordinates of the hit along the
+ * edges, so the only difference between the two shapes is whether the hit
+ * has to stay below the diagonal with u + v <= 1
+ */
+template <bool Parallelogram>
+[[nodiscard]] inline std::optional<PrimitiveHit>
+intersect_moller_trumbore(const Ray &r, const Vec3 &v0, const Vec3 &edge1,
+                          const Vec3 &edge2, const float t_min,
+                          const float t_max) {
+  const auto h = r.direction().cross(edge2);
+  const auto a = edge1.dot(h);
+
+  if (a > -EPSILON && a < EPSILON) {
+    return std::nullopt;
+  }
+
+  const auto f = 1 / a;
+  const auto s = r.origin() - v0;
+  const auto u = f * s.dot(h);
+
+  // TODO: this branch might be unpredictable, should profile this
+  if (u < 0.0 || u > 1.0) {
+    return std::nullopt;
+  }
+
+  const auto q = s.cross(edge1);
+  const auto v = f * r.direction().dot(q);
+
+  // TODO: this might also be unpredictable, check it
+  if (v < 0.0 || (Parallelogram ? v : u + v) > 1.0) {
+    return std::nullopt;
+  }
+
+  const auto t = f * edge2.dot(q);
+
+  if (t > EPSILON && t > t_min && t < t_max) {
+    return {{.t = t, .u = u, .v = v}};
+  }
+
+  return std::nullopt;
+}
+
+/**
+ * Möller–Trumbore ray/triangle intersection for the triangle with the vertex
+ * `v0` and edges `edge1` and `edge2` leaving it. Returns the distance along
+ * the ray to the hit and its barycentrics, if there is one between `t_min`
+ * and `t_max`
+ */
+[[nodiscard]] inline std::optional<PrimitiveHit>
+intersect_triangle(const Ray &r, const Vec3 &v0, const Vec3 &edge1,
+                   const Vec3 &edge2, const float t_min, const float t_max) {
+  return intersect_moller_trumbore<false>(r, v0, edge1, edge2, t_min, t_max);
+}
+
+/**
+ * Watertight ray/triangle intersection for the triangle with the vertices
+ * `v0`, `v1`, and `v2`. The vertices are moved into a space where the ray
+ * points along +z, and the edge functions are evaluated there in 2D. Edges
+ * shared between triangles are evaluated identically on both sides, so a
+ * ray hitting an edge exactly always hits at least one of the triangles.
+ * Returns the distance along the ray to the hit and its barycentrics, if
+ * there is one between `t_min` and `t_max`
+ *
+ * https://jcgt.org/published/0002/01/05/
+ */
+[[nodiscard]] inline std::optional<PrimitiveHit>
+intersect_triangle_watertight(const Ray &r, const Vec3 &v0, const Vec3 &v1,
+                              const Vec3 &v2, const float t_min,
+                              const float t_max) {
+  const auto dir = r.direction();
+
+  // make the axis along which the ray direction is largest z, and swap x and
+  // y if the ray points along -z to keep the winding of the triangle
+  size_t kz = 0;
+  if (std::abs(dir.y()) > std::abs(dir[kz])) {
+    kz = 1;
+  }
+  if (std::abs(dir.z()) > std::abs(dir[kz])) {
+    kz = 2;
+  }
+  auto kx = (kz + 1) % 3;
+  auto ky = (kx + 1) % 3;
+  if (dir[kz] < 0.0f) {
+    std::swap(kx, ky);
+  }
+
+  // shear the vertices so that the ray starts at the origin and points along
+  // +z. this only depends on the ray and the vertex, so a vertex shared by
+  // two triangles ends up in exactly the same place for both of them
+  const auto sx = dir[kx] / dir[kz];
+  const auto sy = dir[ky] / dir[kz];
+  const auto sz = 1.0f / dir[kz];
+
+  const auto a = v0 - r.origin();
+  const auto b = v1 - r.origin();
+  const auto c = v2 - r.origin();
+  const auto ax = a[kx] - sx * a[kz];
+  const auto ay = a[ky] - sy * a[kz];
+  const auto bx = b[kx] - sx * b[kz];
+  const auto by = b[ky] - sy * b[kz];
+  const auto cx = c[kx] - sx * c[kz];
+  const auto cy = c[ky] - sy * c[kz];
+
+  // the edge functions are evaluated in double precision, where the products
+  // of two floats are exact. this way an edge gives the same result (with the
+  // sign flipped) for both of the triangles sharing it, no matter how the
+  // compiler decides to contract the expressions into FMAs
+  const auto edge = [](const float px, const float py, const float qx,
+                       const float qy) {
+    return static_cast<float>(static_cast<double>(px) * qy -
+                              static_cast<double>(py) * qx);
+  };
+  const auto u = edge(cx, cy, bx, by);
+  const auto v = edge(ax, ay, cx, cy);
+  const auto w = edge(bx, by, ax, ay);
+
+  // the ray misses if it's outside of any of the edges. both windings are
+  // accepted since there is no backface culling
+  if ((u < 0.0f || v < 0.0f || w < 0.0f) &&
+      (u > 0.0f || v > 0.0f || w > 0.0f)) {
+    return std::nullopt;
+  }
+
+  const auto det = u + v + w;
+  if (det == 0.0f) {
+    return std::nullopt;
+  }
+
+  // interpolate the z of the sheared vertices to get the distance to the hit
+  const auto az = sz * a[kz];
+  const auto bz = sz * b[kz];
+  const auto cz = sz * c[kz];
+  const auto t = (u * az + v * bz + w * cz) / det;
+
+  if (t > t_min && t < t_max) {
+    // `v` and `w` are the unnormalized weights of the second and third vertex
+    return {{.t = t, .u = v / det, .v = w / det}};
+  }
+
+  return std::nullopt;
+}
+
+/**
+ * Get the (padded) AABB of the triangle with the given vertices
+ */
+[[nodiscard]] AABB triangle_aabb(const Vec3 &v0, const Vec3 &v1,
+                                 const Vec3 &v2);
+
+/**
+ * Get the (padded) AABB of the part of the triangle with the given vertices
+ * that lies inside `box`
+ */
+[[nodiscard]] AABB triangle_clipped_aabb(const Vec3 &v0, const Vec3 &v1,
+                                         const Vec3 &v2, const AABB &box);
+
+/**
+ * Get the (padded) AABB of the part of the convex polygon with the given
+ * vertices (at most four of them) that lies inside `box`
+ */
+[[nodiscard]] AABB polygon_clipped_aabb(std::span<const Vec3> vertices,
+                                        const AABB &box);
+
 /**
  * Simple sphere primitive. Represented by a center point
  * and a radius
  */
-class Sphere : public Primitive {
+class Sphere final : public Primitive {
   Vec3 center;
   float radius;
 
@@ -81,9 +355,12 @@ public:
    */
   [[nodiscard]] explicit Sphere(const object &obj);
 
-  [[nodiscard]] std::optional<Intersection> hit(const Ray &r, float t_min,
-                                                float t_max) const override;
+  [[nodiscard]] std::optional<PrimitiveHit>
+  intersect(const Ray &r, float t_min, float t_max) const override;
+  [[nodiscard]] Intersection surface(const Ray &r,
+                                     const PrimitiveHit &h) const override;
   [[nodiscard]] virtual AABB aabb() const override;
+  [[nodiscard]] std::optional<SphereData> sphere_data() const override;
 };
 
 /**
@@ -91,7 +368,7 @@ public:
  * plus two edges, and is initialized using three points in 3D space plus a
  * normal vector to indicate which surface is the "front"
  */
-class Triangle : public Primitive {
+class Triangle final : public Primitive {
   Vec3 v0;
   Vec3 v1;
   Vec3 v2;
@@ -113,11 +390,391 @@ public:
    */
   [[nodiscard]] explicit Triangle(const object &obj);
 
-  [[nodiscard]] std::optional<Intersection> hit(const Ray &r, float t_min,
-                                                float t_max) const override;
+  [[nodiscard]] std::optional<PrimitiveHit>
+  intersect(const Ray &r, float t_min, float t_max) const override;
+  [[nodiscard]] Intersection surface(const Ray &r,
+                                     const PrimitiveHit &h) const override;
+  [[nodiscard]] virtual AABB aabb() const override;
+
+  /**
+   * Clip the triangle against the planes of `box` and return the bounds of
+   * the polygon that is left
+   */
+  [[nodiscard]] virtual AABB clipped_aabb(const AABB &box) const override;
+  [[nodiscard]] virtual std::optional<TriangleData>
+  triangle_data() const override;
+};
+
+/**
+ * A triangle intersected with the watertight test. Only the vertices and the
+ * normal are stored, since the test doesn't use the edges
+ */
+class WatertightTriangle final : public Primitive {
+  Vec3 v0;
+  Vec3 v1;
+  Vec3 v2;
+  Vec3 normal;
+
+public:
+  /**
+   * Construct a triangle given by three points in space and a normal, like
+   * Triangle
+   */
+  [[nodiscard]] WatertightTriangle(const Vec3 &v0_a, const Vec3 &v1_a,
+                                   const Vec3 &v2_a, float normal_a);
+
+  /**
+   * Construct a triangle from a JSON object containing the `vertices`, and
+   * `normal` fields
+   */
+  [[nodiscard]] explicit WatertightTriangle(const object &obj);
+
+  [[nodiscard]] std::optional<PrimitiveHit>
+  intersect(const Ray &r, float t_min, float t_max) const override;
+  [[nodiscard]] Intersection surface(const Ray &r,
+                                     const PrimitiveHit &h) const override;
+  [[nodiscard]] virtual AABB aabb() const override;
+  [[nodiscard]] virtual AABB clipped_aabb(const AABB &box) const override;
+};
+
+/**
+ * A parallelogram with one corner at `origin` and the edges `u` and `v`
+ * leaving it, so the opposite corner is at origin + u + v. The front face is
+ * on the side of u x v, multiplied by `normal` like for triangles. A quad
+ * replaces the two triangles that would otherwise be needed for a wall or
+ * the face of a box
+ */
+class Quad final : public Primitive {
+  Vec3 origin;
+  Vec3 u;
+  Vec3 v;
+  Vec3 normal;
+
+public:
+  /**
+   * Construct a quad from a corner, its two edges, and the sign of the
+   * normal (either 1 or -1)
+   */
+  [[nodiscard]] Quad(const Vec3 &origin_a, const Vec3 &u_a, const Vec3 &v_a,
+                     float normal_a);
+
+  /**
+   * Construct a quad from a JSON object containing the `origin`, `u`, `v`,
+   * and `normal` fields
+   */
+  [[nodiscard]] explicit Quad(const object &obj);
+
+  [[nodiscard]] std::optional<PrimitiveHit>
+  intersect(const Ray &r, float t_min, float t_max) const override;
+  [[nodiscard]] Intersection surface(const Ray &r,
+                                     const PrimitiveHit &h) const override;
+  [[nodiscard]] virtual AABB aabb() const override;
+  [[nodiscard]] virtual AABB clipped_aabb(const AABB &box) const override;
+  [[nodiscard]] virtual std::optional<TriangleData>
+  triangle_data() const override;
+};
+
+/**
+ * A solid axis-aligned box. The normals always point out of the box, even
+ * when the ray starts inside it, like for spheres
+ */
+class Box final : public Primitive {
+  Vec3 min;
+  Vec3 max;
+
+public:
+  /**
+   * Construct a box from its minimum and maximum corners
+   */
+  [[nodiscard]] Box(const Vec3 &min_a, const Vec3 &max_a);
+
+  /**
+   * Construct a box from a JSON object containing the `min` and `max` fields
+   */
+  [[nodiscard]] explicit Box(const object &obj);
+
+  [[nodiscard]] std::optional<PrimitiveHit>
+  intersect(const Ray &r, float t_min, float t_max) const override;
+  [[nodiscard]] Intersection surface(const Ray &r,
+                                     const PrimitiveHit &h) const override;
   [[nodiscard]] virtual AABB aabb() const override;
 };
 
+class TriangleMesh;
+
+/**
+ * A single triangle of a TriangleMesh. The vertices live in the mesh's shared
+ * buffers, so a mesh triangle only stores a pointer back to its mesh and its
+ * index in the mesh
+ */
+class MeshTriangle final : public Primitive {
+  const TriangleMesh *mesh;
+  uint32_t index;
+
+public:
+  /**
+   * Construct a reference to the triangle with the given index in the mesh
+   */
+  [[nodiscard]] MeshTriangle(const TriangleMesh *mesh_a, uint32_t index_a)
+      : mesh(mesh_a), index(index_a){};
+
+  [[nodiscard]] std::optional<PrimitiveHit>
+  intersect(const Ray &r, float t_min, float t_max) const override;
+  [[nodiscard]] Intersection surface(const Ray &r,
+                                     const PrimitiveHit &h) const override;
+  [[nodiscard]] virtual AABB aabb() const override;
+  [[nodiscard]] virtual AABB clipped_aabb(const AABB &box) const override;
+  [[nodiscard]] virtual std::optional<TriangleData>
+  triangle_data() const override;
+};
+
+/**
+ * A triangle mesh stored as one contiguous buffer of vertex positions plus an
+ * index buffer with three vertex indices per triangle, so vertices shared
+ * between faces are only stored once. The mesh itself isn't a primitive,
+ * instead each of its triangles is exposed to the BVH as a MeshTriangle.
+ * Like Triangle, the normal of each face is the cross product of its edges
+ * multiplied by `normal`, which should be either 1 or -1. All of the
+ * triangles of a mesh are intersected with the same triangle test
+ */
+class TriangleMesh {
+  friend class MeshTriangle;
+
+  std::vector<Vec3> positions;
+  std::vector<uint32_t> indices;
+  float normal;
+  TriangleTest test;
+  std::vector<MeshTriangle> triangles;
+
+public:
+  /**
+   * Construct a mesh from the given vertex and index buffers
+   */
+  [[nodiscard]] TriangleMesh(std::vector<Vec3> positions_a,
+                             std::vector<uint32_t> indices_a, float normal_a,
+                             TriangleTest test_a = TriangleTest::MollerTrumbore);
+
+  /**
+   * Construct a mesh from a JSON object containing the `vertices`, `indices`,
+   * and `normal` fields. `indices` is an array of triangles, each of which is
+   * an array of three indices into `vertices`
+   */
+  [[nodiscard]] explicit TriangleMesh(
+      const object &obj, TriangleTest test_a = TriangleTest::MollerTrumbore);
+
+  // the triangles point back at the mesh, so it must stay put
+  TriangleMesh(const TriangleMesh &) = delete;
+  TriangleMesh &operator=(const TriangleMesh &) = delete;
+
+  /**
+   * Get the number of triangles in the mesh
+   */
+  [[nodiscard]] size_t size() const { return triangles.size(); }
+
+  /**
+   * Get the triangle with the given index
+   */
+  [[nodiscard]] const MeshTriangle &triangle(const size_t i) const {
+    return triangles[i];
+  }
+
+  /**
+   * Get the number of vertices in the mesh
+   */
+  [[nodiscard]] size_t n_vertices() const { return positions.size(); }
+
+  /**
+   * Get the position of the vertex with the given index
+   */
+  [[nodiscard]] const Vec3 &position(const size_t i) const {
+    return positions[i];
+  }
+
+  /**
+   * Move the vertex with the given index. The triangles using the vertex
+   * move along with it, so a BVH built over them has to be refit afterwards
+   */
+  void set_position(const size_t i, const Vec3 &p) { positions.at(i) = p; }
+};
+
+/********************************************************/
+/*   Primitive intersect functions, defined inline so   */
+/*   that they can be inlined into the BVH leaf loops   */
+/********************************************************/
+
+inline std::optional<PrimitiveHit>
+Sphere::intersect(const Ray &r, const float t_min, const float t_max) const {
+  Vec3 oc = r.origin() - center;
+  const auto a = r.direction().length_squared();
+  const auto half_b = oc.dot(r.direction());
+  const auto c = oc.length_squared() - radius * radius;
+
+  const auto discriminant = half_b * half_b - a * c;
+
+  if (discriminant < 0) {
+    return std::nullopt;
+  }
+
+  const auto sqrtd = sqrtf(discriminant);
+
+  // Find the nearest root that lies in the acceptable range.
+  auto root = (-half_b - sqrtd) / a;
+  if (root < t_min || t_max < root) {
+    root = (-half_b + sqrtd) / a;
+    if (root < t_min || t_max < root) {
+      return std::nullopt;
+    }
+  }
+
+  return {{.t = root, .u = 0.0f, .v = 0.0f}};
+}
+
+inline Intersection Sphere::surface(const Ray &r,
+                                    const PrimitiveHit &h) const {
+  const auto point = r.point_at_parameter(h.t);
+  return {
+      .point = point,
+      .normal = (point - center) / radius,
+      .t = h.t,
+  };
+}
+
+/**
+ * Möller–Trumbore algorithm for triangle intersection
+ * https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
+ */
+inline std::optional<PrimitiveHit>
+Triangle::intersect(const Ray &r, const float t_min, const float t_max) const {
+  return intersect_triangle(r, v0, edge1, edge2, t_min, t_max);
+}
+
+inline Intersection Triangle::surface(const Ray &r,
+                                      const PrimitiveHit &h) const {
+  return {
+      r.origin() + r.direction() * h.t,
+      normal,
+      h.t,
+  };
+}
+
+inline std::optional<PrimitiveHit>
+WatertightTriangle::intersect(const Ray &r, const float t_min,
+                              const float t_max) const {
+  return intersect_triangle_watertight(r, v0, v1, v2, t_min, t_max);
+}
+
+inline Intersection WatertightTriangle::surface(const Ray &r,
+                                                const PrimitiveHit &h) const {
+  return {
+      r.origin() + r.direction() * h.t,
+      normal,
+      h.t,
+  };
+}
+
+inline std::optional<PrimitiveHit>
+Quad::intersect(const Ray &r, const float t_min, const float t_max) const {
+  return intersect_moller_trumbore<true>(r, origin, u, v, t_min, t_max);
+}
+
+inline Intersection Quad::surface(const Ray &r, const PrimitiveHit &h) const {
+  return {
+      r.origin() + r.direction() * h.t,
+      normal,
+      h.t,
+  };
+}
+
+/**
+ * Slab test against the box, like `AABB::hit`, except that the distances to
+ * where the ray enters and leaves the box are both kept. The entry is the
+ * hit unless it's outside of [t_min, t_max], in which case the ray may still
+ * hit the box on its way out
+ */
+inline std::optional<PrimitiveHit>
+Box::intersect(const Ray &r, const float t_min, const float t_max) const {
+  auto t_near = -std::numeric_limits<float>::infinity();
+  auto t_far = std::numeric_limits<float>::infinity();
+
+  for (size_t axis = 0; axis < 3; ++axis) {
+    const auto inv_dir = 1.0f / r.direction()[axis];
+    auto t0 = (min[axis] - r.origin()[axis]) * inv_dir;
+    auto t1 = (max[axis] - r.origin()[axis]) * inv_dir;
+    if (inv_dir < 0.0f) {
+      std::swap(t0, t1);
+    }
+
+    // a NaN from a ray lying in the plane of a face is ignored here
+    t_near = std::max(t_near, t0);
+    t_far = std::min(t_far, t1);
+  }
+
+  if (t_near > t_far) {
+    return std::nullopt;
+  }
+
+  if (t_near >= t_min && t_near <= t_max) {
+    return {{.t = t_near, .u = 0.0f, .v = 0.0f}};
+  }
+
+  if (t_far >= t_min && t_far <= t_max) {
+    return {{.t = t_far, .u = 0.0f, .v = 0.0f}};
+  }
+
+  return std::nullopt;
+}
+
+inline Intersection Box::surface(const Ray &r, const PrimitiveHit &h) const {
+  // the hit is on the face whose plane is closest to the point
+  const auto point = r.point_at_parameter(h.t);
+  auto best = std::numeric_limits<float>::infinity();
+  auto normal = Vec3::zeros();
+  for (size_t axis = 0; axis < 3; ++axis) {
+    const auto to_min = std::abs(point[axis] - min[axis]);
+    const auto to_max = std::abs(point[axis] - max[axis]);
+    if (to_min < best) {
+      best = to_min;
+      normal = Vec3::zeros();
+      normal[axis] = -1.0f;
+    }
+    if (to_max < best) {
+      best = to_max;
+      normal = Vec3::zeros();
+      normal[axis] = 1.0f;
+    }
+  }
+
+  return {.point = point, .normal = normal, .t = h.t};
+}
+
+inline std::optional<PrimitiveHit>
+MeshTriangle::intersect(const Ray &r, const float t_min,
+                        const float t_max) const {
+  const auto *idx = &mesh->indices[3 * index];
+  const auto &v0 = mesh->positions[idx[0]];
+  const auto &v1 = mesh->positions[idx[1]];
+  const auto &v2 = mesh->positions[idx[2]];
+
+  if (mesh->test == TriangleTest::Watertight) {
+    return intersect_triangle_watertight(r, v0, v1, v2, t_min, t_max);
+  }
+  return intersect_triangle(r, v0, v1 - v0, v2 - v0, t_min, t_max);
+}
+
+inline Intersection MeshTriangle::surface(const Ray &r,
+                                          const PrimitiveHit &h) const {
+  // the normal isn't stored, it's only computed for the closest hit
+  const auto *idx = &mesh->indices[3 * index];
+  const auto &v0 = mesh->positions[idx[0]];
+  const auto edge1 = mesh->positions[idx[1]] - v0;
+  const auto edge2 = mesh->positions[idx[2]] - v0;
+  return {
+      r.origin() + r.direction() * h.t,
+      edge1.cross(edge2).normalize() * mesh->normal,
+      h.t,
+  };
+}
+
 } // namespace ronald
 
 #endif // PRIMITIVE_H
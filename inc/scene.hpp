@@ -22,6 +22,7 @@
 #include "common.hpp"
 #include "image.hpp"
 #include "inputs.hpp"
+#include "instance.hpp"
 #include "material.hpp"
 #include "primitive.hpp"
 #include "vec3.hpp"
@@ -36,16 +37,46 @@ namespace ronald {
 
 /**
  * Create an object from a JSON file containing the "material"
- * and "primitive" fields
+ * and "primitive" fields. The primitive is appended to `primitives`,
+ * which owns it for the lifetime of the returned object
  */
-[[nodiscard]] const Object object_from_json(const object &obj,
-                                            const material_map &materials);
+[[nodiscard]] const Object
+object_from_json(const object &obj, const material_map &materials,
+                 std::vector<std::shared_ptr<Primitive>> &primitives);
 
 /**
  * Create a list of materials from a JSON array containing material objects
  */
 [[nodiscard]] material_map materials_from_json(const object &obj);
 
+/**
+ * Brute-force intersection of a ray with every object in the scene. This is
+ * no longer used for rendering, but is kept around as a reference
+ * implementation to check the accelerated paths against
+ */
+[[nodiscard]] std::optional<Hit> hit_objects(const std::vector<Object> &objs,
+                                             const Ray &ray);
+
+/**
+ * Brute-force check of whether the ray hits any object in the scene between
+ * `t_min` and `t_max`. Like `hit_objects`, this is the reference
+ * implementation for `Accelerator::occluded`
+ */
+[[nodiscard]] bool occluded_objects(const std::vector<Object> &objs,
+                                    const Ray &ray, float t_min, float t_max);
+
+/**
+ * Get the path of the BVH cache file for a scene description in the cache
+ * directory `dir`. The file is named after a hash of everything the BVH
+ * depends on: the primitives of the objects and prototypes, the triangle
+ * test, and the options the BVH is built with. The materials and the camera
+ * aren't included, so they can change without invalidating the cache
+ */
+[[nodiscard]] std::string bvh_cache_path(const std::string &dir,
+                                         const object &obj,
+                                         TriangleTest triangle_test,
+                                         const BVHOptions &opts);
+
 /**
  * The scene is composed of the objects and the camera
  */
@@ -58,11 +89,22 @@ private:
   // the "white light" material
   const material_map materials;
 
+  // The primitives in the scene. This is the storage that owns the
+  // primitives, the objects and the BVH only point into it
+  const std::vector<std::shared_ptr<Primitive>> primitives;
+
+  // The triangle meshes in the scene. Like the primitives, these own the
+  // mesh triangles that the objects point into
+  const std::vector<std::shared_ptr<TriangleMesh>> meshes;
+
+  // The geometry shared by the instances in the scene, along with the BVH
+  // built over each of them
+  const prototype_map prototypes;
+
   // A list of objects in the scene. Each object is a primitive
   // and an associated material from the materials vector
-  // TODO: BVH
   const std::vector<Object> objects;
-  const FlatBVH bvh;
+  const std::unique_ptr<Accelerator> bvh;
 
   // Info about the camera
   const Camera camera;
@@ -76,18 +118,37 @@ private:
 public:
   /**
    * Construct a scene object from the given objects and camera
-   * position
+   * position. The objects must point into `primitives_a` (or the triangles
+   * of `meshes_a`) and `materials_a`, and any instances among the
+   * primitives must refer to prototypes in `prototypes_a`. The BVH is
+   * cached in `bvh_cache` if it's given, see `Accelerator::build`
    */
-  [[nodiscard]] Scene(std::vector<Object> &objects_a,
-                      const material_map &materials_a, const Camera &camera_a)
-      : materials(materials_a), objects(objects_a), bvh(objects_a),
+  [[nodiscard]] Scene(
+      const std::vector<std::shared_ptr<Primitive>> &primitives_a,
+      std::vector<Object> &objects_a, const material_map &materials_a,
+      const Camera &camera_a, const BVHOptions &bvh_opts = {},
+      const std::vector<std::shared_ptr<TriangleMesh>> &meshes_a = {},
+      const prototype_map &prototypes_a = {},
+      const std::string &bvh_cache = "")
+      : materials(materials_a), primitives(primitives_a), meshes(meshes_a),
+        prototypes(prototypes_a), objects(objects_a),
+        bvh(Accelerator::build(objects_a, bvh_opts, bvh_cache)),
         camera(camera_a){};
 
   /**
    * Construct a scene object from a JSON object containing the `objects` and
-   * `camera` fields
+   * `camera` fields, and optionally a `bvh` field with BVH construction
+   * options and a `prototypes` field with the geometry shared by instances.
+   * BVH options given on the command line take precedence over the ones in
+   * the scene description
    */
-  [[nodiscard]] static Scene from_json(const object &obj, const float aspect_r);
+  [[nodiscard]] static Scene from_json(const object &obj, const float aspect_r,
+                                       const Config &config);
+  /**
+   * Get the acceleration structure built over the objects of the scene
+   */
+  [[nodiscard]] const Accelerator &accelerator() const { return *bvh; }
+
   /**
    * Calls `trace` for each pixel in the scene for as many samples
    * as specified in the config
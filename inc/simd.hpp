@@ -0,0 +1,62 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <immintrin.h>
+
+#include <cstdint>
+#include <limits>
+
+namespace ronald {
+
+/**
+ * The result of intersecting a ray with a block of eight primitives. `lane`
+ * is the lane of the closest primitive hit, or -1 if none of them were hit
+ */
+struct BlockHit {
+  int lane;
+  float t;
+};
+
+/**
+ * Find the closest of the lanes set in `mask`, given the distance to the hit
+ * in each lane. Returns a miss at `t_max` if no lanes are set
+ */
+[[nodiscard]] inline BlockHit closest_block_hit(const __m256 t,
+                                                const __m256 mask,
+                                                const float t_max) {
+  if (_mm256_movemask_ps(mask) == 0) {
+    return {.lane = -1, .t = t_max};
+  }
+
+  // find the smallest t of the lanes that were hit by reducing the vector
+  // down to its minimum, then find which lane it came from
+  const auto inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+  const auto hit_t = _mm256_blendv_ps(inf, t, mask);
+  auto min_t = _mm256_min_ps(hit_t, _mm256_permute_ps(hit_t, 0b10110001));
+  min_t = _mm256_min_ps(min_t, _mm256_permute_ps(min_t, 0b01001110));
+  min_t = _mm256_min_ps(min_t, _mm256_permute2f128_ps(min_t, min_t, 1));
+
+  const auto lane = __builtin_ctz(static_cast<uint32_t>(
+      _mm256_movemask_ps(_mm256_cmp_ps(hit_t, min_t, _CMP_EQ_OQ))));
+  return {.lane = lane, .t = _mm256_cvtss_f32(min_t)};
+}
+
+} // namespace ronald
+
+#endif // SIMD_H
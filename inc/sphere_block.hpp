@@ -0,0 +1,269 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPHERE_BLOCK_H
+#define SPHERE_BLOCK_H
+
+#include "common.hpp"
+#include "primitive.hpp"
+#include "ray.hpp"
+#include "simd.hpp"
+#include "vec3.hpp"
+
+#include <span>
+#include <vector>
+
+namespace ronald {
+
+/**
+ * Eight spheres packed in structure-of-arrays form, so that one ray can be
+ * tested against all of them at once with AVX. Unused lanes have a squared
+ * radius of -infinity, which makes the discriminant negative for every ray
+ */
+struct alignas(32) SphereBlock {
+  static constexpr size_t WIDTH = 8;
+
+  float center_x[WIDTH];
+  float center_y[WIDTH];
+  float center_z[WIDTH];
+  float radius_sq[WIDTH];
+
+  // the signed radius is only read to compute the normal of the closest hit
+  float radius[WIDTH];
+
+  SphereBlock() {
+    std::fill(std::begin(center_x), std::end(center_x), 0.0f);
+    std::fill(std::begin(center_y), std::end(center_y), 0.0f);
+    std::fill(std::begin(center_z), std::end(center_z), 0.0f);
+    std::fill(std::begin(radius_sq), std::end(radius_sq),
+              -std::numeric_limits<float>::infinity());
+    std::fill(std::begin(radius), std::end(radius), 1.0f);
+  }
+
+  /**
+   * Store a sphere in the given lane of the block
+   */
+  void set(const size_t lane, const SphereData &sphere) {
+    center_x[lane] = sphere.center.x();
+    center_y[lane] = sphere.center.y();
+    center_z[lane] = sphere.center.z();
+    radius_sq[lane] = sphere.radius * sphere.radius;
+    radius[lane] = sphere.radius;
+  }
+
+  /**
+   * Get the center of the sphere in the given lane
+   */
+  [[nodiscard]] Vec3 center(const size_t lane) const {
+    return Vec3(center_x[lane], center_y[lane], center_z[lane]);
+  }
+};
+
+/**
+ * Intersect the ray with the eight spheres of the block. This solves the same
+ * quadratic as `Sphere::hit` in every lane, and takes the near root if it
+ * lies between `t_min` and `t_max` or the far root otherwise. Only the
+ * distance is computed here, the caller works out the point and normal for
+ * the closest hit once it knows which sphere that is
+ */
+[[nodiscard]] inline BlockHit intersect_sphere_block(const SphereBlock &b,
+                                                     const Ray &r,
+                                                     const float t_min,
+                                                     const float t_max) {
+  const auto dir = r.direction();
+  const auto ori = r.origin();
+  const auto d_x = _mm256_set1_ps(dir.x());
+  const auto d_y = _mm256_set1_ps(dir.y());
+  const auto d_z = _mm256_set1_ps(dir.z());
+
+  // oc = origin - center
+  const auto oc_x =
+      _mm256_sub_ps(_mm256_set1_ps(ori.x()), _mm256_load_ps(b.center_x));
+  const auto oc_y =
+      _mm256_sub_ps(_mm256_set1_ps(ori.y()), _mm256_load_ps(b.center_y));
+  const auto oc_z =
+      _mm256_sub_ps(_mm256_set1_ps(ori.z()), _mm256_load_ps(b.center_z));
+
+  // `a` is the same for every lane
+  const auto a = _mm256_set1_ps(dir.length_squared());
+  const auto half_b = _mm256_fmadd_ps(
+      oc_z, d_z, _mm256_fmadd_ps(oc_y, d_y, _mm256_mul_ps(oc_x, d_x)));
+  const auto c = _mm256_sub_ps(
+      _mm256_fmadd_ps(oc_z, oc_z,
+                      _mm256_fmadd_ps(oc_y, oc_y, _mm256_mul_ps(oc_x, oc_x))),
+      _mm256_load_ps(b.radius_sq));
+  const auto discriminant =
+      _mm256_fmsub_ps(half_b, half_b, _mm256_mul_ps(a, c));
+
+  // the square root of a negative discriminant is NaN, which fails all of the
+  // ordered comparisons below, so the lanes that miss drop out on their own
+  const auto sqrtd = _mm256_sqrt_ps(discriminant);
+  const auto neg_half_b = _mm256_sub_ps(_mm256_setzero_ps(), half_b);
+  const auto near = _mm256_div_ps(_mm256_sub_ps(neg_half_b, sqrtd), a);
+  const auto far = _mm256_div_ps(_mm256_add_ps(neg_half_b, sqrtd), a);
+
+  const auto lo = _mm256_set1_ps(t_min);
+  const auto hi = _mm256_set1_ps(t_max);
+  const auto near_ok = _mm256_and_ps(_mm256_cmp_ps(near, lo, _CMP_GE_OQ),
+                                     _mm256_cmp_ps(near, hi, _CMP_LE_OQ));
+  const auto far_ok = _mm256_and_ps(_mm256_cmp_ps(far, lo, _CMP_GE_OQ),
+                                    _mm256_cmp_ps(far, hi, _CMP_LE_OQ));
+
+  const auto t = _mm256_blendv_ps(far, near, near_ok);
+  return closest_block_hit(t, _mm256_or_ps(near_ok, far_ok), t_max);
+}
+
+/**
+ * A set of spheres packed into blocks, along with the material of each
+ * sphere. The spheres can be added in groups, each starting on a new block,
+ * so the same storage works for the leaves of a BVH and for intersecting a
+ * whole set of spheres by brute force
+ */
+class SphereBlocks {
+  std::vector<SphereBlock> blocks;
+
+  // the material of each lane. the unused lanes at the end of a group have
+  // no material
+  std::vector<const Material *> materials;
+
+public:
+  /**
+   * Pack a group of spheres into new blocks and return the index of the first
+   * one. `mats` holds the material of each sphere
+   */
+  uint32_t add(std::span<const SphereData> spheres,
+               std::span<const Material *const> mats) {
+    assert(spheres.size() == mats.size());
+
+    // the spheres are referred to by their lane index across all blocks
+    const auto n_blocks =
+        (spheres.size() + SphereBlock::WIDTH - 1) / SphereBlock::WIDTH;
+    if (blocks.size() + n_blocks >
+        std::numeric_limits<uint32_t>::max() / SphereBlock::WIDTH) {
+      throw std::runtime_error("too many sphere blocks");
+    }
+
+    const auto offset = static_cast<uint32_t>(blocks.size());
+    for (size_t i = 0; i < spheres.size(); i += SphereBlock::WIDTH) {
+      auto &block = blocks.emplace_back();
+      for (size_t lane = 0; lane < SphereBlock::WIDTH; ++lane) {
+        if (i + lane < spheres.size()) {
+          block.set(lane, spheres[i + lane]);
+          materials.push_back(mats[i + lane]);
+        } else {
+          materials.push_back(nullptr);
+        }
+      }
+    }
+    return offset;
+  }
+
+  /**
+   * Replace the sphere with the given index
+   */
+  void set(const size_t id, const SphereData &sphere) {
+    blocks[id / SphereBlock::WIDTH].set(id % SphereBlock::WIDTH, sphere);
+  }
+
+  /**
+   * Get the number of blocks
+   */
+  [[nodiscard]] size_t size() const { return blocks.size(); }
+
+  /**
+   * Get the number of bytes used by the blocks and their materials
+   */
+  [[nodiscard]] size_t memory() const {
+    return blocks.size() * sizeof(SphereBlock) +
+           materials.size() * sizeof(const Material *);
+  }
+
+  /**
+   * Intersect a ray with `count` blocks starting at `first`. If one of the
+   * spheres is hit closer than `*t_max`, `*t_max` is shrunk to the distance
+   * of the hit and `*id` is set to the sphere's index in the set. Returns
+   * whether any of the spheres were hit
+   */
+  bool intersect(const size_t first, const size_t count, const Ray &r,
+                 const float t_min, float *t_max, uint32_t *id) const {
+    bool found = false;
+    for (size_t i = first; i < first + count; ++i) {
+      const auto result = intersect_sphere_block(blocks[i], r, t_min, *t_max);
+      if (result.lane >= 0) {
+        found = true;
+        *id = static_cast<uint32_t>(i * SphereBlock::WIDTH +
+                                    static_cast<size_t>(result.lane));
+        *t_max = result.t;
+      }
+    }
+    return found;
+  }
+
+  /**
+   * Check whether the ray hits any sphere of `count` blocks starting at
+   * `first` between `t_min` and `t_max`, stopping at the first block with a
+   * hit
+   */
+  [[nodiscard]] bool occluded(const size_t first, const size_t count,
+                              const Ray &r, const float t_min,
+                              const float t_max) const {
+    for (size_t i = first; i < first + count; ++i) {
+      if (intersect_sphere_block(blocks[i], r, t_min, t_max).lane >= 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Compute the point and normal of a hit `t` units along the ray on the
+   * sphere with the given index
+   */
+  [[nodiscard]] Intersection surface(const Ray &r, const uint32_t id,
+                                     const float t) const {
+    const auto &block = blocks[id / SphereBlock::WIDTH];
+    const auto lane = id % SphereBlock::WIDTH;
+    const auto point = r.point_at_parameter(t);
+    return {
+        .point = point,
+        .normal = (point - block.center(lane)) / block.radius[lane],
+        .t = t,
+    };
+  }
+
+  /**
+   * Get the material of the sphere with the given index
+   */
+  [[nodiscard]] const Material *material(const uint32_t id) const {
+    return materials[id];
+  }
+
+  /**
+   * Intersect a ray with every sphere in the set
+   */
+  [[nodiscard]] std::optional<Hit> intersect(const Ray &r, const float t_min,
+                                             float t_max) const {
+    uint32_t id = 0;
+    if (!intersect(0, blocks.size(), r, t_min, &t_max, &id)) {
+      return std::nullopt;
+    }
+    return {{.hit = surface(r, id, t_max), .material = material(id)}};
+  }
+};
+
+} // namespace ronald
+
+#endif // SPHERE_BLOCK_H
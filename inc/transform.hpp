@@ -0,0 +1,103 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "aabb.hpp"
+#include "ray.hpp"
+#include "vec3.hpp"
+
+#include <array>
+
+namespace ronald {
+
+/**
+ * An affine transform, stored as the top three rows of a 4x4 matrix. The
+ * left 3x3 block is the linear part (rotation, scale, shear) and the last
+ * column is the translation. The bottom row is always (0, 0, 0, 1), so it
+ * isn't stored
+ */
+class Transform {
+  std::array<std::array<float, 4>, 3> m;
+
+public:
+  /**
+   * Construct a transform from the three rows of its matrix
+   */
+  [[nodiscard]] explicit Transform(
+      const std::array<std::array<float, 4>, 3> &rows)
+      : m(rows) {}
+
+  /**
+   * The transform that leaves everything where it is
+   */
+  [[nodiscard]] static Transform identity() {
+    return Transform({{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}});
+  }
+
+  /**
+   * Transform a point, applying both the linear part and the translation
+   */
+  [[nodiscard]] Vec3 point(const Vec3 &p) const {
+    return vector(p) + Vec3(m[0][3], m[1][3], m[2][3]);
+  }
+
+  /**
+   * Transform a direction, which ignores the translation
+   */
+  [[nodiscard]] Vec3 vector(const Vec3 &v) const {
+    return Vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+  }
+
+  /**
+   * Multiply a direction by the transpose of the linear part. Normals have to
+   * be transformed by the inverse transpose to stay perpendicular to the
+   * surface, so calling this on the inverse of a transform moves normals the
+   * same way the transform moves points. The result isn't normalized
+   */
+  [[nodiscard]] Vec3 transposed_vector(const Vec3 &v) const {
+    return Vec3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+  }
+
+  /**
+   * Transform a ray. The direction isn't normalized, so the point at any `t`
+   * along the transformed ray is the transformed point at the same `t` along
+   * the original ray, and distances can be compared between spaces
+   */
+  [[nodiscard]] Ray ray(const Ray &r) const {
+    return Ray(point(r.origin()), vector(r.direction()));
+  }
+
+  /**
+   * Get the AABB of the transformed box, by transforming its eight corners
+   */
+  [[nodiscard]] AABB aabb(const AABB &box) const;
+
+  /**
+   * Get the inverse of the transform. Throws if the transform is singular,
+   * e.g. when it scales an axis to zero
+   */
+  [[nodiscard]] Transform inverse() const;
+};
+
+} // namespace ronald
+
+#endif // TRANSFORM_H
@@ -0,0 +1,165 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRIANGLE_BLOCK_H
+#define TRIANGLE_BLOCK_H
+
+#include "primitive.hpp"
+#include "ray.hpp"
+#include "simd.hpp"
+#include "vec3.hpp"
+
+namespace ronald {
+
+/**
+ * Eight triangles packed in structure-of-arrays form, so that one ray can be
+ * tested against all of them at once with AVX. Each array holds one
+ * component of the same value for the eight triangles. Unused lanes are left
+ * zeroed, and a triangle with zero-length edges is never hit. Quads share
+ * the blocks with the triangles, see `u_weight`
+ */
+struct alignas(32) TriangleBlock {
+  static constexpr size_t WIDTH = 8;
+
+  float v0_x[WIDTH];
+  float v0_y[WIDTH];
+  float v0_z[WIDTH];
+  float edge1_x[WIDTH];
+  float edge1_y[WIDTH];
+  float edge1_z[WIDTH];
+  float edge2_x[WIDTH];
+  float edge2_y[WIDTH];
+  float edge2_z[WIDTH];
+
+  // the last edge test is `u_weight * u + v <= 1`. that's the diagonal of a
+  // triangle when the weight is 1, and the far edge of a parallelogram when
+  // it's 0
+  float u_weight[WIDTH];
+
+  // the normals are only read for the closest hit
+  float normal_x[WIDTH];
+  float normal_y[WIDTH];
+  float normal_z[WIDTH];
+
+  /**
+   * Store a triangle in the given lane of the block
+   */
+  void set(const size_t lane, const TriangleData &tri) {
+    v0_x[lane] = tri.v0.x();
+    v0_y[lane] = tri.v0.y();
+    v0_z[lane] = tri.v0.z();
+    edge1_x[lane] = tri.edge1.x();
+    edge1_y[lane] = tri.edge1.y();
+    edge1_z[lane] = tri.edge1.z();
+    edge2_x[lane] = tri.edge2.x();
+    edge2_y[lane] = tri.edge2.y();
+    edge2_z[lane] = tri.edge2.z();
+    u_weight[lane] = tri.parallelogram ? 0.0f : 1.0f;
+    normal_x[lane] = tri.normal.x();
+    normal_y[lane] = tri.normal.y();
+    normal_z[lane] = tri.normal.z();
+  }
+
+  /**
+   * Get the normal of the triangle in the given lane
+   */
+  [[nodiscard]] Vec3 normal(const size_t lane) const {
+    return Vec3(normal_x[lane], normal_y[lane], normal_z[lane]);
+  }
+};
+
+/**
+ * Intersect the ray with the eight triangles (or quads) of the block using
+ * the Möller–Trumbore algorithm, without any branches. Each of the early outs
+ * of the scalar version becomes a lane mask, and the masks are combined at
+ * the end to find the closest triangle hit between `t_min` and `t_max`. The dot
+ * and cross products use FMA, so `t` can differ slightly from
+ * `intersect_triangle`, mostly for rays that hit at grazing angles
+ */
+[[nodiscard]] inline BlockHit
+intersect_triangle_block(const TriangleBlock &b, const Ray &r,
+                         const float t_min, const float t_max) {
+  const auto dir = r.direction();
+  const auto ori = r.origin();
+  const auto d_x = _mm256_set1_ps(dir.x());
+  const auto d_y = _mm256_set1_ps(dir.y());
+  const auto d_z = _mm256_set1_ps(dir.z());
+
+  const auto e1_x = _mm256_load_ps(b.edge1_x);
+  const auto e1_y = _mm256_load_ps(b.edge1_y);
+  const auto e1_z = _mm256_load_ps(b.edge1_z);
+  const auto e2_x = _mm256_load_ps(b.edge2_x);
+  const auto e2_y = _mm256_load_ps(b.edge2_y);
+  const auto e2_z = _mm256_load_ps(b.edge2_z);
+
+  // h = dir x edge2
+  const auto h_x = _mm256_fmsub_ps(d_y, e2_z, _mm256_mul_ps(d_z, e2_y));
+  const auto h_y = _mm256_fmsub_ps(d_z, e2_x, _mm256_mul_ps(d_x, e2_z));
+  const auto h_z = _mm256_fmsub_ps(d_x, e2_y, _mm256_mul_ps(d_y, e2_x));
+
+  // a = edge1 . h, the ray is parallel to the triangle when it's near zero
+  const auto a = _mm256_fmadd_ps(
+      e1_z, h_z, _mm256_fmadd_ps(e1_y, h_y, _mm256_mul_ps(e1_x, h_x)));
+  const auto f = _mm256_div_ps(_mm256_set1_ps(1.0f), a);
+
+  // s = origin - v0
+  const auto s_x = _mm256_sub_ps(_mm256_set1_ps(ori.x()),
+                                 _mm256_load_ps(b.v0_x));
+  const auto s_y = _mm256_sub_ps(_mm256_set1_ps(ori.y()),
+                                 _mm256_load_ps(b.v0_y));
+  const auto s_z = _mm256_sub_ps(_mm256_set1_ps(ori.z()),
+                                 _mm256_load_ps(b.v0_z));
+
+  const auto u = _mm256_mul_ps(
+      f, _mm256_fmadd_ps(s_z, h_z,
+                         _mm256_fmadd_ps(s_y, h_y, _mm256_mul_ps(s_x, h_x))));
+
+  // q = s x edge1
+  const auto q_x = _mm256_fmsub_ps(s_y, e1_z, _mm256_mul_ps(s_z, e1_y));
+  const auto q_y = _mm256_fmsub_ps(s_z, e1_x, _mm256_mul_ps(s_x, e1_z));
+  const auto q_z = _mm256_fmsub_ps(s_x, e1_y, _mm256_mul_ps(s_y, e1_x));
+
+  const auto v = _mm256_mul_ps(
+      f, _mm256_fmadd_ps(d_z, q_z,
+                         _mm256_fmadd_ps(d_y, q_y, _mm256_mul_ps(d_x, q_x))));
+  const auto t = _mm256_mul_ps(
+      f, _mm256_fmadd_ps(e2_z, q_z,
+                         _mm256_fmadd_ps(e2_y, q_y, _mm256_mul_ps(e2_x, q_x))));
+
+  // the ordered comparisons are false for NaN, so the lanes of degenerate
+  // triangles (where `f` is infinite) drop out along with the misses
+  const auto zero = _mm256_setzero_ps();
+  const auto one = _mm256_set1_ps(1.0f);
+  const auto eps = _mm256_set1_ps(EPSILON);
+  auto mask = _mm256_or_ps(_mm256_cmp_ps(a, _mm256_set1_ps(-EPSILON), _CMP_LE_OQ),
+                           _mm256_cmp_ps(a, eps, _CMP_GE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+  const auto uv = _mm256_fmadd_ps(_mm256_load_ps(b.u_weight), u, v);
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(uv, one, _CMP_LE_OQ));
+  mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, eps, _CMP_GT_OQ));
+  mask = _mm256_and_ps(mask,
+                       _mm256_cmp_ps(t, _mm256_set1_ps(t_min), _CMP_GT_OQ));
+  mask = _mm256_and_ps(mask,
+                       _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LT_OQ));
+
+  return closest_block_hit(t, mask, t_max);
+}
+
+} // namespace ronald
+
+#endif // TRIANGLE_BLOCK_H
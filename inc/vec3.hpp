@@ -221,6 +221,14 @@ public:
     return v[idx];
   }
 
+  /**
+   * Mutable access to the elements of the vector by numeric index
+   */
+  float &operator[](const size_t idx) {
+    assert(idx < 3);
+    return v[idx];
+  }
+
   /**
    * Stream insertion operator
    */
@@ -17,9 +17,16 @@
 #include "aabb.hpp"
 namespace ronald {
 
+AABB AABB::empty() {
+  constexpr auto inf = std::numeric_limits<float>::infinity();
+  return AABB(Vec3(inf, inf, inf), Vec3(-inf, -inf, -inf));
+}
+
 bool AABB::hit(const Ray &r, const Vec3 &inv_dir, float t_min,
                float t_max) const {
-  // check all three axes for if the ray misses
+  // check all three axes for if the ray misses. the interval where the ray is
+  // inside the box shrinks with every slab, so a ray that crosses each slab
+  // individually can still miss the box entirely
   for (size_t axis = 0; axis < 3; ++axis) {
 
     const auto rval = r.origin()[axis];
@@ -29,10 +36,10 @@ bool AABB::hit(const Ray &r, const Vec3 &inv_dir, float t_min,
     const auto t1 = std::max((min[axis] - rval) * inv_dir[axis],
                              (max[axis] - rval) * inv_dir[axis]);
 
-    const auto true_t_min = std::max(t0, t_min);
-    const auto true_t_max = std::min(t1, t_max);
+    t_min = std::max(t0, t_min);
+    t_max = std::min(t1, t_max);
 
-    if (true_t_max <= true_t_min) {
+    if (t_max <= t_min) {
       return false;
     }
   }
@@ -55,6 +62,13 @@ size_t AABB::largest_extent() const {
   return max_dim;
 }
 
+float AABB::surface_area() const {
+  const auto d = max - min;
+  return 2.0f * (d.x() * d.y() + d.x() * d.z() + d.y() * d.z());
+}
+
+Vec3 AABB::centroid() const { return (min + max) * 0.5f; }
+
 AABB AABB::surrounding_box(const AABB &a, const AABB &b) {
   const auto small =
       Vec3(std::min(a.min.x(), b.min.x()), std::min(a.min.y(), b.min.y()),
@@ -67,4 +81,20 @@ AABB AABB::surrounding_box(const AABB &a, const AABB &b) {
   return AABB(small, big);
 }
 
+AABB AABB::intersection(const AABB &a, const AABB &b) {
+  const auto small =
+      Vec3(std::max(a.min.x(), b.min.x()), std::max(a.min.y(), b.min.y()),
+           std::max(a.min.z(), b.min.z()));
+
+  const auto big =
+      Vec3(std::min(a.max.x(), b.max.x()), std::min(a.max.y(), b.max.y()),
+           std::min(a.max.z(), b.max.z()));
+
+  return AABB(small, big);
+}
+
+bool AABB::is_empty() const {
+  return min.x() > max.x() || min.y() > max.y() || min.z() > max.z();
+}
+
 } // namespace ronald
@@ -0,0 +1,168 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "accelerator.hpp"
+#include "bvh.hpp"
+#include "grid.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+
+namespace ronald {
+
+AcceleratorType accelerator_type_from_string(const std::string &str) {
+  if (str == "bvh") {
+    return AcceleratorType::BVH;
+  }
+
+  if (str == "grid") {
+    return AcceleratorType::Grid;
+  }
+
+  if (str == "auto") {
+    return AcceleratorType::Auto;
+  }
+
+  throw std::runtime_error(
+      "Accelerator must be one of `bvh`, `grid`, or `auto`");
+}
+
+// below this many objects the BVH is shallow enough that the cheaper
+// traversal of the grid doesn't make up for its empty cells
+constexpr size_t GRID_MIN_OBJECTS = 256;
+
+// the grid is only picked when the diagonal of the largest object's bounds is
+// at most this many times the median
+constexpr float GRID_MAX_SIZE_RATIO = 4.0f;
+
+// the grid is only picked when its non-empty cells hold at most this many
+// objects on average. scattered objects of similar sizes come out at around
+// 4, while clusters far apart from each other crowd into a few cells
+constexpr double GRID_MAX_OCCUPANCY = 16.0;
+
+bool prefer_grid(const std::vector<Object> &objs, const BVHOptions &opts) {
+  if (objs.size() < GRID_MIN_OBJECTS) {
+    return false;
+  }
+
+  std::vector<float> sizes;
+  sizes.reserve(objs.size());
+  for (const auto &o : objs) {
+    const auto b = o.primitive->aabb();
+    sizes.push_back((b.max - b.min).length());
+  }
+
+  const auto largest = *std::max_element(sizes.begin(), sizes.end());
+  const auto median = sizes.begin() + static_cast<ptrdiff_t>(sizes.size() / 2);
+  std::nth_element(sizes.begin(), median, sizes.end());
+  if (largest > GRID_MAX_SIZE_RATIO * *median) {
+    return false;
+  }
+
+  return Grid::mean_occupancy(objs, opts) <= GRID_MAX_OCCUPANCY;
+}
+
+std::unique_ptr<Accelerator> Accelerator::build(std::vector<Object> &objs,
+                                                const BVHOptions &opts,
+                                                const std::string &cache_path) {
+  if (opts.width != 8 && opts.node_format == NodeFormat::Compressed) {
+    throw std::runtime_error("Compressed BVH nodes require a BVH width of 8");
+  }
+
+  auto type = opts.accelerator;
+  if (type == AcceleratorType::Auto) {
+    type = prefer_grid(objs, opts) ? AcceleratorType::Grid
+                                   : AcceleratorType::BVH;
+  }
+
+  if (type == AcceleratorType::Grid && !cache_path.empty()) {
+    std::cerr << "Not caching the grid, only the 2-wide BVH can be cached"
+              << std::endl;
+  } else if (opts.width == 8 && !cache_path.empty()) {
+    std::cerr << "Not caching the BVH, only the 2-wide BVH can be cached"
+              << std::endl;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+
+  std::unique_ptr<Accelerator> accel;
+  auto name = std::to_string(opts.width) + "-wide BVH";
+  auto loaded = false;
+  if (type == AcceleratorType::Grid) {
+    auto grid = std::make_unique<Grid>(objs, opts);
+    const auto &dims = grid->dimensions();
+    name = std::to_string(dims[0]) + "x" + std::to_string(dims[1]) + "x" +
+           std::to_string(dims[2]) + " grid";
+    accel = std::move(grid);
+  } else if (opts.width == 8) {
+    accel = std::make_unique<WideBVH>(objs, opts);
+  } else if (cache_path.empty()) {
+    accel = std::make_unique<FlatBVH>(objs, opts);
+  } else if (auto cached = FlatBVH::load(cache_path, objs, opts)) {
+    accel = std::move(cached);
+    loaded = true;
+  } else {
+    // the build reorders the objects, but the cache refers to them in the
+    // order they were given
+    const auto given = objs;
+    auto flat = std::make_unique<FlatBVH>(objs, opts);
+    try {
+      flat->save(cache_path, given);
+    } catch (const std::exception &e) {
+      std::cerr << "Failed to cache the BVH: " << e.what() << std::endl;
+    }
+    accel = std::move(flat);
+  }
+
+  const auto elapsed = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start);
+  std::cerr << (loaded ? "Loaded " : "Built ") << name << " over "
+            << objs.size() << " objects in " << std::fixed
+            << std::setprecision(2) << elapsed.count() << std::defaultfloat
+            << "ms ";
+  if (loaded) {
+    std::cerr << "from " << cache_path << std::endl;
+  } else if (type == AcceleratorType::Grid) {
+    std::cerr << std::endl;
+  } else {
+    std::cerr << "using " << std::max<size_t>(opts.build_threads, 1)
+              << " thread(s)" << std::endl;
+  }
+
+  const auto mem = accel->memory();
+  const auto mib = [](const size_t bytes) {
+    return static_cast<double>(bytes) / (1024.0 * 1024.0);
+  };
+  if (type == AcceleratorType::Grid) {
+    std::cerr << "Grid memory: " << std::fixed << std::setprecision(2)
+              << mib(mem.nodes) << "MiB of cells, " << mib(mem.leaves)
+              << "MiB of leaves" << std::defaultfloat << std::endl;
+    return accel;
+  }
+
+  std::cerr << "BVH memory: " << std::fixed << std::setprecision(2)
+            << mib(mem.nodes) << "MiB of "
+            << (opts.node_format == NodeFormat::Compressed ? "compressed"
+                                                           : "full")
+            << " nodes, " << mib(mem.leaves) << "MiB of leaves"
+            << std::defaultfloat << std::endl;
+
+  return accel;
+}
+
+} // namespace ronald
@@ -0,0 +1,37 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "common.hpp"
+#include "primitive.hpp"
+#include "vec3.hpp"
+
+namespace ronald {
+
+Box::Box(const Vec3 &min_a, const Vec3 &max_a) : min(min_a), max(max_a) {
+  for (size_t axis = 0; axis < 3; ++axis) {
+    if (min[axis] > max[axis]) {
+      throw std::runtime_error("Box min must not be greater than its max");
+    }
+  }
+}
+
+Box::Box(const object &obj)
+    : Box(Vec3(get<std::array<float, 3>>(obj, "min", "primitive")),
+          Vec3(get<std::array<float, 3>>(obj, "max", "primitive"))) {}
+
+AABB Box::aabb() const { return AABB(min, max); }
+
+} // namespace ronald
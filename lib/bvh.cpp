@@ -20,16 +20,168 @@
 #include "rand.hpp"
 #include <algorithm>
 #include <cstdlib>
+#include <future>
 
 namespace ronald {
 
-BVH::BVH(const NodeType _type, const AABB &_bbox, BVHPair children)
-    : type(_type), bbox(_bbox), data(std::move(children)) {}
+BVH::BVH(const NodeType _type, const AABB &_bbox, BVHPair children,
+         const size_t _axis)
+    : type(_type), bbox(_bbox), data(std::move(children)), axis(_axis) {}
 
-BVH::BVH(const NodeType _type, const AABB &_bbox, const Object &obj)
-    : type(_type), bbox(_bbox), data(obj){};
+BVH::BVH(const NodeType _type, const AABB &_bbox,
+         const std::vector<Object> &objs)
+    : type(_type), bbox(_bbox), data(objs){};
 
-BVH BVH::build_bvh(std::vector<Object> &objs, size_t *total_nodes) {
+SplitMethod split_method_from_string(const std::string &str) {
+  if (str == "sah") {
+    return SplitMethod::SAH;
+  }
+
+  if (str == "middle") {
+    return SplitMethod::Middle;
+  }
+
+  if (str == "lbvh") {
+    return SplitMethod::LBVH;
+  }
+
+  if (str == "sbvh") {
+    return SplitMethod::SBVH;
+  }
+
+  throw std::runtime_error(
+      "BVH split method must be one of `sah`, `middle`, `lbvh`, or `sbvh`");
+}
+
+NodeLayout node_layout_from_string(const std::string &str) {
+  if (str == "depth_first") {
+    return NodeLayout::DepthFirst;
+  }
+
+  if (str == "treelet") {
+    return NodeLayout::Treelet;
+  }
+
+  throw std::runtime_error(
+      "BVH node layout must be either `depth_first` or `treelet`");
+}
+
+Traversal traversal_from_string(const std::string &str) {
+  if (str == "stack") {
+    return Traversal::Stack;
+  }
+
+  if (str == "stackless") {
+    return Traversal::Stackless;
+  }
+
+  throw std::runtime_error(
+      "BVH traversal must be either `stack` or `stackless`");
+}
+
+NodeFormat node_format_from_string(const std::string &str) {
+  if (str == "full") {
+    return NodeFormat::Full;
+  }
+
+  if (str == "compressed") {
+    return NodeFormat::Compressed;
+  }
+
+  throw std::runtime_error(
+      "BVH node format must be either `full` or `compressed`");
+}
+
+BVHOptions BVHOptions::from_json(const object &obj) {
+  BVHOptions opts;
+
+  if (obj.contains("split_method")) {
+    opts.split_method =
+        split_method_from_string(get<std::string>(obj, "split_method", "bvh"));
+  }
+
+  if (obj.contains("sah_buckets")) {
+    const auto buckets = get<int>(obj, "sah_buckets", "bvh");
+    if (buckets < 2) {
+      throw std::runtime_error("BVH `sah_buckets` must be at least 2");
+    }
+    opts.sah_buckets = static_cast<size_t>(buckets);
+  }
+
+  if (obj.contains("traversal_cost")) {
+    opts.traversal_cost = get<float>(obj, "traversal_cost", "bvh");
+  }
+
+  if (obj.contains("intersection_cost")) {
+    opts.intersection_cost = get<float>(obj, "intersection_cost", "bvh");
+  }
+
+  if (obj.contains("width")) {
+    const auto width = get<int>(obj, "width", "bvh");
+    if (width != 2 && width != 8) {
+      throw std::runtime_error("BVH `width` must be either 2 or 8");
+    }
+    opts.width = static_cast<size_t>(width);
+  }
+
+  if (obj.contains("nodes")) {
+    opts.node_format =
+        node_format_from_string(get<std::string>(obj, "nodes", "bvh"));
+  }
+
+  if (obj.contains("layout")) {
+    opts.node_layout =
+        node_layout_from_string(get<std::string>(obj, "layout", "bvh"));
+  }
+
+  if (obj.contains("traversal")) {
+    opts.traversal =
+        traversal_from_string(get<std::string>(obj, "traversal", "bvh"));
+  }
+
+  if (obj.contains("max_leaf_size")) {
+    const auto max_leaf_size = get<int>(obj, "max_leaf_size", "bvh");
+    if (max_leaf_size < 1 ||
+        max_leaf_size > std::numeric_limits<uint16_t>::max()) {
+      throw std::runtime_error("BVH `max_leaf_size` must be between 1 and "
+                               "65535");
+    }
+    opts.max_leaf_size = static_cast<size_t>(max_leaf_size);
+  }
+
+  if (obj.contains("spatial_split_alpha")) {
+    opts.spatial_split_alpha = get<float>(obj, "spatial_split_alpha", "bvh");
+  }
+
+  if (obj.contains("max_duplication")) {
+    opts.max_duplication = get<float>(obj, "max_duplication", "bvh");
+    if (opts.max_duplication < 0.0f) {
+      throw std::runtime_error("BVH `max_duplication` must not be negative");
+    }
+  }
+
+  if (obj.contains("grid_density")) {
+    opts.grid_density = get<float>(obj, "grid_density", "bvh");
+    if (opts.grid_density <= 0.0f) {
+      throw std::runtime_error("BVH `grid_density` must be positive");
+    }
+  }
+
+  if (opts.traversal_cost < 0.0f || opts.intersection_cost <= 0.0f) {
+    throw std::runtime_error("BVH traversal and intersection costs must be "
+                             "positive");
+  }
+
+  return opts;
+}
+
+/**
+ * Partition the refs around the median centroid along the axis where the
+ * objects are the most spread out. This split always produces two non-empty
+ * halves, so it is also used as the fallback when the SAH can't find a split.
+ * Returns the number of refs in the first half
+ */
+size_t partition_middle(std::span<BVHBuildRef> refs, size_t *split_axis) {
   // chose the axis along which to split this node of the BVH.
   // one simple way to do this would be to simply select randomly.
   // here we will select based on the largest extend of the current AABB,
@@ -38,63 +190,269 @@ BVH BVH::build_bvh(std::vector<Object> &objs, size_t *total_nodes) {
   //
   // see figure 4.3 here:
   // https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies
-  auto full_bounds = AABB();
-  for (const auto &o : objs) {
-    full_bounds = AABB::surrounding_box(full_bounds, o.primitive->aabb());
+  auto full_bounds = AABB::empty();
+  for (const auto &ref : refs) {
+    full_bounds = AABB::surrounding_box(full_bounds, ref.bounds);
   }
   const auto axis = full_bounds.largest_extent();
+  *split_axis = axis;
+
+  const auto mid = refs.size() / 2;
+  // partition the elements in the vector according to the split criteria.
+  // here we split at the median of the midpoints of the child bboxes.
+  //
+  // see figure 4.4 here:
+  // https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies
+  std::nth_element(refs.begin(), refs.begin() + static_cast<long>(mid),
+                   refs.end(), [axis](const auto &a, const auto &b) {
+                     return a.centroid[axis] < b.centroid[axis];
+                   });
+
+  return mid;
+}
+
+/**
+ * Find the SAH bucket a ref's centroid falls into along the given axis
+ */
+size_t sah_bucket(const BVHBuildRef &ref, const AABB &centroid_bounds,
+                  const size_t axis, const size_t n_buckets) {
+  const auto lo = centroid_bounds.min[axis];
+  const auto extent = centroid_bounds.max[axis] - lo;
+  const auto c = ref.centroid[axis];
+  const auto b = static_cast<size_t>(static_cast<float>(n_buckets) *
+                                     ((c - lo) / extent));
+  return std::min(b, n_buckets - 1);
+}
+
+/**
+ * Find the best split of the refs using the binned Surface Area Heuristic.
+ * The centroid bounds are divided into `opts.sah_buckets` equally sized
+ * buckets along each axis, and the boundaries between buckets are evaluated
+ * as candidate split planes. The cost of a split is estimated as the
+ * probability of a ray hitting each child (proportional to its surface area)
+ * multiplied by the number of objects in that child.
+ *
+ * https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies#TheSurfaceAreaHeuristic
+ */
+SAHSplit find_sah_split(std::span<const BVHBuildRef> refs,
+                        const BVHOptions &opts) {
+  SAHSplit best;
+  best.cost = std::numeric_limits<float>::infinity();
+
+  auto bounds = AABB::empty();
+  best.centroid_bounds = AABB::empty();
+  for (const auto &ref : refs) {
+    bounds = AABB::surrounding_box(bounds, ref.bounds);
+    best.centroid_bounds = AABB::surrounding_box(
+        best.centroid_bounds, AABB(ref.centroid, ref.centroid));
+  }
+
+  const auto &centroid_bounds = best.centroid_bounds;
+  const auto n_buckets = opts.sah_buckets;
+  const auto parent_area = bounds.surface_area();
+
+  std::vector<SAHBucket> buckets(n_buckets);
+  std::vector<AABB> right_bounds(n_buckets);
+  std::vector<size_t> right_count(n_buckets);
+
+  for (size_t axis = 0; axis < 3; ++axis) {
+    if (centroid_bounds.max[axis] <= centroid_bounds.min[axis]) {
+      continue;
+    }
+
+    std::fill(buckets.begin(), buckets.end(), SAHBucket());
+    for (const auto &ref : refs) {
+      auto &bucket =
+          buckets[sah_bucket(ref, centroid_bounds, axis, n_buckets)];
+      bucket.count += 1;
+      bucket.bounds = AABB::surrounding_box(bucket.bounds, ref.bounds);
+    }
+
+    // sweep from the right to find the bounds and object count of everything
+    // to the right of each candidate split plane...
+    auto acc_bounds = AABB::empty();
+    size_t acc_count = 0;
+    for (size_t i = n_buckets - 1; i > 0; --i) {
+      acc_bounds = AABB::surrounding_box(acc_bounds, buckets[i].bounds);
+      acc_count += buckets[i].count;
+      right_bounds[i - 1] = acc_bounds;
+      right_count[i - 1] = acc_count;
+    }
+
+    // ...then sweep from the left and evaluate the cost of splitting after
+    // each bucket. this keeps the evaluation linear in the number of buckets
+    acc_bounds = AABB::empty();
+    acc_count = 0;
+    for (size_t i = 0; i < n_buckets - 1; ++i) {
+      acc_bounds = AABB::surrounding_box(acc_bounds, buckets[i].bounds);
+      acc_count += buckets[i].count;
+
+      if (acc_count == 0 || right_count[i] == 0) {
+        continue;
+      }
+
+      const auto cost =
+          opts.traversal_cost +
+          opts.intersection_cost *
+              (static_cast<float>(acc_count) * acc_bounds.surface_area() +
+               static_cast<float>(right_count[i]) *
+                   right_bounds[i].surface_area()) /
+              parent_area;
+
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = axis;
+        best.bucket = i;
+        best.left_bounds = acc_bounds;
+        best.right_bounds = right_bounds[i];
+      }
+    }
+  }
+
+  return best;
+}
+
+size_t apply_sah_split(std::span<BVHBuildRef> refs, const SAHSplit &split,
+                       const BVHOptions &opts) {
+  const auto m =
+      std::partition(refs.begin(), refs.end(), [&](const BVHBuildRef &ref) {
+        return sah_bucket(ref, split.centroid_bounds, split.axis,
+                          opts.sah_buckets) <= split.bucket;
+      });
+  return static_cast<size_t>(m - refs.begin());
+}
+
+/**
+ * Partition the refs using the binned Surface Area Heuristic. Returns the
+ * number of refs in the first half.
+ *
+ * If the objects fit in a leaf and intersecting all of them is estimated to
+ * be cheaper than the best split, or if no split can separate the objects
+ * (for example, when all of their centroids coincide), `refs.size()` is
+ * returned and the refs are left in their original order.
+ */
+size_t partition_sah(std::span<BVHBuildRef> refs, const BVHOptions &opts,
+                     size_t *split_axis) {
+  const auto split = find_sah_split(refs, opts);
+  if (split.cost == std::numeric_limits<float>::infinity()) {
+    return refs.size();
+  }
+
+  const auto leaf_cost =
+      opts.intersection_cost * static_cast<float>(refs.size());
+  if (refs.size() <= opts.max_leaf_size && leaf_cost <= split.cost) {
+    return refs.size();
+  }
+
+  *split_axis = split.axis;
+  return apply_sah_split(refs, split, opts);
+}
 
+// Subtrees with fewer refs than this are always built on the current thread,
+// below this size the cost of starting a thread outweighs the work it saves
+constexpr size_t PARALLEL_BUILD_MIN_REFS = 4096;
+
+BVH BVH::build_bvh(std::vector<Object> &objs, size_t *total_nodes,
+                   const BVHOptions &opts) {
   if (objs.size() == 0) {
     throw std::runtime_error("invalid bvh length");
   }
 
-  if (objs.size() == 1) {
-    const auto obj = objs.front();
-    const auto bb = obj.primitive->aabb();
+  if (objs.size() > std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("too many objects for the BVH");
+  }
+
+  std::vector<BVHBuildRef> refs(objs.size());
+  for (size_t i = 0; i < objs.size(); ++i) {
+    const auto bb = objs[i].primitive->aabb();
+    refs[i] = {.bounds = bb,
+               .centroid = bb.centroid(),
+               .index = static_cast<uint32_t>(i)};
+  }
+
+  if (opts.split_method == SplitMethod::LBVH) {
+    return build_lbvh(refs, objs, opts, total_nodes);
+  }
+
+  if (opts.split_method == SplitMethod::SBVH) {
+    return build_sbvh(refs, objs, opts, total_nodes);
+  }
+
+  return build_range(refs, objs, opts, std::max<size_t>(opts.build_threads, 1),
+                     total_nodes);
+}
+
+BVH BVH::build_range(std::span<BVHBuildRef> refs,
+                     const std::vector<Object> &objs, const BVHOptions &opts,
+                     const size_t threads, size_t *total_nodes) {
+  const auto make_leaf = [&]() {
+    auto bb = AABB::empty();
+    std::vector<Object> leaf_objs;
+    leaf_objs.reserve(refs.size());
+    for (const auto &ref : refs) {
+      bb = AABB::surrounding_box(bb, ref.bounds);
+      leaf_objs.push_back(objs[ref.index]);
+    }
     *total_nodes += 1;
-    return BVH(NodeType::Leaf, bb, obj);
+    return BVH(NodeType::Leaf, bb, leaf_objs);
+  };
+
+  const auto fits_in_leaf = refs.size() <= opts.max_leaf_size;
+  if (refs.size() == 1 ||
+      (fits_in_leaf && opts.split_method == SplitMethod::Middle)) {
+    return make_leaf();
   }
 
-  const auto m = objs.begin() + objs.size() / 2;
-  // TODO: SAH split method
-  // partition the elements in the vector according to the split criteria.
-  // for now we will split at the midpoint of the minimums of the child bboxes.
-  // this is not really optimal but it will get the job done for the time being
-  //
-  // see figure 4.4 here:
-  // https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies
-  //
-  // and the section on the SAH split method (not implemented in this project)
-  // https://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies#TheSurfaceAreaHeuristic
-  std::nth_element(
-      objs.begin(), m, objs.end(), [axis](const auto &a, const auto &b) {
-        const auto box_left = a.primitive->aabb();
-        const auto box_right = b.primitive->aabb();
-        const auto left_midpoint =
-            std::midpoint(box_left.min[axis], box_left.max[axis]);
-        const auto right_midpoint =
-            std::midpoint(box_right.min[axis], box_right.max[axis]);
-
-        return left_midpoint - right_midpoint < 0.0;
-      });
+  auto m = refs.size();
+  size_t axis = 0;
+  if (opts.split_method == SplitMethod::SAH) {
+    m = partition_sah(refs, opts, &axis);
+
+    // the SAH decided a leaf is cheaper than any split
+    if (m == refs.size() && fits_in_leaf) {
+      return make_leaf();
+    }
+  }
 
-  // split off the vector in two pieces at the partition point
-  std::vector<Object> l_vec(objs.begin(), m);
-  std::vector<Object> r_vec(m, objs.end());
+  if (m == 0 || m == refs.size()) {
+    m = partition_middle(refs, &axis);
+  }
 
-  // construct the left and right subtrees
-  auto left = std::make_unique<BVH>(build_bvh(l_vec, total_nodes));
-  auto right = std::make_unique<BVH>(build_bvh(r_vec, total_nodes));
+  // the two halves of the range don't overlap, so the subtrees can be built
+  // independently. if there are threads to spare, the left subtree is built
+  // on a new thread while this one builds the right subtree. each thread
+  // keeps its own node count and they are summed afterwards
+  const auto l_refs = refs.first(m);
+  const auto r_refs = refs.subspan(m);
+  std::unique_ptr<BVH> left;
+  std::unique_ptr<BVH> right;
+
+  if (threads > 1 && refs.size() >= PARALLEL_BUILD_MIN_REFS) {
+    const auto l_threads = threads / 2;
+    size_t l_nodes = 0;
+    auto l_future = std::async(std::launch::async, [&]() {
+      return build_range(l_refs, objs, opts, l_threads, &l_nodes);
+    });
+    right = std::make_unique<BVH>(
+        build_range(r_refs, objs, opts, threads - l_threads, total_nodes));
+    left = std::make_unique<BVH>(l_future.get());
+    *total_nodes += l_nodes;
+  } else {
+    left = std::make_unique<BVH>(
+        build_range(l_refs, objs, opts, threads, total_nodes));
+    right = std::make_unique<BVH>(
+        build_range(r_refs, objs, opts, threads, total_nodes));
+  }
 
   *total_nodes += 1;
   const auto surrounding_box = AABB::surrounding_box(left->bbox, right->bbox);
   return BVH(NodeType::Internal, surrounding_box,
-             std::make_pair(std::move(left), std::move(right)));
+             std::make_pair(std::move(left), std::move(right)), axis);
 }
 
 std::optional<Hit> BVH::intersect(const Ray &r, const float t_min,
                                   const float t_max) const {
-  const auto inv_dir = 1.0f / r.direction().normalize();
+  const auto inv_dir = 1.0f / r.direction();
   if (this->bbox.hit(r, inv_dir, t_min, t_max)) {
     // we are an internal node -- check both child nodes and continue
     // traversing down the tree
@@ -112,14 +470,13 @@ std::optional<Hit> BVH::intersect(const Ray &r, const float t_min,
       }
     }
 
-    // we are a leaf node -- check if the ray intersects the leaf primitive
-    const auto obj = std::get<Object>(this->data);
-    const auto hit = obj.primitive->hit(r, t_min, t_max);
-    if (hit.has_value()) {
-      return {{
-          .hit = hit.value(),
-          .material = obj.material,
-      }};
+    // we are a leaf node -- check if the ray intersects the leaf primitives
+    const auto &objs = std::get<std::vector<Object>>(this->data);
+    Hit hit = {.hit = {Vec3::zeros(), Vec3::zeros(), 0.0}, .material = nullptr};
+    auto closest = t_max;
+    intersect_leaf(objs.data(), objs.size(), r, t_min, &closest, &hit);
+    if (hit.material != nullptr) {
+      return hit;
     }
   }
 
@@ -127,76 +484,775 @@ std::optional<Hit> BVH::intersect(const Ray &r, const float t_min,
   return std::nullopt;
 }
 
-FlatBVH::FlatBVH(std::vector<Object> &objs) {
-  size_t total_nodes = 0;
-  const auto bvh = BVH::build_bvh(objs, &total_nodes);
-  const FlatBVHNode def = {
-      .type = NodeType::Internal,
-      .bbox = AABB(),
-      .data = static_cast<size_t>(0),
-      .secondChildOffset = 0,
+/**
+ * Append a copy of the primitive to the array for its type, returning its
+ * index in the array
+ */
+template <typename T>
+uint32_t push_primitive(std::vector<T> *prims, const T &prim) {
+  if (prims->size() >= std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("too many primitives in the BVH leaves");
+  }
+  prims->push_back(prim);
+  return static_cast<uint32_t>(prims->size() - 1);
+}
+
+BVHLeaves::Leaf BVHLeaves::add(const std::vector<Object> &objs) {
+  std::vector<TriangleData> tris;
+  tris.reserve(objs.size());
+  for (const auto &o : objs) {
+    const auto tri = o.primitive->triangle_data();
+    if (!tri.has_value()) {
+      break;
+    }
+    tris.push_back(*tri);
+  }
+
+  if (tris.size() == objs.size()) {
+    // the triangles are referred to by their lane index across all blocks
+    const auto n_blocks =
+        (tris.size() + TriangleBlock::WIDTH - 1) / TriangleBlock::WIDTH;
+    if (blocks.size() + n_blocks >
+        std::numeric_limits<uint32_t>::max() / TriangleBlock::WIDTH) {
+      throw std::runtime_error("too many triangle blocks in the BVH leaves");
+    }
+    const auto offset = static_cast<uint32_t>(blocks.size());
+    for (size_t i = 0; i < tris.size(); i += TriangleBlock::WIDTH) {
+      auto &block = blocks.emplace_back();
+      for (size_t lane = 0; lane < TriangleBlock::WIDTH; ++lane) {
+        if (i + lane < tris.size()) {
+          block.set(lane, tris[i + lane]);
+          block_materials.push_back(objs[i + lane].material);
+          block_sources.push_back(objs[i + lane].primitive);
+        } else {
+          block_materials.push_back(nullptr);
+          block_sources.push_back(nullptr);
+        }
+      }
+    }
+    return {.offset = offset, .kind = LeafKind::Triangles};
+  }
+
+  std::vector<SphereData> sphere_list;
+  std::vector<const Material *> sphere_mats;
+  sphere_list.reserve(objs.size());
+  sphere_mats.reserve(objs.size());
+  for (const auto &o : objs) {
+    const auto sphere = o.primitive->sphere_data();
+    if (!sphere.has_value()) {
+      break;
+    }
+    sphere_list.push_back(*sphere);
+    sphere_mats.push_back(o.material);
+  }
+
+  if (sphere_list.size() == objs.size()) {
+    const auto offset = sphere_blocks.add(sphere_list, sphere_mats);
+    sphere_sources.resize(sphere_blocks.size() * SphereBlock::WIDTH, nullptr);
+    for (size_t i = 0; i < objs.size(); ++i) {
+      sphere_sources[offset * SphereBlock::WIDTH + i] = objs[i].primitive;
+    }
+    return {.offset = offset, .kind = LeafKind::Spheres};
+  }
+
+  if (entries.size() >= std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("too many objects in the BVH leaves");
+  }
+
+  const auto offset = static_cast<uint32_t>(entries.size());
+  for (const auto &o : objs) {
+    // this only runs once per object while flattening, so the casts don't
+    // matter for performance
+    const auto *p = o.primitive;
+    auto e = Entry{
+        .type = PrimitiveType::Other, .index = 0, .material = o.material};
+    if (const auto *sphere = dynamic_cast<const Sphere *>(p)) {
+      e.type = PrimitiveType::Sphere;
+      e.index = push_primitive(&spheres, *sphere);
+    } else if (const auto *tri = dynamic_cast<const Triangle *>(p)) {
+      e.type = PrimitiveType::Triangle;
+      e.index = push_primitive(&triangles, *tri);
+    } else if (const auto *wtri = dynamic_cast<const WatertightTriangle *>(p)) {
+      e.type = PrimitiveType::WatertightTriangle;
+      e.index = push_primitive(&watertight_triangles, *wtri);
+    } else if (const auto *mtri = dynamic_cast<const MeshTriangle *>(p)) {
+      e.type = PrimitiveType::MeshTriangle;
+      e.index = push_primitive(&mesh_triangles, *mtri);
+    } else if (const auto *quad = dynamic_cast<const Quad *>(p)) {
+      e.type = PrimitiveType::Quad;
+      e.index = push_primitive(&quads, *quad);
+    } else if (const auto *box = dynamic_cast<const Box *>(p)) {
+      e.type = PrimitiveType::Box;
+      e.index = push_primitive(&boxes, *box);
+    } else {
+      e.index = push_primitive(&others, p);
+    }
+    entries.push_back(e);
+    entry_sources.push_back(p);
+  }
+  return {.offset = offset, .kind = LeafKind::Entries};
+}
+
+bool BVHLeaves::intersect_entries(const uint32_t offset, const size_t count,
+                                  const Ray &r, const float t_min,
+                                  float *t_max, LeafHit *closest) const {
+  bool found = false;
+  for (size_t i = offset; i < offset + count; ++i) {
+    const auto hit_result = intersect_entry(entries[i], r, t_min, *t_max);
+    if (hit_result.has_value()) {
+      found = true;
+      *t_max = hit_result->t;
+      *closest = {.hit = *hit_result,
+                  .id = static_cast<uint32_t>(i),
+                  .kind = LeafKind::Entries};
+    }
+  }
+  return found;
+}
+
+bool BVHLeaves::occluded_entries(const uint32_t offset, const size_t count,
+                                 const Ray &r, const float t_min,
+                                 const float t_max) const {
+  for (size_t i = offset; i < offset + count; ++i) {
+    const auto &e = entries[i];
+
+    // only the primitives that don't go through the typed arrays can have a
+    // faster any-hit test than their closest hit test
+    const auto hit = e.type == PrimitiveType::Other
+                         ? others[e.index]->occluded(r, t_min, t_max)
+                         : intersect_entry(e, r, t_min, t_max).has_value();
+    if (hit) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Intersection BVHLeaves::surface_entry(const Entry &e, const Ray &r,
+                                      const PrimitiveHit &h) const {
+  switch (e.type) {
+  case PrimitiveType::Sphere:
+    return spheres[e.index].surface(r, h);
+  case PrimitiveType::Triangle:
+    return triangles[e.index].surface(r, h);
+  case PrimitiveType::WatertightTriangle:
+    return watertight_triangles[e.index].surface(r, h);
+  case PrimitiveType::MeshTriangle:
+    return mesh_triangles[e.index].surface(r, h);
+  case PrimitiveType::Quad:
+    return quads[e.index].surface(r, h);
+  case PrimitiveType::Box:
+    return boxes[e.index].surface(r, h);
+  case PrimitiveType::Other:
+    break;
+  }
+  return others[e.index]->surface(r, h);
+}
+
+Hit BVHLeaves::surface(const Ray &r, const LeafHit &closest) const {
+  switch (closest.kind) {
+  case LeafKind::Entries: {
+    const auto &e = entries[closest.id];
+    return {.hit = surface_entry(e, r, closest.hit), .material = e.material};
+  }
+  case LeafKind::Spheres:
+    return {.hit = sphere_blocks.surface(r, closest.id, closest.hit.t),
+            .material = sphere_blocks.material(closest.id)};
+  case LeafKind::Triangles:
+    break;
+  }
+
+  const auto &block = blocks[closest.id / TriangleBlock::WIDTH];
+  const auto t = closest.hit.t;
+  return {
+      .hit = {r.origin() + r.direction() * t,
+              block.normal(closest.id % TriangleBlock::WIDTH), t},
+      .material = block_materials[closest.id],
   };
+}
+
+size_t BVHLeaves::count(const PrimitiveType type) const {
+  switch (type) {
+  case PrimitiveType::Sphere:
+    return spheres.size();
+  case PrimitiveType::Triangle:
+    return triangles.size();
+  case PrimitiveType::WatertightTriangle:
+    return watertight_triangles.size();
+  case PrimitiveType::MeshTriangle:
+    return mesh_triangles.size();
+  case PrimitiveType::Quad:
+    return quads.size();
+  case PrimitiveType::Box:
+    return boxes.size();
+  case PrimitiveType::Other:
+    break;
+  }
+  return others.size();
+}
+
+size_t BVHLeaves::memory() const {
+  return entries.size() * sizeof(Entry) + spheres.size() * sizeof(Sphere) +
+         triangles.size() * sizeof(Triangle) +
+         watertight_triangles.size() * sizeof(WatertightTriangle) +
+         mesh_triangles.size() * sizeof(MeshTriangle) +
+         quads.size() * sizeof(Quad) + boxes.size() * sizeof(Box) +
+         others.size() * sizeof(const Primitive *) +
+         blocks.size() * sizeof(TriangleBlock) +
+         block_materials.size() * sizeof(const Material *) +
+         sphere_blocks.memory() +
+         (entry_sources.size() + block_sources.size() +
+          sphere_sources.size()) *
+             sizeof(const Primitive *);
+}
+
+AABB BVHLeaves::refit(const uint32_t offset, const size_t count,
+                      const LeafKind kind) {
+  auto bounds = AABB::empty();
+
+  if (kind == LeafKind::Triangles) {
+    for (size_t i = 0; i < count; ++i) {
+      const auto id = offset * TriangleBlock::WIDTH + i;
+      const auto *p = block_sources[id];
+      blocks[id / TriangleBlock::WIDTH].set(id % TriangleBlock::WIDTH,
+                                            *p->triangle_data());
+      bounds = AABB::surrounding_box(bounds, p->aabb());
+    }
+    return bounds;
+  }
+
+  if (kind == LeafKind::Spheres) {
+    for (size_t i = 0; i < count; ++i) {
+      const auto id = offset * SphereBlock::WIDTH + i;
+      const auto *p = sphere_sources[id];
+      sphere_blocks.set(id, *p->sphere_data());
+      bounds = AABB::surrounding_box(bounds, p->aabb());
+    }
+    return bounds;
+  }
+
+  // the type of each entry was found with a dynamic_cast when it was added,
+  // so the static casts here are safe
+  for (size_t i = offset; i < offset + count; ++i) {
+    const auto &e = entries[i];
+    const auto *p = entry_sources[i];
+    switch (e.type) {
+    case PrimitiveType::Sphere:
+      spheres[e.index] = *static_cast<const Sphere *>(p);
+      break;
+    case PrimitiveType::Triangle:
+      triangles[e.index] = *static_cast<const Triangle *>(p);
+      break;
+    case PrimitiveType::WatertightTriangle:
+      watertight_triangles[e.index] =
+          *static_cast<const WatertightTriangle *>(p);
+      break;
+    case PrimitiveType::MeshTriangle:
+      mesh_triangles[e.index] = *static_cast<const MeshTriangle *>(p);
+      break;
+    case PrimitiveType::Quad:
+      quads[e.index] = *static_cast<const Quad *>(p);
+      break;
+    case PrimitiveType::Box:
+      boxes[e.index] = *static_cast<const Box *>(p);
+      break;
+    case PrimitiveType::Other:
+      break;
+    }
+    bounds = AABB::surrounding_box(bounds, p->aabb());
+  }
+  return bounds;
+}
+
+AABB BVHLeaves::source_bounds(const uint32_t offset, const size_t count,
+                              const LeafKind kind) const {
+  auto bounds = AABB::empty();
+  for (const auto &o : objects(offset, count, kind)) {
+    bounds = AABB::surrounding_box(bounds, o.primitive->aabb());
+  }
+  return bounds;
+}
+
+std::vector<Object> BVHLeaves::objects(const uint32_t offset,
+                                       const size_t count,
+                                       const LeafKind kind) const {
+  std::vector<Object> objs;
+  objs.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    if (kind == LeafKind::Triangles) {
+      const auto id = offset * TriangleBlock::WIDTH + i;
+      objs.push_back(
+          {.primitive = block_sources[id], .material = block_materials[id]});
+    } else if (kind == LeafKind::Spheres) {
+      const auto id = offset * SphereBlock::WIDTH + i;
+      objs.push_back({.primitive = sphere_sources[id],
+                      .material = sphere_blocks.material(
+                          static_cast<uint32_t>(id))});
+    } else {
+      objs.push_back({.primitive = entry_sources[offset + i],
+                      .material = entries[offset + i].material});
+    }
+  }
+  return objs;
+}
+
+FlatBVH::FlatBVH(std::vector<Object> &objs, const BVHOptions &_opts)
+    : opts(_opts) {
+  size_t total_nodes = 0;
+  const auto bvh = BVH::build_bvh(objs, &total_nodes, opts);
+
+  // one extra node pads the root so that the pairs of children start on a
+  // cache line
+  if (total_nodes + 1 > std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("too many BVH nodes");
+  }
+
+  nodes.resize(total_nodes + 1, FlatBVHNode());
+  store_node(bvh, 0);
+  uint32_t next = 2;
+  layout(bvh, 0, &next);
+  update_links();
+  update_built_costs(0);
+}
+
+void FlatBVH::update_links() {
+  parents.assign(nodes.size() / 2, 0);
+
+  // the children are always stored after their parent, so the depths can be
+  // filled in by going through the nodes in order. the padding node after
+  // the root has no children
+  std::vector<uint32_t> depths(nodes.size() / 2, 0);
+  uint32_t max_depth = 0;
+  for (uint32_t i = 0; i < nodes.size(); ++i) {
+    const auto &node = nodes[i];
+    if (node.nObjects > 0 || i == 1) {
+      continue;
+    }
+
+    const auto pair = node.childOffset / 2;
+    parents[pair] = i;
+    depths[pair] = i < 2 ? 1 : depths[i / 2] + 1;
+    max_depth = std::max(max_depth, depths[pair]);
+  }
 
-  nodes = std::vector<FlatBVHNode>(total_nodes, def);
-  size_t offset = 0;
-  recursive_flatten(bvh, &offset);
+  // a ray can have one node on the stack for each level of the tree
+  stackless =
+      opts.traversal == Traversal::Stackless || max_depth >= STACK_SIZE;
 }
 
-size_t FlatBVH::recursive_flatten(const BVH &node, size_t *offset) {
-  FlatBVHNode *flatNode = &nodes[*offset];
+void FlatBVH::store_node(const BVH &node, const uint32_t index) {
+  auto *flatNode = &nodes[index];
   flatNode->bbox = node.aabb();
-  flatNode->type = node.node_type();
 
-  const size_t myOffset = *offset;
-  *offset += 1;
+  if (node.node_type() == NodeType::Leaf) {
+    const auto &objs = std::get<std::vector<Object>>(node.get_data());
+    const auto leaf = leaves.add(objs);
+    flatNode->objectsOffset = leaf.offset;
+    flatNode->nObjects = static_cast<uint16_t>(objs.size());
+    flatNode->kind = static_cast<uint8_t>(leaf.kind);
+  } else {
+    flatNode->axis = static_cast<uint8_t>(node.split_axis());
+    flatNode->nObjects = 0;
+  }
+}
 
+void FlatBVH::layout(const BVH &root, const uint32_t index, uint32_t *next) {
+  if (opts.node_layout == NodeLayout::Treelet) {
+    layout_treelets(root, index, next);
+  } else {
+    layout_depth_first(root, index, next);
+  }
+}
+
+void FlatBVH::layout_depth_first(const BVH &node, const uint32_t index,
+                                 uint32_t *next) {
   if (node.node_type() == NodeType::Leaf) {
-    flatNode->data = std::get<Object>(node.get_data());
+    return;
+  }
+
+  const auto &[left, right] = std::get<BVHPair>(node.get_data());
+  const auto first = *next;
+  *next += 2;
+  nodes[index].childOffset = first;
+  store_node(*left, first);
+  store_node(*right, first + 1);
+  layout_depth_first(*left, first, next);
+  layout_depth_first(*right, first + 1, next);
+}
+
+void FlatBVH::layout_treelets(const BVH &root, const uint32_t index,
+                              uint32_t *next) {
+  // an internal node that has been stored, but whose children haven't
+  struct Pending {
+    const BVH *node;
+    uint32_t index;
+    float area;
+  };
+  const auto pending = [&](const BVH &node, const uint32_t i) {
+    return Pending{
+        .node = &node, .index = i, .area = node.aabb().surface_area()};
+  };
+  const auto smaller = [](const Pending &a, const Pending &b) {
+    return a.area < b.area;
+  };
+
+  if (root.node_type() == NodeType::Leaf) {
+    return;
+  }
+
+  std::vector<Pending> roots = {pending(root, index)};
+  std::vector<Pending> treelet;
+  while (!roots.empty()) {
+    treelet = {roots.back()};
+    roots.pop_back();
+
+    for (size_t pairs = 0; pairs < TREELET_PAIRS && !treelet.empty();
+         ++pairs) {
+      std::pop_heap(treelet.begin(), treelet.end(), smaller);
+      const auto p = treelet.back();
+      treelet.pop_back();
+
+      const auto &[left, right] = std::get<BVHPair>(p.node->get_data());
+      const auto first = *next;
+      *next += 2;
+      nodes[p.index].childOffset = first;
+      store_node(*left, first);
+      store_node(*right, first + 1);
+
+      for (const auto &[child, i] :
+           {std::pair{left.get(), first}, std::pair{right.get(), first + 1}}) {
+        if (child->node_type() == NodeType::Internal) {
+          treelet.push_back(pending(*child, i));
+          std::push_heap(treelet.begin(), treelet.end(), smaller);
+        }
+      }
+    }
+
+    // the leftover subtrees are sorted by area, so the largest one ends up
+    // at the back of the stack and gets the treelet right after this one
+    std::sort_heap(treelet.begin(), treelet.end(), smaller);
+    roots.insert(roots.end(), treelet.begin(), treelet.end());
+  }
+}
+
+float FlatBVH::update_costs(const uint32_t index, const bool refit_bounds,
+                            std::vector<float> *cost, AABB *bounds) {
+  auto *node = &nodes[index];
+  float sah = 0.0f;
+  if (node->nObjects > 0) {
+    const auto kind = static_cast<BVHLeaves::LeafKind>(node->kind);
+    *bounds = refit_bounds
+                  ? leaves.refit(node->objectsOffset, node->nObjects, kind)
+                  : leaves.source_bounds(node->objectsOffset, node->nObjects,
+                                         kind);
+    sah = opts.intersection_cost * static_cast<float>(node->nObjects) *
+          bounds->surface_area();
   } else {
-    // Create interior flattened BVH node
-    const auto &[left, right] = std::get<BVHPair>(node.get_data());
-    recursive_flatten(*left, offset);
-    flatNode->secondChildOffset = recursive_flatten(*right, offset);
+    const auto first = node->childOffset;
+    auto left = AABB::empty();
+    auto right = AABB::empty();
+    sah = update_costs(first, refit_bounds, cost, &left) +
+          update_costs(first + 1, refit_bounds, cost, &right);
+    *bounds = AABB::surrounding_box(left, right);
+    sah += opts.traversal_cost * bounds->surface_area();
+  }
+
+  if (refit_bounds) {
+    node->bbox = *bounds;
+  }
+
+  // a flat leaf has no surface area, but it's also as cheap as it gets
+  const auto area = bounds->surface_area();
+  (*cost)[index] = area > 0.0f ? sah / area : 0.0f;
+  return sah;
+}
+
+size_t FlatBVH::rebuild_degraded(const uint32_t index, const float threshold,
+                                 const std::vector<float> &cost) {
+  const auto &node = nodes[index];
+  if (node.nObjects > 0) {
+    return 0;
+  }
+
+  if (cost[index] > threshold * built_cost[index]) {
+    rebuild_subtree(index);
+    return 1;
   }
 
-  return myOffset;
+  const auto first = node.childOffset;
+  return rebuild_degraded(first, threshold, cost) +
+         rebuild_degraded(first + 1, threshold, cost);
+}
+
+void FlatBVH::collect_objects(const uint32_t index,
+                              std::vector<Object> *objs) const {
+  const auto &node = nodes[index];
+  if (node.nObjects > 0) {
+    const auto leaf = leaves.objects(
+        node.objectsOffset, node.nObjects,
+        static_cast<BVHLeaves::LeafKind>(node.kind));
+    objs->insert(objs->end(), leaf.begin(), leaf.end());
+    return;
+  }
+  collect_objects(node.childOffset, objs);
+  collect_objects(node.childOffset + 1, objs);
+}
+
+void FlatBVH::rebuild_subtree(const uint32_t index) {
+  std::vector<Object> objs;
+  collect_objects(index, &objs);
+
+  // the spatial split builder may have put the same object in several
+  // leaves of the subtree
+  std::sort(objs.begin(), objs.end(), [](const Object &a, const Object &b) {
+    return a.primitive < b.primitive;
+  });
+  objs.erase(std::unique(objs.begin(), objs.end(),
+                         [](const Object &a, const Object &b) {
+                           return a.primitive == b.primitive;
+                         }),
+             objs.end());
+
+  size_t total_nodes = 0;
+  const auto bvh = BVH::build_bvh(objs, &total_nodes, opts);
+
+  // the root of the new subtree takes the place of the old one, so the
+  // number of nodes added stays even and the pairs stay on cache lines
+  const auto first = nodes.size();
+  if (first + total_nodes - 1 > std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("too many BVH nodes");
+  }
+  nodes.resize(first + total_nodes - 1, FlatBVHNode());
+  store_node(bvh, index);
+  auto next = static_cast<uint32_t>(first);
+  layout(bvh, index, &next);
+
+  update_built_costs(index);
+}
+
+void FlatBVH::update_built_costs(const uint32_t index) {
+  auto bounds = AABB::empty();
+  built_cost.resize(nodes.size());
+  update_costs(index, false, &built_cost, &bounds);
+}
+
+size_t FlatBVH::refit(const float rebuild_threshold) {
+  auto bounds = AABB::empty();
+  std::vector<float> cost(nodes.size());
+  update_costs(0, true, &cost, &bounds);
+  if (rebuild_threshold <= 0.0f) {
+    return 0;
+  }
+
+  const auto rebuilt = rebuild_degraded(0, rebuild_threshold, cost);
+  if (rebuilt > 0) {
+    update_links();
+  }
+  return rebuilt;
+}
+
+template <typename Leaf>
+void FlatBVH::traverse_stackless(const Ray &r, const float t_min,
+                                 const float *t_max, const Leaf &leaf) const {
+  const auto inv_dir = 1.0f / r.direction();
+  const bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0,
+                              inv_dir.z() < 0};
+
+  // the child nearest to the ray origin is visited first, like in the stack
+  // traversal, so that the closest hit is found early
+  const auto near_child = [&](const FlatBVHNode &node) {
+    return node.childOffset + (dir_is_neg[node.axis] ? 1u : 0u);
+  };
+
+  const auto &root = nodes[0];
+  if (!root.bbox.hit(r, inv_dir, t_min, *t_max)) {
+    return;
+  }
+  if (root.nObjects > 0) {
+    leaf(root);
+    return;
+  }
+
+  // each node is entered either from its parent (as the near child), from
+  // its sibling (as the far child), or from one of its children on the way
+  // back up. the siblings are stored in pairs starting at even indices, so
+  // the sibling of a node is the index with the lowest bit flipped
+  enum class From { Parent, Sibling, Child };
+  auto from = From::Parent;
+  auto current = near_child(root);
+  while (true) {
+    if (from == From::Child) {
+      if (current == 0) {
+        return;
+      }
+
+      const auto parent = parents[current / 2];
+      if (current == near_child(nodes[parent])) {
+        current ^= 1;
+        from = From::Sibling;
+      } else {
+        current = parent;
+      }
+      continue;
+    }
+
+    const auto &node = nodes[current];
+    if (node.bbox.hit(r, inv_dir, t_min, *t_max)) {
+      if (node.nObjects == 0) {
+        current = near_child(node);
+        from = From::Parent;
+        continue;
+      }
+      if (leaf(node)) {
+        return;
+      }
+    }
+
+    // done with this subtree. the far child is visited after the near one,
+    // and the parent is done once both of its children are
+    if (from == From::Parent) {
+      current ^= 1;
+      from = From::Sibling;
+    } else {
+      current = parents[current / 2];
+      from = From::Child;
+    }
+  }
+}
+
+template <typename Visit>
+std::optional<Hit> FlatBVH::traverse(const Ray &r, const float t_min,
+                                     const float t_max,
+                                     const Visit &visit) const {
+  // only the distance and primitive of the closest hit are tracked during
+  // traversal, its surface is computed once at the end
+  BVHLeaves::LeafHit closest = {};
+  bool found = false;
+
+  auto min_so_far = t_max;
+
+  // the inverse direction is not normalized so that the distances from the
+  // slab test are in the same units as the primitive hits. this lets us skip
+  // nodes that are further away than the closest hit found so far
+  const auto inv_dir = 1.0f / r.direction();
+  const bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0,
+                              inv_dir.z() < 0};
+
+  // Follow ray through BVH nodes to find primitive intersections
+  size_t toVisitOffset = 0;
+  uint32_t currentNodeIndex = 0;
+  uint32_t nodesToVisit[STACK_SIZE];
+  while (true) {
+    const FlatBVHNode *node = &nodes[currentNodeIndex];
+    visit(currentNodeIndex);
+
+    if (node->bbox.hit(r, inv_dir, t_min, min_so_far)) {
+      if (node->nObjects > 0) {
+        found = leaves.intersect(node->objectsOffset, node->nObjects,
+                                 static_cast<BVHLeaves::LeafKind>(node->kind),
+                                 r, t_min, &min_so_far, &closest) ||
+                found;
+
+        if (toVisitOffset == 0) {
+          break;
+        }
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
+
+      } else {
+        // the first child holds the objects on the low side of the split
+        // axis. visit the child nearest to the ray origin first so that the
+        // closest hit is found early and the far child can be culled
+        if (dir_is_neg[node->axis]) {
+          nodesToVisit[toVisitOffset++] = node->childOffset;
+          currentNodeIndex = node->childOffset + 1;
+        } else {
+          nodesToVisit[toVisitOffset++] = node->childOffset + 1;
+          currentNodeIndex = node->childOffset;
+        }
+      }
+    } else {
+      if (toVisitOffset == 0) {
+        break;
+      }
+      currentNodeIndex = nodesToVisit[--toVisitOffset];
+    }
+  }
+
+  if (!found) {
+    return std::nullopt;
+  }
+  return leaves.surface(r, closest);
 }
 
 std::optional<Hit> FlatBVH::intersect(const Ray &r, const float t_min,
                                       const float t_max) const {
-  std::optional<Hit> curr_hit = {{
-      .hit = {Vec3::zeros(), Vec3::zeros(), 0.0},
-      .material = nullptr,
-  }};
+  if (!stackless) {
+    return traverse(r, t_min, t_max, [](size_t) {});
+  }
 
+  BVHLeaves::LeafHit closest = {};
+  bool found = false;
   auto min_so_far = t_max;
+  traverse_stackless(r, t_min, &min_so_far, [&](const FlatBVHNode &node) {
+    found = leaves.intersect(node.objectsOffset, node.nObjects,
+                             static_cast<BVHLeaves::LeafKind>(node.kind), r,
+                             t_min, &min_so_far, &closest) ||
+            found;
+    return false;
+  });
 
-  const auto inv_dir = 1.0f / r.direction().normalize();
-  // Follow ray through BVH nodes to find primitive intersections
+  if (!found) {
+    return std::nullopt;
+  }
+  return leaves.surface(r, closest);
+}
+
+std::optional<Hit> FlatBVH::trace(const Ray &r, const float t_min,
+                                  const float t_max,
+                                  std::vector<uint32_t> *visited) const {
+  return traverse(r, t_min, t_max, [&](const size_t index) {
+    visited->push_back(static_cast<uint32_t>(index));
+  });
+}
+
+bool FlatBVH::occluded(const Ray &r, const float t_min,
+                       const float t_max) const {
+  if (stackless) {
+    auto occluded = false;
+    traverse_stackless(r, t_min, &t_max, [&](const FlatBVHNode &node) {
+      occluded = leaves.occluded(node.objectsOffset, node.nObjects,
+                                 static_cast<BVHLeaves::LeafKind>(node.kind),
+                                 r, t_min, t_max);
+      return occluded;
+    });
+    return occluded;
+  }
+
+  const auto inv_dir = 1.0f / r.direction();
+
+  // any hit will do, so the children are visited in the order they're stored
+  // in and the traversal stops at the first leaf with a hit
   size_t toVisitOffset = 0;
-  size_t currentNodeIndex = 0;
-  size_t nodesToVisit[64];
+  uint32_t currentNodeIndex = 0;
+  uint32_t nodesToVisit[STACK_SIZE];
   while (true) {
     const FlatBVHNode *node = &nodes[currentNodeIndex];
 
     if (node->bbox.hit(r, inv_dir, t_min, t_max)) {
-      if (node->type == NodeType::Leaf) {
-        const auto obj = std::get<Object>(node->data);
-        const auto hit_result = obj.primitive->hit(r, t_min, min_so_far);
-        if (hit_result.has_value()) {
-          curr_hit->hit = *hit_result;
-          curr_hit->material = obj.material;
-          min_so_far = hit_result->t;
+      if (node->nObjects > 0) {
+        if (leaves.occluded(node->objectsOffset, node->nObjects,
+                            static_cast<BVHLeaves::LeafKind>(node->kind), r,
+                            t_min, t_max)) {
+          return true;
         }
 
         if (toVisitOffset == 0) {
           break;
         }
         currentNodeIndex = nodesToVisit[--toVisitOffset];
-
       } else {
-        nodesToVisit[toVisitOffset++] = node->secondChildOffset;
-        currentNodeIndex += 1;
+        nodesToVisit[toVisitOffset++] = node->childOffset + 1;
+        currentNodeIndex = node->childOffset;
       }
     } else {
       if (toVisitOffset == 0) {
@@ -206,10 +1262,13 @@ std::optional<Hit> FlatBVH::intersect(const Ray &r, const float t_min,
     }
   }
 
-  if (curr_hit->material != nullptr) {
-    return curr_hit;
-  }
-  return std::nullopt;
+  return false;
+}
+
+AcceleratorMemory FlatBVH::memory() const {
+  return {.nodes = nodes.size() * sizeof(FlatBVHNode) +
+                   parents.size() * sizeof(uint32_t),
+          .leaves = leaves.memory()};
 }
 
 } // namespace ronald
@@ -0,0 +1,194 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bvh.hpp"
+
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace ronald {
+
+constexpr char CACHE_MAGIC[8] = {'R', 'O', 'N', 'B', 'V', 'H', '\0', '\0'};
+
+void FlatBVH::save(const std::string &path,
+                   const std::vector<Object> &objs) const {
+  std::unordered_map<const Primitive *, uint32_t> indices;
+  indices.reserve(objs.size());
+  for (size_t i = 0; i < objs.size(); ++i) {
+    indices.emplace(objs[i].primitive, static_cast<uint32_t>(i));
+  }
+
+  // the leaves point into the leaf storage, which isn't saved, so they are
+  // pointed at their object indices in the file instead
+  auto stored = std::vector<FlatBVHNode>(nodes.begin(), nodes.end());
+  std::vector<uint32_t> refs;
+  for (auto &node : stored) {
+    if (node.nObjects == 0) {
+      continue;
+    }
+
+    const auto leaf =
+        leaves.objects(node.objectsOffset, node.nObjects,
+                       static_cast<BVHLeaves::LeafKind>(node.kind));
+    node.objectsOffset = static_cast<uint32_t>(refs.size());
+    for (const auto &o : leaf) {
+      const auto it = indices.find(o.primitive);
+      if (it == indices.end()) {
+        throw std::runtime_error("BVH object is missing from the objects");
+      }
+      refs.push_back(it->second);
+    }
+  }
+
+  auto header = CacheHeader{
+      .magic = {},
+      .version = CACHE_VERSION,
+      .node_size = sizeof(FlatBVHNode),
+      .n_objects = objs.size(),
+      .n_nodes = stored.size(),
+      .n_refs = refs.size(),
+  };
+  std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+
+  // write to a temporary file first, so that a render started at the same
+  // time never sees a partially written cache
+  const auto parent = std::filesystem::path(path).parent_path();
+  if (!parent.empty()) {
+    std::filesystem::create_directories(parent);
+  }
+
+  const auto tmp = path + ".tmp";
+  std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(stored.data()),
+            static_cast<std::streamsize>(stored.size() * sizeof(FlatBVHNode)));
+  out.write(reinterpret_cast<const char *>(refs.data()),
+            static_cast<std::streamsize>(refs.size() * sizeof(uint32_t)));
+  out.close();
+  if (!out) {
+    throw std::runtime_error("Failed to write BVH cache \"" + tmp + "\"");
+  }
+  std::filesystem::rename(tmp, path);
+}
+
+bool FlatBVH::read_cache(const std::span<const std::byte> file,
+                         const std::vector<Object> &objs) {
+  CacheHeader header;
+  if (file.size() < sizeof(header)) {
+    return false;
+  }
+  std::memcpy(&header, file.data(), sizeof(header));
+
+  if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+      header.version != CACHE_VERSION ||
+      header.node_size != sizeof(FlatBVHNode) ||
+      header.n_objects != objs.size()) {
+    return false;
+  }
+
+  // the counts are checked against the file size one at a time so that
+  // multiplying them can't overflow
+  const auto body = file.size() - sizeof(header);
+  if (header.n_nodes < 2 || header.n_nodes % 2 != 0 ||
+      header.n_nodes > body / sizeof(FlatBVHNode) ||
+      header.n_refs > body / sizeof(uint32_t) ||
+      body != header.n_nodes * sizeof(FlatBVHNode) +
+                  header.n_refs * sizeof(uint32_t)) {
+    return false;
+  }
+
+  const auto n_nodes = static_cast<size_t>(header.n_nodes);
+  const auto *data = file.data() + sizeof(header);
+  nodes.resize(n_nodes);
+  std::memcpy(nodes.data(), data, n_nodes * sizeof(FlatBVHNode));
+  std::vector<uint32_t> refs(static_cast<size_t>(header.n_refs));
+  std::memcpy(refs.data(), data + n_nodes * sizeof(FlatBVHNode),
+              refs.size() * sizeof(uint32_t));
+
+  std::vector<Object> leaf;
+  for (size_t i = 0; i < n_nodes; ++i) {
+    auto &node = nodes[i];
+
+    // the children always come after their parent, so the traversal can't
+    // loop. the padding node after the root is never visited. the offset is
+    // widened first so that a corrupt one can't wrap around
+    if (node.nObjects == 0) {
+      const auto first = static_cast<size_t>(node.childOffset);
+      if (i != 1 && (first <= i || first + 1 >= n_nodes)) {
+        return false;
+      }
+      continue;
+    }
+
+    const auto offset = static_cast<size_t>(node.objectsOffset);
+    if (offset + node.nObjects > refs.size()) {
+      return false;
+    }
+
+    leaf.clear();
+    for (size_t j = offset; j < offset + node.nObjects; ++j) {
+      if (refs[j] >= objs.size()) {
+        return false;
+      }
+      leaf.push_back(objs[refs[j]]);
+    }
+
+    const auto stored = leaves.add(leaf);
+    node.objectsOffset = stored.offset;
+    node.kind = static_cast<uint8_t>(stored.kind);
+  }
+
+  update_links();
+  update_built_costs(0);
+  return true;
+}
+
+std::unique_ptr<FlatBVH> FlatBVH::load(const std::string &path,
+                                       const std::vector<Object> &objs,
+                                       const BVHOptions &opts) {
+  const auto fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  struct stat st = {};
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  // the mapping stays valid after the file is closed
+  const auto size = static_cast<size_t>(st.st_size);
+  auto *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return nullptr;
+  }
+
+  auto bvh = std::unique_ptr<FlatBVH>(new FlatBVH(opts));
+  const auto valid =
+      bvh->read_cache({static_cast<const std::byte *>(map), size}, objs);
+  munmap(map, size);
+  return valid ? std::move(bvh) : nullptr;
+}
+
+} // namespace ronald
@@ -0,0 +1,126 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bvh.hpp"
+
+#include <iomanip>
+
+namespace ronald {
+
+void BVHStats::print(std::ostream &out) const {
+  const auto mib = [](const size_t bytes) {
+    return static_cast<double>(bytes) / (1024.0 * 1024.0);
+  };
+
+  out << "BVH statistics:\n";
+  out << "\tnodes: " << internal_nodes + leaves << " (" << internal_nodes
+      << " internal, " << leaves << " leaves)\n";
+  out << "\tdepth: " << max_depth << " max, " << std::fixed
+      << std::setprecision(2) << average_depth << " average\n";
+  out << "\tleaf sizes:";
+  for (size_t i = 0; i < leaf_sizes.size(); ++i) {
+    if (leaf_sizes[i] > 0) {
+      out << ' ' << i << ": " << leaf_sizes[i];
+    }
+  }
+  out << '\n';
+  out << std::setprecision(4);
+  out << "\tSAH cost: " << sah_cost << '\n';
+  out << "\tsibling overlap: " << sibling_overlap << '\n';
+  out << std::setprecision(2);
+  out << "\tmemory: " << mib(memory.nodes) << "MiB of nodes, "
+      << mib(memory.leaves) << "MiB of leaves" << std::defaultfloat
+      << std::endl;
+}
+
+void FlatBVH::add_stats(const uint32_t index, const size_t depth,
+                        BVHStats *stats) const {
+  const auto &node = nodes[index];
+  const auto area = static_cast<double>(node.bbox.surface_area());
+
+  if (node.nObjects > 0) {
+    stats->leaves += 1;
+    stats->max_depth = std::max(stats->max_depth, depth);
+    stats->average_depth += static_cast<double>(depth);
+    if (stats->leaf_sizes.size() <= node.nObjects) {
+      stats->leaf_sizes.resize(node.nObjects + 1u);
+    }
+    stats->leaf_sizes[node.nObjects] += 1;
+    stats->sah_cost +=
+        opts.intersection_cost * static_cast<double>(node.nObjects) * area;
+    return;
+  }
+
+  const auto &left = nodes[node.childOffset].bbox;
+  const auto &right = nodes[node.childOffset + 1].bbox;
+  const auto overlap = AABB::intersection(left, right);
+  if (!overlap.is_empty()) {
+    stats->sibling_overlap += static_cast<double>(overlap.surface_area());
+  }
+
+  stats->internal_nodes += 1;
+  stats->sah_cost += opts.traversal_cost * area;
+  add_stats(node.childOffset, depth + 1, stats);
+  add_stats(node.childOffset + 1, depth + 1, stats);
+}
+
+BVHStats FlatBVH::stats() const {
+  auto stats = BVHStats();
+  add_stats(0, 0, &stats);
+
+  const auto root_area = static_cast<double>(nodes[0].bbox.surface_area());
+  if (root_area > 0.0) {
+    stats.sah_cost /= root_area;
+    stats.sibling_overlap /= root_area;
+  }
+  stats.average_depth /= static_cast<double>(stats.leaves);
+  stats.memory = memory();
+  return stats;
+}
+
+void FlatBVH::write_json(const uint32_t index, std::ostream &out) const {
+  const auto &node = nodes[index];
+  const auto &b = node.bbox;
+  out << R"({"bounds":{"min":[)" << b.min.x() << ',' << b.min.y() << ','
+      << b.min.z() << R"(],"max":[)" << b.max.x() << ',' << b.max.y() << ','
+      << b.max.z() << "]},";
+
+  if (node.nObjects > 0) {
+    const auto kind = static_cast<BVHLeaves::LeafKind>(node.kind);
+    out << R"("objects":)" << node.nObjects << R"(,"kind":")"
+        << (kind == BVHLeaves::LeafKind::Triangles ? "triangles"
+            : kind == BVHLeaves::LeafKind::Spheres ? "spheres"
+                                                   : "entries")
+        << "\"}";
+    return;
+  }
+
+  out << R"("children":[)";
+  write_json(node.childOffset, out);
+  out << ',';
+  write_json(node.childOffset + 1, out);
+  out << "]}";
+}
+
+void FlatBVH::dump_json(std::ostream &out) const {
+  // enough digits that the bounds read back exactly
+  const auto precision = out.precision(9);
+  write_json(0, out);
+  out << '\n';
+  out.precision(precision);
+}
+
+} // namespace ronald
@@ -0,0 +1,297 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "grid.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+namespace ronald {
+
+Grid::Grid(const std::vector<Object> &objs, const BVHOptions &opts)
+    : bounds(AABB::empty()) {
+  const auto obj_bounds = fit(objs, opts.grid_density);
+  if (objs.empty()) {
+    return;
+  }
+
+  // turn the counts into the start of each cell's range of object indices
+  // and fill the ranges in
+  const auto n_cells = resolution[0] * resolution[1] * resolution[2];
+  const auto starts = cell_starts(obj_bounds);
+  std::vector<uint32_t> refs(starts[n_cells]);
+  auto next = std::vector<size_t>(starts.begin(), starts.end() - 1);
+  for (size_t i = 0; i < objs.size(); ++i) {
+    for_each_cell(obj_bounds[i], [&](const size_t cell) {
+      refs[next[cell]++] = static_cast<uint32_t>(i);
+    });
+  }
+
+  cells.resize(n_cells, {.offset = 0,
+                         .count = 0,
+                         .kind = BVHLeaves::LeafKind::Entries});
+  std::vector<Object> cell_objs;
+  for (size_t i = 0; i < n_cells; ++i) {
+    if (starts[i] == starts[i + 1]) {
+      continue;
+    }
+
+    cell_objs.clear();
+    for (auto j = starts[i]; j < starts[i + 1]; ++j) {
+      cell_objs.push_back(objs[refs[j]]);
+    }
+    const auto leaf = leaves.add(cell_objs);
+    cells[i] = {.offset = leaf.offset,
+                .count = static_cast<uint32_t>(cell_objs.size()),
+                .kind = leaf.kind};
+  }
+}
+
+double Grid::mean_occupancy(const std::vector<Object> &objs,
+                            const BVHOptions &opts) {
+  auto grid = Grid();
+  const auto obj_bounds = grid.fit(objs, opts.grid_density);
+  if (objs.empty()) {
+    return 0.0;
+  }
+
+  const auto starts = grid.cell_starts(obj_bounds);
+  size_t occupied = 0;
+  for (size_t i = 0; i + 1 < starts.size(); ++i) {
+    occupied += starts[i] == starts[i + 1] ? 0 : 1;
+  }
+  return static_cast<double>(starts.back()) / static_cast<double>(occupied);
+}
+
+std::vector<AABB> Grid::fit(const std::vector<Object> &objs,
+                            const float density) {
+  std::vector<AABB> obj_bounds;
+  obj_bounds.reserve(objs.size());
+  for (const auto &o : objs) {
+    obj_bounds.push_back(o.primitive->aabb());
+    bounds = AABB::surrounding_box(bounds, obj_bounds.back());
+  }
+
+  if (objs.empty()) {
+    return obj_bounds;
+  }
+
+  // pick the number of cells per unit of distance so that the grid has
+  // `density` cells per object in total. axes too thin for even one cell
+  // get exactly one, and the cells are spread over the other axes instead,
+  // so flat scenes don't end up with far too many cells
+  const auto extent = bounds.max - bounds.min;
+  const auto target = density * static_cast<double>(objs.size());
+  std::array<bool, 3> thin = {};
+  for (size_t axis = 0; axis < 3; ++axis) {
+    thin[axis] = !(extent[axis] > 0.0f);
+  }
+
+  auto cells_per_unit = 0.0;
+  for (auto changed = true; changed;) {
+    auto volume = 1.0;
+    auto dims = 0.0;
+    for (size_t axis = 0; axis < 3; ++axis) {
+      if (!thin[axis]) {
+        volume *= extent[axis];
+        dims += 1.0;
+      }
+    }
+    cells_per_unit = dims > 0.0 ? std::pow(target / volume, 1.0 / dims) : 0.0;
+
+    changed = false;
+    for (size_t axis = 0; axis < 3; ++axis) {
+      if (!thin[axis] && extent[axis] * cells_per_unit < 1.0) {
+        thin[axis] = true;
+        changed = true;
+      }
+    }
+  }
+
+  for (size_t axis = 0; axis < 3; ++axis) {
+    const auto n = std::clamp(std::round(extent[axis] * cells_per_unit), 1.0,
+                              static_cast<double>(MAX_RESOLUTION));
+    resolution[axis] = std::isnan(n) ? 1 : static_cast<size_t>(n);
+    cell_size[axis] = extent[axis] / static_cast<float>(resolution[axis]);
+    inv_cell_size[axis] =
+        cell_size[axis] > 0.0f ? 1.0f / cell_size[axis] : 0.0f;
+  }
+  return obj_bounds;
+}
+
+template <typename F>
+void Grid::for_each_cell(const AABB &b, const F &f) const {
+  const auto x0 = cell_coord(b.min[0], 0);
+  const auto x1 = cell_coord(b.max[0], 0);
+  const auto y0 = cell_coord(b.min[1], 1);
+  const auto y1 = cell_coord(b.max[1], 1);
+  const auto z0 = cell_coord(b.min[2], 2);
+  const auto z1 = cell_coord(b.max[2], 2);
+  for (auto z = z0; z <= z1; ++z) {
+    for (auto y = y0; y <= y1; ++y) {
+      for (auto x = x0; x <= x1; ++x) {
+        f(x + resolution[0] * (y + resolution[1] * z));
+      }
+    }
+  }
+}
+
+std::vector<size_t>
+Grid::cell_starts(const std::vector<AABB> &obj_bounds) const {
+  const auto n_cells = resolution[0] * resolution[1] * resolution[2];
+  std::vector<size_t> starts(n_cells + 1, 0);
+  for (const auto &b : obj_bounds) {
+    for_each_cell(b, [&](const size_t cell) { starts[cell + 1] += 1; });
+  }
+  for (size_t i = 0; i < n_cells; ++i) {
+    starts[i + 1] += starts[i];
+  }
+  return starts;
+}
+
+size_t Grid::cell_coord(const float pos, const size_t axis) const {
+  const auto c = (pos - bounds.min[axis]) * inv_cell_size[axis];
+  // written so that NaN also ends up in the first cell
+  if (!(c > 0.0f)) {
+    return 0;
+  }
+  return std::min(static_cast<size_t>(c), resolution[axis] - 1);
+}
+
+template <typename Cell>
+void Grid::traverse(const Ray &r, const float t_min, const float *t_max,
+                    const Cell &cell) const {
+  if (cells.empty()) {
+    return;
+  }
+
+  const auto origin = r.origin();
+  const auto dir = r.direction();
+  const auto inv_dir = 1.0f / dir;
+
+  // clip the ray to the bounds of the grid. the slab distances are NaN when
+  // the ray lies in the plane of a slab, so they're passed second to keep
+  // std::max and std::min from picking them
+  auto t_enter = t_min;
+  auto t_exit = *t_max;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    auto t0 = (bounds.min[axis] - origin[axis]) * inv_dir[axis];
+    auto t1 = (bounds.max[axis] - origin[axis]) * inv_dir[axis];
+    if (t0 > t1) {
+      std::swap(t0, t1);
+    }
+    t_enter = std::max(t_enter, t0);
+    t_exit = std::min(t_exit, t1);
+    if (t_exit < t_enter) {
+      return;
+    }
+  }
+
+  // set up the 3D-DDA: the cell the ray enters the grid in, the distance to
+  // the next cell boundary on each axis, and how far apart the boundaries on
+  // each axis are along the ray
+  constexpr auto inf = std::numeric_limits<float>::infinity();
+  const auto entry = r.point_at_parameter(t_enter);
+  std::array<ptrdiff_t, 3> pos{};
+  std::array<ptrdiff_t, 3> step{};
+  std::array<ptrdiff_t, 3> out{};
+  std::array<float, 3> t_next{};
+  std::array<float, 3> t_delta{};
+  for (size_t axis = 0; axis < 3; ++axis) {
+    pos[axis] = static_cast<ptrdiff_t>(cell_coord(entry[axis], axis));
+    const auto cell_min =
+        bounds.min[axis] + static_cast<float>(pos[axis]) * cell_size[axis];
+    if (dir[axis] > 0.0f) {
+      step[axis] = 1;
+      out[axis] = static_cast<ptrdiff_t>(resolution[axis]);
+      t_next[axis] =
+          t_enter + (cell_min + cell_size[axis] - entry[axis]) * inv_dir[axis];
+      t_delta[axis] = cell_size[axis] * inv_dir[axis];
+    } else if (dir[axis] < 0.0f) {
+      step[axis] = -1;
+      out[axis] = -1;
+      t_next[axis] = t_enter + (cell_min - entry[axis]) * inv_dir[axis];
+      t_delta[axis] = -cell_size[axis] * inv_dir[axis];
+    } else {
+      step[axis] = 0;
+      out[axis] = -1;
+      t_next[axis] = inf;
+      t_delta[axis] = inf;
+    }
+  }
+
+  while (true) {
+    const size_t axis = t_next[0] < t_next[1]
+                            ? (t_next[0] < t_next[2] ? 0 : 2)
+                            : (t_next[1] < t_next[2] ? 1 : 2);
+    const auto index = static_cast<size_t>(pos[0]) +
+                       resolution[0] * (static_cast<size_t>(pos[1]) +
+                                        resolution[1] *
+                                            static_cast<size_t>(pos[2]));
+
+    const auto &c = cells[index];
+    if (c.count > 0 && cell(c)) {
+      return;
+    }
+
+    // a hit found so far that's inside the cells already visited can't be
+    // beaten by any of the objects in the cells after them
+    if (*t_max <= t_next[axis]) {
+      return;
+    }
+
+    pos[axis] += step[axis];
+    if (pos[axis] == out[axis]) {
+      return;
+    }
+    t_next[axis] += t_delta[axis];
+  }
+}
+
+std::optional<Hit> Grid::intersect(const Ray &r, const float t_min,
+                                   const float t_max) const {
+  BVHLeaves::LeafHit closest = {};
+  bool found = false;
+  auto min_so_far = t_max;
+  traverse(r, t_min, &min_so_far, [&](const GridCell &c) {
+    found = leaves.intersect(c.offset, c.count, c.kind, r, t_min, &min_so_far,
+                             &closest) ||
+            found;
+    return false;
+  });
+
+  if (!found) {
+    return std::nullopt;
+  }
+  return leaves.surface(r, closest);
+}
+
+bool Grid::occluded(const Ray &r, const float t_min, const float t_max) const {
+  auto occluded = false;
+  traverse(r, t_min, &t_max, [&](const GridCell &c) {
+    occluded = leaves.occluded(c.offset, c.count, c.kind, r, t_min, t_max);
+    return occluded;
+  });
+  return occluded;
+}
+
+AcceleratorMemory Grid::memory() const {
+  return {.nodes = cells.size() * sizeof(GridCell), .leaves = leaves.memory()};
+}
+
+} // namespace ronald
@@ -30,7 +30,25 @@ void Config::print() const {
   std::cerr << "\toutput: " << out << '\n';
   std::cerr << "\tinput: " << in << '\n';
   std::cerr << "\tsamples: " << samples << '\n';
-  std::cerr << "\tthreads: " << threads << std::endl;
+  std::cerr << "\tthreads: " << threads << '\n';
+  std::cerr << "\taccelerator: "
+            << (accelerator.empty() ? "<scene>" : accelerator) << '\n';
+  std::cerr << "\tbvh split: " << (bvh_split.empty() ? "<scene>" : bvh_split)
+            << '\n';
+  std::cerr << "\tbvh width: "
+            << (bvh_width == 0 ? "<scene>" : std::to_string(bvh_width))
+            << '\n';
+  std::cerr << "\tbvh nodes: " << (bvh_nodes.empty() ? "<scene>" : bvh_nodes)
+            << '\n';
+  std::cerr << "\tbvh cache: " << (bvh_cache.empty() ? "<none>" : bvh_cache)
+            << '\n';
+  std::cerr << "\tbvh stats: " << (bvh_stats ? "yes" : "no") << '\n';
+  if (!bvh_dump.empty()) {
+    std::cerr << "\tbvh dump: " << bvh_dump << '\n';
+  }
+  std::cerr << "\ttriangle test: "
+            << (triangle_test.empty() ? "<scene>" : triangle_test)
+            << std::endl;
 }
 
 Config::Config(const po::variables_map &vm) {
@@ -71,6 +89,72 @@ Config::Config(const po::variables_map &vm) {
     throw "Using more threads than hardware_concurrency value is not supported";
   }
 
+  if (vm.count("accelerator")) {
+    accelerator = vm["accelerator"].as<std::string>();
+    if (accelerator != "bvh" && accelerator != "grid" &&
+        accelerator != "auto") {
+      throw "Accelerator must be one of `bvh`, `grid`, or `auto`";
+    }
+  }
+
+  if (vm.count("bvh-split")) {
+    bvh_split = vm["bvh-split"].as<std::string>();
+    if (bvh_split != "sah" && bvh_split != "middle" && bvh_split != "lbvh" &&
+        bvh_split != "sbvh") {
+      throw "BVH split method must be one of `sah`, `middle`, `lbvh`, or "
+            "`sbvh`";
+    }
+  }
+
+  if (vm.count("bvh-width")) {
+    const auto vm_bvh_width = vm["bvh-width"].as<int>();
+    if (vm_bvh_width != 2 && vm_bvh_width != 8) {
+      throw "BVH width must be either 2 or 8";
+    }
+    bvh_width = static_cast<size_t>(vm_bvh_width);
+  }
+
+  if (vm.count("bvh-nodes")) {
+    bvh_nodes = vm["bvh-nodes"].as<std::string>();
+    if (bvh_nodes != "full" && bvh_nodes != "compressed") {
+      throw "BVH node format must be either `full` or `compressed`";
+    }
+  }
+
+  if (vm.count("bvh-cache")) {
+    bvh_cache = vm["bvh-cache"].as<std::string>();
+    if (bvh_cache.empty()) {
+      throw "BVH cache directory must not be empty";
+    }
+  }
+
+  if (vm.count("bvh-dump")) {
+    bvh_dump = vm["bvh-dump"].as<std::string>();
+    bvh_stats = true;
+  }
+
+  if (vm.count("bvh-stats")) {
+    bvh_stats = true;
+  }
+
+  if (bvh_stats) {
+    if (bvh_width == 8) {
+      throw "BVH statistics are only available for a BVH width of 2";
+    }
+    if (accelerator == "grid") {
+      throw "BVH statistics are not available for the grid accelerator";
+    }
+    accelerator = "bvh";
+    bvh_width = 2;
+  }
+
+  if (vm.count("triangle-test")) {
+    triangle_test = vm["triangle-test"].as<std::string>();
+    if (triangle_test != "moller-trumbore" && triangle_test != "watertight") {
+      throw "Triangle test must be either `moller-trumbore` or `watertight`";
+    }
+  }
+
   width = static_cast<size_t>(vm_width);
   height = static_cast<size_t>(vm_height);
   out = vm_out;
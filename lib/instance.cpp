@@ -0,0 +1,80 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "instance.hpp"
+#include "math.hpp"
+
+namespace ronald {
+
+Prototype::Prototype(std::vector<std::shared_ptr<Primitive>> primitives_a,
+                     std::vector<std::shared_ptr<TriangleMesh>> meshes_a,
+                     std::vector<Object> objects_a, const BVHOptions &opts)
+    : primitives(std::move(primitives_a)), meshes(std::move(meshes_a)),
+      objects(std::move(objects_a)), bounds(AABB::empty()) {
+  if (objects.empty()) {
+    throw std::runtime_error("Prototype must have at least one primitive");
+  }
+
+  for (const auto &o : objects) {
+    bounds = AABB::surrounding_box(bounds, o.primitive->aabb());
+  }
+  bvh = Accelerator::build(objects, opts);
+}
+
+Instance::Instance(const Prototype *prototype_a, const Transform &to_world_a)
+    : prototype(prototype_a), to_world(to_world_a),
+      to_object(to_world_a.inverse()) {}
+
+std::optional<PrimitiveHit> Instance::intersect(const Ray &r,
+                                                const float t_min,
+                                                const float t_max) const {
+  // the object space ray isn't normalized, so `t` means the same thing in
+  // both spaces and the prototype can be traced with the same bounds
+  const auto hit = prototype->intersect(to_object.ray(r), t_min, t_max);
+  if (!hit.has_value()) {
+    return std::nullopt;
+  }
+
+  const auto [u, v] = octahedral_encode(hit->hit.normal);
+  return {{.t = hit->hit.t, .u = u, .v = v}};
+}
+
+Intersection Instance::surface(const Ray &r, const PrimitiveHit &h) const {
+  const auto normal =
+      to_object.transposed_vector(octahedral_decode(h.u, h.v)).normalize();
+  return {
+      r.point_at_parameter(h.t),
+      normal,
+      h.t,
+  };
+}
+
+bool Instance::occluded(const Ray &r, const float t_min,
+                        const float t_max) const {
+  return prototype->occluded(to_object.ray(r), t_min, t_max);
+}
+
+AABB Instance::aabb() const { return to_world.aabb(prototype->aabb()); }
+
+Transform instance_transform_from_json(const object &obj) {
+  if (!obj.contains("transform")) {
+    return Transform::identity();
+  }
+  return Transform(get<std::array<std::array<float, 4>, 3>>(
+      obj, "transform", "instance"));
+}
+
+} // namespace ronald
@@ -0,0 +1,356 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <thread>
+
+namespace ronald {
+
+// Number of bits used for each coordinate of the Morton codes. Three of them
+// interleaved give 63 bit codes, which is enough to keep millions of objects
+// in separate cells of the grid
+constexpr int MORTON_BITS = 21;
+constexpr int MORTON_CODE_BITS = 3 * MORTON_BITS;
+
+// The top bits of the Morton codes that group the objects into treelets.
+// Each treelet covers one cell of a 16x16x16 grid over the centroid bounds
+constexpr int TREELET_BITS = 12;
+
+// Ranges with fewer objects than this are not worth splitting across threads
+constexpr size_t PARALLEL_LBVH_MIN_REFS = 4096;
+
+/**
+ * An object ref paired with the Morton code of its centroid
+ */
+struct MortonRef {
+  uint64_t code;
+  uint32_t index; // index into the build refs
+};
+
+/**
+ * Spread the low 21 bits of `v` out so that there are two zero bits between
+ * each of them, ready to be interleaved with the other two coordinates
+ */
+uint64_t expand_bits(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffff;
+  v = (v | v << 16) & 0x1f0000ff0000ff;
+  v = (v | v << 8) & 0x100f00f00f00f00f;
+  v = (v | v << 4) & 0x10c30c30c30c30c3;
+  v = (v | v << 2) & 0x1249249249249249;
+  return v;
+}
+
+/**
+ * Split the range [0, n) into `chunks` contiguous chunks and run
+ * `f(chunk, begin, end)` for each of them on its own thread. With a single
+ * chunk `f` is just called on the current thread
+ */
+template <typename F>
+void for_each_chunk(const size_t n, const size_t chunks, const F &f) {
+  if (chunks <= 1) {
+    f(0, 0, n);
+    return;
+  }
+
+  std::vector<std::thread> workers;
+  workers.reserve(chunks);
+  for (size_t c = 0; c < chunks; ++c) {
+    workers.emplace_back(f, c, n * c / chunks, n * (c + 1) / chunks);
+  }
+
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+/**
+ * Sort the refs by their Morton codes with a least significant digit radix
+ * sort, 8 bits at a time. Each chunk of the input builds its own histogram
+ * and then scatters its refs into the output, so both halves of every pass
+ * run in parallel. Passes where every code has the same digit are skipped
+ */
+void radix_sort(std::vector<MortonRef> &refs, const size_t chunks) {
+  constexpr int BITS_PER_PASS = 8;
+  constexpr size_t N_BUCKETS = 1 << BITS_PER_PASS;
+
+  std::vector<MortonRef> sorted(refs.size());
+  std::vector<std::array<size_t, N_BUCKETS>> offsets(chunks);
+
+  for (int shift = 0; shift < MORTON_CODE_BITS; shift += BITS_PER_PASS) {
+    const auto digit = [shift](const MortonRef &ref) {
+      return (ref.code >> shift) & (N_BUCKETS - 1);
+    };
+
+    for_each_chunk(refs.size(), chunks,
+                   [&](const size_t c, const size_t begin, const size_t end) {
+                     offsets[c].fill(0);
+                     for (size_t i = begin; i < end; ++i) {
+                       offsets[c][digit(refs[i])] += 1;
+                     }
+                   });
+
+    // turn the counts into the position each chunk writes its first ref of
+    // each digit to. the chunks are ordered within a digit so the sort stays
+    // stable, which the earlier passes rely on
+    size_t total = 0;
+    bool all_one_digit = false;
+    for (size_t b = 0; b < N_BUCKETS; ++b) {
+      size_t digit_count = 0;
+      for (size_t c = 0; c < chunks; ++c) {
+        const auto count = offsets[c][b];
+        offsets[c][b] = total;
+        total += count;
+        digit_count += count;
+      }
+      all_one_digit |= digit_count == refs.size();
+    }
+
+    if (all_one_digit) {
+      continue;
+    }
+
+    for_each_chunk(refs.size(), chunks,
+                   [&](const size_t c, const size_t begin, const size_t end) {
+                     for (size_t i = begin; i < end; ++i) {
+                       sorted[offsets[c][digit(refs[i])]++] = refs[i];
+                     }
+                   });
+
+    std::swap(refs, sorted);
+  }
+}
+
+/**
+ * Builds the BVH nodes for the linear BVH builder. This is a friend of the BVH
+ * so that it can use the private node constructors
+ */
+class LBVHBuilder {
+  std::span<const BVHBuildRef> build_refs;
+  const std::vector<Object> &objs;
+  const BVHOptions &opts;
+
+public:
+  LBVHBuilder(std::span<const BVHBuildRef> _build_refs,
+              const std::vector<Object> &_objs, const BVHOptions &_opts)
+      : build_refs(_build_refs), objs(_objs), opts(_opts) {}
+
+  /**
+   * Emit the subtree for a range of sorted refs whose codes all share the
+   * bits above `bit`. The range is split where `bit` changes from zero to
+   * one, which is a split at the middle of the range's grid cell along the
+   * axis that bit belongs to.
+   *
+   * The ranges are split all the way down to single objects, and sibling
+   * leaves are merged on the way back up when the SAH estimates that a
+   * single leaf is cheaper than the split. The SAH cost of the subtree is
+   * written to `cost` for the parent to make the same decision
+   */
+  BVH emit(std::span<const MortonRef> refs, int bit, size_t *total_nodes,
+           float *cost) const {
+    const auto make_leaf = [&](std::span<const MortonRef> leaf_refs) {
+      auto bb = AABB::empty();
+      std::vector<Object> leaf_objs;
+      leaf_objs.reserve(leaf_refs.size());
+      for (const auto &ref : leaf_refs) {
+        const auto &build_ref = build_refs[ref.index];
+        bb = AABB::surrounding_box(bb, build_ref.bounds);
+        leaf_objs.push_back(objs[build_ref.index]);
+      }
+      *total_nodes += 1;
+      *cost = opts.intersection_cost * static_cast<float>(leaf_refs.size());
+      return BVH(NodeType::Leaf, bb, leaf_objs);
+    };
+
+    if (refs.size() == 1) {
+      return make_leaf(refs);
+    }
+
+    // find the highest bit that actually separates the range. the codes are
+    // sorted, so the refs with the bit set are all at the end of the range
+    auto split = refs.size();
+    for (; bit >= 0; --bit) {
+      const uint64_t mask = uint64_t(1) << bit;
+      const auto it = std::partition_point(
+          refs.begin(), refs.end(),
+          [mask](const MortonRef &ref) { return (ref.code & mask) == 0; });
+      split = static_cast<size_t>(it - refs.begin());
+      if (split > 0 && split < refs.size()) {
+        break;
+      }
+    }
+
+    // all of the codes are the same. the objects can't be separated any
+    // better than by splitting the range in half, so keep them together if
+    // they fit in a leaf
+    size_t axis = 0;
+    if (bit < 0) {
+      if (refs.size() <= opts.max_leaf_size) {
+        return make_leaf(refs);
+      }
+      split = refs.size() / 2;
+    } else {
+      axis = static_cast<size_t>(bit % 3);
+    }
+
+    float left_cost = 0.0f;
+    float right_cost = 0.0f;
+    auto left = std::make_unique<BVH>(
+        emit(refs.first(split), bit - 1, total_nodes, &left_cost));
+    auto right = std::make_unique<BVH>(
+        emit(refs.subspan(split), bit - 1, total_nodes, &right_cost));
+
+    const auto bb = AABB::surrounding_box(left->bbox, right->bbox);
+    const auto area = bb.surface_area();
+    const auto split_cost =
+        opts.traversal_cost + (left->bbox.surface_area() * left_cost +
+                               right->bbox.surface_area() * right_cost) /
+                                  area;
+
+    if (left->type == NodeType::Leaf && right->type == NodeType::Leaf &&
+        refs.size() <= opts.max_leaf_size &&
+        (area <= 0.0f ||
+         opts.intersection_cost * static_cast<float>(refs.size()) <=
+             split_cost)) {
+      // replace the two leaves with the merged one
+      *total_nodes -= 2;
+      return make_leaf(refs);
+    }
+
+    *total_nodes += 1;
+    *cost = split_cost;
+    return BVH(NodeType::Internal, bb,
+               std::make_pair(std::move(left), std::move(right)), axis);
+  }
+
+  /**
+   * Join the treelets into a single tree using the SAH. Each ref in `roots`
+   * stands in for the treelet with the same index
+   */
+  std::unique_ptr<BVH>
+  join(std::span<BVHBuildRef> roots,
+       std::vector<std::unique_ptr<BVH>> &treelets, size_t *total_nodes) const {
+    if (roots.size() == 1) {
+      return std::move(treelets[roots[0].index]);
+    }
+
+    // the treelets can't be merged into leaves, so don't let the SAH stop
+    auto join_opts = opts;
+    join_opts.max_leaf_size = 0;
+
+    size_t axis = 0;
+    auto m = partition_sah(roots, join_opts, &axis);
+    if (m == 0 || m == roots.size()) {
+      m = partition_middle(roots, &axis);
+    }
+
+    auto left = join(roots.first(m), treelets, total_nodes);
+    auto right = join(roots.subspan(m), treelets, total_nodes);
+
+    *total_nodes += 1;
+    const auto bb = AABB::surrounding_box(left->bbox, right->bbox);
+    return std::make_unique<BVH>(
+        BVH(NodeType::Internal, bb,
+            std::make_pair(std::move(left), std::move(right)), axis));
+  }
+};
+
+BVH build_lbvh(std::span<BVHBuildRef> refs, const std::vector<Object> &objs,
+               const BVHOptions &opts, size_t *total_nodes) {
+  const auto threads = std::max<size_t>(opts.build_threads, 1);
+  const auto chunks = refs.size() >= PARALLEL_LBVH_MIN_REFS ? threads : 1;
+
+  auto centroid_bounds = AABB::empty();
+  for (const auto &ref : refs) {
+    centroid_bounds =
+        AABB::surrounding_box(centroid_bounds, AABB(ref.centroid, ref.centroid));
+  }
+
+  // quantize the centroids onto a 2^21 grid over the centroid bounds and
+  // interleave the coordinates into the Morton codes
+  constexpr auto max_cell = static_cast<float>((1 << MORTON_BITS) - 1);
+  const auto extent = centroid_bounds.max - centroid_bounds.min;
+  const auto quantize = [&](const BVHBuildRef &ref, const size_t axis) {
+    if (extent[axis] <= 0.0f) {
+      return uint64_t(0);
+    }
+    const auto offset =
+        (ref.centroid[axis] - centroid_bounds.min[axis]) / extent[axis];
+    return static_cast<uint64_t>(std::clamp(offset * max_cell, 0.0f, max_cell));
+  };
+
+  std::vector<MortonRef> morton(refs.size());
+  for_each_chunk(refs.size(), chunks,
+                 [&](const size_t, const size_t begin, const size_t end) {
+                   for (size_t i = begin; i < end; ++i) {
+                     morton[i] = {
+                         .code = expand_bits(quantize(refs[i], 0)) |
+                                 expand_bits(quantize(refs[i], 1)) << 1 |
+                                 expand_bits(quantize(refs[i], 2)) << 2,
+                         .index = static_cast<uint32_t>(i),
+                     };
+                   }
+                 });
+
+  radix_sort(morton, chunks);
+
+  // the refs in each treelet share the top bits of their codes, so they are
+  // contiguous after sorting
+  std::vector<std::span<const MortonRef>> ranges;
+  constexpr int treelet_shift = MORTON_CODE_BITS - TREELET_BITS;
+  size_t start = 0;
+  for (size_t i = 1; i <= morton.size(); ++i) {
+    if (i == morton.size() ||
+        morton[i].code >> treelet_shift != morton[start].code >> treelet_shift) {
+      ranges.emplace_back(morton.data() + start, i - start);
+      start = i;
+    }
+  }
+
+  // emit the treelets in parallel. the treelets vary a lot in size, so the
+  // threads take them one at a time from a shared counter
+  const LBVHBuilder builder(refs, objs, opts);
+  std::vector<std::unique_ptr<BVH>> treelets(ranges.size());
+  std::vector<size_t> treelet_nodes(ranges.size(), 0);
+  std::atomic<size_t> next_treelet = 0;
+
+  const auto emit_treelets = [&](const size_t, const size_t, const size_t) {
+    for (auto t = next_treelet++; t < ranges.size(); t = next_treelet++) {
+      float cost = 0.0f;
+      treelets[t] = std::make_unique<BVH>(builder.emit(
+          ranges[t], treelet_shift - 1, &treelet_nodes[t], &cost));
+    }
+  };
+  for_each_chunk(ranges.size(), std::min(chunks, ranges.size()),
+                 emit_treelets);
+
+  std::vector<BVHBuildRef> roots(treelets.size());
+  for (size_t t = 0; t < treelets.size(); ++t) {
+    const auto bb = treelets[t]->aabb();
+    roots[t] = {.bounds = bb,
+                .centroid = bb.centroid(),
+                .index = static_cast<uint32_t>(t)};
+    *total_nodes += treelet_nodes[t];
+  }
+
+  return std::move(*builder.join(roots, treelets, total_nodes));
+}
+
+} // namespace ronald
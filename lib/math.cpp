@@ -41,4 +41,30 @@ Vec3 random_in_unit_sphere() {
 
 Vec3 random_on_unit_sphere() { return random_in_unit_sphere().normalize(); }
 
+/**
+ * Sign of `x` that treats zero as positive, so that the unfolding is
+ * reversible on the edges of the octahedron
+ */
+float sign_not_zero(const float x) { return x >= 0.0f ? 1.0f : -1.0f; }
+
+std::pair<float, float> octahedral_encode(const Vec3 &n) {
+  const auto l1 = std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z());
+  const auto u = n.x() / l1;
+  const auto v = n.y() / l1;
+  if (n.z() >= 0.0f) {
+    return {u, v};
+  }
+  return {(1.0f - std::abs(v)) * sign_not_zero(u),
+          (1.0f - std::abs(u)) * sign_not_zero(v)};
+}
+
+Vec3 octahedral_decode(const float u, const float v) {
+  const auto z = 1.0f - std::abs(u) - std::abs(v);
+  if (z >= 0.0f) {
+    return Vec3(u, v, z);
+  }
+  return Vec3((1.0f - std::abs(v)) * sign_not_zero(u),
+              (1.0f - std::abs(u)) * sign_not_zero(v), z);
+}
+
 } // namespace ronald
@@ -0,0 +1,116 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "common.hpp"
+#include "primitive.hpp"
+#include "vec3.hpp"
+
+namespace ronald {
+
+TriangleMesh::TriangleMesh(std::vector<Vec3> positions_a,
+                           std::vector<uint32_t> indices_a,
+                           const float normal_a, const TriangleTest test_a)
+    : positions(std::move(positions_a)), indices(std::move(indices_a)),
+      normal(normal_a), test(test_a) {
+  if (indices.size() % 3 != 0) {
+    throw std::runtime_error("Mesh index count must be a multiple of 3");
+  }
+
+  for (const auto i : indices) {
+    if (i >= positions.size()) {
+      throw std::runtime_error("Mesh index " + std::to_string(i) +
+                               " is out of range");
+    }
+  }
+
+  const auto n_triangles = indices.size() / 3;
+  if (n_triangles > std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("Too many triangles in mesh");
+  }
+
+  triangles.reserve(n_triangles);
+  for (size_t i = 0; i < n_triangles; ++i) {
+    triangles.emplace_back(this, static_cast<uint32_t>(i));
+  }
+}
+
+/**
+ * Read the vertex buffer of a mesh from its JSON description
+ */
+std::vector<Vec3> mesh_positions_from_json(const object &obj) {
+  const auto vertices =
+      get<std::vector<std::array<float, 3>>>(obj, "vertices", "mesh");
+
+  std::vector<Vec3> positions;
+  positions.reserve(vertices.size());
+  for (const auto &v : vertices) {
+    positions.emplace_back(v);
+  }
+  return positions;
+}
+
+/**
+ * Read the index buffer of a mesh from its JSON description, flattening the
+ * triangles into one array
+ */
+std::vector<uint32_t> mesh_indices_from_json(const object &obj) {
+  const auto faces =
+      get<std::vector<std::array<uint32_t, 3>>>(obj, "indices", "mesh");
+
+  std::vector<uint32_t> indices;
+  indices.reserve(faces.size() * 3);
+  for (const auto &f : faces) {
+    indices.insert(indices.end(), f.begin(), f.end());
+  }
+  return indices;
+}
+
+TriangleMesh::TriangleMesh(const object &obj, const TriangleTest test_a)
+    : TriangleMesh(mesh_positions_from_json(obj), mesh_indices_from_json(obj),
+                   get<float>(obj, "normal", "mesh"), test_a) {}
+
+std::optional<TriangleData> MeshTriangle::triangle_data() const {
+  // the triangle blocks only implement the Möller–Trumbore test
+  if (mesh->test != TriangleTest::MollerTrumbore) {
+    return std::nullopt;
+  }
+
+  const auto *idx = &mesh->indices[3 * index];
+  const auto &v0 = mesh->positions[idx[0]];
+  const auto edge1 = mesh->positions[idx[1]] - v0;
+  const auto edge2 = mesh->positions[idx[2]] - v0;
+  return {{
+      .v0 = v0,
+      .edge1 = edge1,
+      .edge2 = edge2,
+      .normal = edge1.cross(edge2).normalize() * mesh->normal,
+  }};
+}
+
+AABB MeshTriangle::aabb() const {
+  const auto *idx = &mesh->indices[3 * index];
+  return triangle_aabb(mesh->positions[idx[0]], mesh->positions[idx[1]],
+                       mesh->positions[idx[2]]);
+}
+
+AABB MeshTriangle::clipped_aabb(const AABB &box) const {
+  const auto *idx = &mesh->indices[3 * index];
+  return triangle_clipped_aabb(mesh->positions[idx[0]],
+                               mesh->positions[idx[1]],
+                               mesh->positions[idx[2]], box);
+}
+
+} // namespace ronald
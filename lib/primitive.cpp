@@ -24,10 +24,27 @@
 
 namespace ronald {
 
-const std::shared_ptr<Primitive> Primitive::from_json(const object &obj) {
+TriangleTest triangle_test_from_string(const std::string &str) {
+  if (str == "moller-trumbore") {
+    return TriangleTest::MollerTrumbore;
+  }
+
+  if (str == "watertight") {
+    return TriangleTest::Watertight;
+  }
+
+  throw std::runtime_error(
+      "Triangle test must be either `moller-trumbore` or `watertight`");
+}
+
+const std::shared_ptr<Primitive> Primitive::from_json(const object &obj,
+                                                      const TriangleTest test) {
   const auto type = get<std::string>(obj, "type", "primitive");
 
   if (type == "triangle") {
+    if (test == TriangleTest::Watertight) {
+      return std::make_shared<WatertightTriangle>(obj);
+    }
     return std::make_shared<Triangle>(obj);
   }
 
@@ -35,7 +52,28 @@ const std::shared_ptr<Primitive> Primitive::from_json(const object &obj) {
     return std::make_shared<Sphere>(obj);
   }
 
-  throw std::runtime_error("Primitive must be either `triangle` or `sphere`");
+  if (type == "quad") {
+    return std::make_shared<Quad>(obj);
+  }
+
+  if (type == "box") {
+    return std::make_shared<Box>(obj);
+  }
+
+  throw std::runtime_error(
+      "Primitive must be one of `triangle`, `sphere`, `quad`, or `box`");
+}
+
+AABB Primitive::clipped_aabb(const AABB &box) const {
+  return AABB::intersection(aabb(), box);
+}
+
+std::optional<TriangleData> Primitive::triangle_data() const {
+  return std::nullopt;
+}
+
+std::optional<SphereData> Primitive::sphere_data() const {
+  return std::nullopt;
 }
 
 } // namespace ronald
@@ -0,0 +1,55 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "common.hpp"
+#include "primitive.hpp"
+#include "vec3.hpp"
+
+namespace ronald {
+
+Quad::Quad(const Vec3 &origin_a, const Vec3 &u_a, const Vec3 &v_a,
+           const float normal_a)
+    : origin(origin_a), u(u_a), v(v_a),
+      normal(u_a.cross(v_a).normalize() * normal_a) {}
+
+Quad::Quad(const object &obj)
+    : Quad(Vec3(get<std::array<float, 3>>(obj, "origin", "primitive")),
+           Vec3(get<std::array<float, 3>>(obj, "u", "primitive")),
+           Vec3(get<std::array<float, 3>>(obj, "v", "primitive")),
+           get<float>(obj, "normal", "primitive")) {}
+
+AABB Quad::aabb() const {
+  // the two halves of the quad, padded the same way as triangles
+  return AABB::surrounding_box(triangle_aabb(origin, origin + u, origin + v),
+                               triangle_aabb(origin + u + v, origin + u,
+                                             origin + v));
+}
+
+AABB Quad::clipped_aabb(const AABB &box) const {
+  const std::array<Vec3, 4> vertices = {origin, origin + u, origin + u + v,
+                                        origin + v};
+  return polygon_clipped_aabb(vertices, box);
+}
+
+std::optional<TriangleData> Quad::triangle_data() const {
+  return {{.v0 = origin,
+           .edge1 = u,
+           .edge2 = v,
+           .normal = normal,
+           .parallelogram = true}};
+}
+
+} // namespace ronald
@@ -0,0 +1,328 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bvh.hpp"
+#include "primitive.hpp"
+
+#include <algorithm>
+
+namespace ronald {
+
+/**
+ * A bin of the spatial split builder. Unlike the SAH buckets, which count
+ * each object once, a spatial bin receives the clipped piece of every object
+ * that overlaps it. The number of objects starting and ending in each bin is
+ * tracked so the sweep can count how many references end up on each side
+ */
+struct SpatialBin {
+  AABB bounds = AABB::empty();
+  size_t entries = 0;
+  size_t exits = 0;
+};
+
+/**
+ * The best spatial split found for a set of refs. The split plane is the
+ * boundary after `bin` in a grid of equally sized bins over `bounds`
+ */
+struct SpatialSplit {
+  float cost = std::numeric_limits<float>::infinity();
+  size_t axis = 0;
+  size_t bin = 0;
+  size_t duplicates = 0;
+  AABB bounds;
+};
+
+/**
+ * Builds the BVH nodes for the spatial split builder. This is a friend of the
+ * BVH so that it can use the private node constructors
+ */
+class SBVHBuilder {
+  const std::vector<Object> &objs;
+  const BVHOptions &opts;
+  float root_area;
+  size_t duplicates_left;
+
+  /**
+   * Find the bin along `axis` of the given bounds that `x` falls into
+   */
+  size_t bin_index(const AABB &bounds, const size_t axis, const float x) const {
+    const auto lo = bounds.min[axis];
+    const auto extent = bounds.max[axis] - lo;
+    const auto n_bins = opts.sah_buckets;
+    const auto b = static_cast<float>(n_bins) * ((x - lo) / extent);
+    return std::min(static_cast<size_t>(std::max(b, 0.0f)), n_bins - 1);
+  }
+
+  /**
+   * Get the position of the plane at the start of the given bin
+   */
+  float bin_plane(const AABB &bounds, const size_t axis, const size_t b) const {
+    if (b == opts.sah_buckets) {
+      return bounds.max[axis];
+    }
+    const auto extent = bounds.max[axis] - bounds.min[axis];
+    return bounds.min[axis] + extent * static_cast<float>(b) /
+                                  static_cast<float>(opts.sah_buckets);
+  }
+
+  /**
+   * Clip the ref to the slab between `lo` and `hi` along `axis`. The result is
+   * empty if the object doesn't actually pass through the slab
+   */
+  BVHBuildRef clip(const BVHBuildRef &ref, const size_t axis, const float lo,
+                   const float hi) const {
+    auto slab = ref.bounds;
+    slab.min[axis] = std::max(slab.min[axis], lo);
+    slab.max[axis] = std::min(slab.max[axis], hi);
+
+    const auto bounds = AABB::intersection(
+        objs[ref.index].primitive->clipped_aabb(slab), ref.bounds);
+    return {.bounds = bounds, .centroid = bounds.centroid(), .index = ref.index};
+  }
+
+  /**
+   * Find the best spatial split of the refs. Each object is clipped to every
+   * bin it overlaps and the pieces are added to the bins, then the bins are
+   * swept from both sides exactly like the SAH buckets
+   */
+  SpatialSplit find_spatial_split(std::span<const BVHBuildRef> refs,
+                                  const AABB &bounds) const {
+    SpatialSplit best;
+    best.bounds = bounds;
+
+    const auto n_bins = opts.sah_buckets;
+    const auto parent_area = bounds.surface_area();
+    std::vector<SpatialBin> bins(n_bins);
+    std::vector<AABB> right_bounds(n_bins);
+    std::vector<size_t> right_count(n_bins);
+
+    for (size_t axis = 0; axis < 3; ++axis) {
+      if (bounds.max[axis] <= bounds.min[axis]) {
+        continue;
+      }
+
+      std::fill(bins.begin(), bins.end(), SpatialBin());
+      for (const auto &ref : refs) {
+        const auto first = bin_index(bounds, axis, ref.bounds.min[axis]);
+        const auto last = bin_index(bounds, axis, ref.bounds.max[axis]);
+        bins[first].entries += 1;
+        bins[last].exits += 1;
+
+        if (first == last) {
+          bins[first].bounds =
+              AABB::surrounding_box(bins[first].bounds, ref.bounds);
+          continue;
+        }
+
+        for (auto b = first; b <= last; ++b) {
+          const auto piece = clip(ref, axis, bin_plane(bounds, axis, b),
+                                  bin_plane(bounds, axis, b + 1));
+          if (!piece.bounds.is_empty()) {
+            bins[b].bounds = AABB::surrounding_box(bins[b].bounds, piece.bounds);
+          }
+        }
+      }
+
+      auto acc_bounds = AABB::empty();
+      size_t acc_count = 0;
+      for (size_t i = n_bins - 1; i > 0; --i) {
+        acc_bounds = AABB::surrounding_box(acc_bounds, bins[i].bounds);
+        acc_count += bins[i].exits;
+        right_bounds[i - 1] = acc_bounds;
+        right_count[i - 1] = acc_count;
+      }
+
+      acc_bounds = AABB::empty();
+      acc_count = 0;
+      for (size_t i = 0; i < n_bins - 1; ++i) {
+        acc_bounds = AABB::surrounding_box(acc_bounds, bins[i].bounds);
+        acc_count += bins[i].entries;
+
+        if (acc_count == 0 || right_count[i] == 0 || acc_bounds.is_empty() ||
+            right_bounds[i].is_empty()) {
+          continue;
+        }
+
+        // every object straddling the plane is counted on both sides
+        const auto duplicates = acc_count + right_count[i] - refs.size();
+        if (duplicates > duplicates_left) {
+          continue;
+        }
+
+        const auto cost =
+            opts.traversal_cost +
+            opts.intersection_cost *
+                (static_cast<float>(acc_count) * acc_bounds.surface_area() +
+                 static_cast<float>(right_count[i]) *
+                     right_bounds[i].surface_area()) /
+                parent_area;
+
+        if (cost < best.cost) {
+          best.cost = cost;
+          best.axis = axis;
+          best.bin = i;
+          best.duplicates = duplicates;
+        }
+      }
+    }
+
+    return best;
+  }
+
+  /**
+   * Distribute the refs between the two sides of a spatial split. Refs
+   * straddling the split plane are clipped, and the pieces go to both sides
+   */
+  void apply_spatial_split(std::span<const BVHBuildRef> refs,
+                           const SpatialSplit &split,
+                           std::vector<BVHBuildRef> *left,
+                           std::vector<BVHBuildRef> *right) const {
+    const auto axis = split.axis;
+    const auto plane = bin_plane(split.bounds, axis, split.bin + 1);
+
+    for (const auto &ref : refs) {
+      const auto first = bin_index(split.bounds, axis, ref.bounds.min[axis]);
+      const auto last = bin_index(split.bounds, axis, ref.bounds.max[axis]);
+
+      if (last <= split.bin) {
+        left->push_back(ref);
+      } else if (first > split.bin) {
+        right->push_back(ref);
+      } else {
+        const auto l_piece = clip(ref, axis, ref.bounds.min[axis], plane);
+        const auto r_piece = clip(ref, axis, plane, ref.bounds.max[axis]);
+        if (!l_piece.bounds.is_empty()) {
+          left->push_back(l_piece);
+        }
+        if (!r_piece.bounds.is_empty()) {
+          right->push_back(r_piece);
+        }
+      }
+    }
+  }
+
+public:
+  SBVHBuilder(const std::vector<Object> &_objs, const BVHOptions &_opts,
+              const float _root_area, const size_t _duplicates_left)
+      : objs(_objs), opts(_opts), root_area(_root_area),
+        duplicates_left(_duplicates_left) {}
+
+  /**
+   * Recursively build the subtree for the given refs
+   */
+  BVH build(std::vector<BVHBuildRef> refs, size_t *total_nodes) {
+    auto bounds = AABB::empty();
+    for (const auto &ref : refs) {
+      bounds = AABB::surrounding_box(bounds, ref.bounds);
+    }
+
+    const auto make_leaf = [&]() {
+      std::vector<Object> leaf_objs;
+      leaf_objs.reserve(refs.size());
+      for (const auto &ref : refs) {
+        leaf_objs.push_back(objs[ref.index]);
+      }
+      *total_nodes += 1;
+      return BVH(NodeType::Leaf, bounds, leaf_objs);
+    };
+
+    if (refs.size() == 1) {
+      return make_leaf();
+    }
+
+    const auto object_split = find_sah_split(refs, opts);
+
+    // only look for a spatial split when the children of the object split
+    // overlap a meaningful amount, since that is the only case where
+    // splitting the objects themselves can help
+    auto spatial_split = SpatialSplit();
+    const auto overlap = AABB::intersection(object_split.left_bounds,
+                                            object_split.right_bounds);
+    const auto no_object_split =
+        object_split.cost == std::numeric_limits<float>::infinity();
+    if (duplicates_left > 0 &&
+        (no_object_split || (!overlap.is_empty() &&
+                             overlap.surface_area() / root_area >
+                                 opts.spatial_split_alpha))) {
+      spatial_split = find_spatial_split(refs, bounds);
+    }
+
+    const auto fits_in_leaf = refs.size() <= opts.max_leaf_size;
+    const auto leaf_cost =
+        opts.intersection_cost * static_cast<float>(refs.size());
+    const auto split_cost = std::min(object_split.cost, spatial_split.cost);
+    if (fits_in_leaf && leaf_cost <= split_cost) {
+      return make_leaf();
+    }
+
+    std::vector<BVHBuildRef> l_refs;
+    std::vector<BVHBuildRef> r_refs;
+    size_t axis = 0;
+
+    if (spatial_split.cost < object_split.cost) {
+      apply_spatial_split(refs, spatial_split, &l_refs, &r_refs);
+      axis = spatial_split.axis;
+    }
+
+    // the clipped pieces may all land on one side when the object split was
+    // unusable, in which case fall back to the middle split
+    if (l_refs.empty() || r_refs.empty()) {
+      l_refs.clear();
+      r_refs.clear();
+
+      size_t m = 0;
+      if (!no_object_split) {
+        m = apply_sah_split(refs, object_split, opts);
+        axis = object_split.axis;
+      } else {
+        m = partition_middle(refs, &axis);
+      }
+
+      l_refs.assign(refs.begin(), refs.begin() + static_cast<long>(m));
+      r_refs.assign(refs.begin() + static_cast<long>(m), refs.end());
+    } else {
+      const auto duplicates = l_refs.size() + r_refs.size() - refs.size();
+      duplicates_left -= std::min(duplicates, duplicates_left);
+    }
+
+    // the parent's refs aren't needed anymore, free them before recursing
+    refs = {};
+
+    auto left = std::make_unique<BVH>(build(std::move(l_refs), total_nodes));
+    auto right = std::make_unique<BVH>(build(std::move(r_refs), total_nodes));
+
+    *total_nodes += 1;
+    return BVH(NodeType::Internal, bounds,
+               std::make_pair(std::move(left), std::move(right)), axis);
+  }
+};
+
+BVH build_sbvh(std::span<const BVHBuildRef> refs,
+               const std::vector<Object> &objs, const BVHOptions &opts,
+               size_t *total_nodes) {
+  auto bounds = AABB::empty();
+  for (const auto &ref : refs) {
+    bounds = AABB::surrounding_box(bounds, ref.bounds);
+  }
+
+  const auto budget = static_cast<size_t>(opts.max_duplication *
+                                          static_cast<float>(refs.size()));
+  auto builder = SBVHBuilder(objs, opts, bounds.surface_area(), budget);
+  return builder.build(std::vector<BVHBuildRef>(refs.begin(), refs.end()),
+                       total_nodes);
+}
+
+} // namespace ronald
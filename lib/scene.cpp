@@ -21,7 +21,11 @@
 #include "progress.hpp"
 #include "vec3.hpp"
 
+#include <algorithm>
 #include <boost/lockfree/queue.hpp>
+#include <filesystem>
+#include <iomanip>
+#include <sstream>
 #include <thread>
 
 using namespace std::chrono_literals;
@@ -33,8 +37,9 @@ namespace ronald {
 // be terminated by Russian Roulette
 constexpr size_t MAX_RECURSIVE_DEPTH = 20;
 
-const Object object_from_json(const object &obj,
-                              const material_map &materials) {
+const Object
+object_from_json(const object &obj, const material_map &materials,
+                 std::vector<std::shared_ptr<Primitive>> &primitives) {
 
   const auto material_key = get<std::string>(obj, "material", "objects");
   if (!materials.contains(material_key)) {
@@ -42,13 +47,13 @@ const Object object_from_json(const object &obj,
                              material_key + "\"");
   }
 
-  const auto material = materials.at(material_key);
-  const auto primitive =
-      Primitive::from_json(at(obj, "primitive", "objects").as_object());
+  const auto &material = materials.at(material_key);
+  primitives.push_back(
+      Primitive::from_json(at(obj, "primitive", "objects").as_object()));
 
   return {
-      .primitive = primitive,
-      .material = material,
+      .primitive = primitives.back().get(),
+      .material = material.get(),
   };
 }
 
@@ -70,19 +75,13 @@ std::optional<Hit> hit_objects(const std::vector<Object> &objs,
   constexpr auto f32_max = std::numeric_limits<float>::max();
 
   auto min_so_far = f32_max;
-  Hit hit = {
-      .hit = {Vec3::zeros(), Vec3::zeros(), 0.0},
-      .material = nullptr,
-  };
-
-  std::optional<Intersection> last_hit = std::nullopt;
+  std::optional<PrimitiveHit> last_hit = std::nullopt;
   size_t last_obj_hit = 0;
 
   for (size_t i = 0; i < objs.size(); ++i) {
     const auto &o = objs[i];
-    const auto this_hit = o.primitive->hit(ray, T_MIN, min_so_far);
+    const auto this_hit = o.primitive->intersect(ray, T_MIN, min_so_far);
     if (this_hit.has_value()) {
-      hit.hit = this_hit.value();
       last_hit = this_hit;
       last_obj_hit = i;
 
@@ -92,15 +91,23 @@ std::optional<Hit> hit_objects(const std::vector<Object> &objs,
   }
 
   if (last_hit.has_value()) {
-    // Delay computing the scattered and emitted results until we've figured
-    // out which object we actually hit (if any)
-    hit.material = objs[last_obj_hit].material;
-    return hit;
+    // Delay computing the surface, scattered and emitted results until we've
+    // figured out which object we actually hit (if any)
+    const auto &o = objs[last_obj_hit];
+    return {{.hit = o.primitive->surface(ray, *last_hit),
+             .material = o.material}};
   }
 
   return std::nullopt;
 }
 
+bool occluded_objects(const std::vector<Object> &objs, const Ray &ray,
+                      const float t_min, const float t_max) {
+  return std::any_of(objs.begin(), objs.end(), [&](const Object &o) {
+    return o.primitive->occluded(ray, t_min, t_max);
+  });
+}
+
 Vec3 Scene::trace(const float u, const float v) const {
   constexpr float T_MIN = 0.0005f;
   constexpr auto f32_max = std::numeric_limits<float>::max();
@@ -110,14 +117,7 @@ Vec3 Scene::trace(const float u, const float v) const {
   auto total_emitted = Vec3::zeros();
 
   for (size_t i = 0; i < MAX_RECURSIVE_DEPTH; ++i) {
-    // the BVH is disabled temporarily due to poor performance in multithreaded
-    // mode. the construction and traversal of the BVH is correct (you can
-    // verify this if you want to spend the time re-compiling and re-rendering)
-    // but the performance is just slow. I haven't had the time to debug this
-    // and since the BVH was a stretch goal it's not a high priority
-
-    // const auto hit_result = this->bvh.intersect(curr_ray, T_MIN, f32_max);
-    const auto hit_result = hit_objects(this->objects, curr_ray);
+    const auto hit_result = this->bvh->intersect(curr_ray, T_MIN, f32_max);
 
     // Ray did not hit anything -- return zero
     if (!hit_result.has_value()) {
@@ -161,12 +161,166 @@ Vec3 Scene::trace(const float u, const float v) const {
   return Vec3::zeros();
 }
 
-Scene Scene::from_json(const object &obj, const float aspect_r) {
+/**
+ * Read a `primitives` array of the scene description, appending the
+ * primitives to `prims` (or `meshes`) and an object with the given material
+ * for each of them to `objs`. Instances may refer to any of `prototypes`
+ */
+void primitives_from_json(const array &json_prims, const Material *material,
+                          const TriangleTest triangle_test,
+                          const prototype_map &prototypes,
+                          std::vector<std::shared_ptr<Primitive>> *prims,
+                          std::vector<std::shared_ptr<TriangleMesh>> *meshes,
+                          std::vector<Object> *objs) {
+  for (const auto &p : json_prims) {
+    const auto p_as_obj = p.as_object();
+    const auto type = get<std::string>(p_as_obj, "type", "primitive");
+
+    // a mesh adds an object for each of its triangles
+    if (type == "mesh") {
+      meshes->push_back(
+          std::make_shared<TriangleMesh>(p_as_obj, triangle_test));
+      const auto &mesh = *meshes->back();
+      for (size_t i = 0; i < mesh.size(); ++i) {
+        objs->push_back({.primitive = &mesh.triangle(i), .material = material});
+      }
+      continue;
+    }
+
+    if (type == "instance") {
+      const auto key = get<std::string>(p_as_obj, "prototype", "instance");
+      if (!prototypes.contains(key)) {
+        throw std::runtime_error("Undefined reference to prototype \"" + key +
+                                 "\"");
+      }
+      prims->push_back(std::make_shared<Instance>(
+          prototypes.at(key).get(), instance_transform_from_json(p_as_obj)));
+      objs->push_back({.primitive = prims->back().get(), .material = material});
+      continue;
+    }
+
+    prims->push_back(Primitive::from_json(p_as_obj, triangle_test));
+    objs->push_back({.primitive = prims->back().get(), .material = material});
+  }
+}
+
+/**
+ * Mix `size` bytes into a 64-bit FNV-1a hash
+ */
+uint64_t hash_bytes(uint64_t hash, const void *data, const size_t size) {
+  const auto *bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+std::string bvh_cache_path(const std::string &dir, const object &obj,
+                           const TriangleTest triangle_test,
+                           const BVHOptions &opts) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  const auto mix_json = [&](const value &jv) {
+    const auto str = serialize(jv);
+    hash = hash_bytes(hash, str.data(), str.size());
+  };
+  const auto mix = [&](const auto &field) {
+    hash = hash_bytes(hash, &field, sizeof(field));
+  };
+
+  for (const auto &o : at(obj, "objects").as_array()) {
+    mix_json(at(o.as_object(), "primitives", "objects"));
+  }
+  if (obj.contains("prototypes")) {
+    mix_json(at(obj, "prototypes"));
+  }
+
+  // the options are mixed in one at a time to skip the padding between them
+  mix(triangle_test);
+  mix(opts.split_method);
+  mix(opts.sah_buckets);
+  mix(opts.traversal_cost);
+  mix(opts.intersection_cost);
+  mix(opts.max_leaf_size);
+  mix(opts.node_layout);
+  mix(opts.spatial_split_alpha);
+  mix(opts.max_duplication);
+
+  std::ostringstream name;
+  name << std::hex << std::setw(16) << std::setfill('0') << hash << ".bvh";
+  return (std::filesystem::path(dir) / name.str()).string();
+}
+
+Scene Scene::from_json(const object &obj, const float aspect_r,
+                       const Config &config) {
   const auto material_obj = at(obj, "materials").as_object();
   const auto mats = materials_from_json(material_obj);
 
+  auto triangle_test = TriangleTest::MollerTrumbore;
+  if (obj.contains("triangle_test")) {
+    triangle_test = triangle_test_from_string(
+        get<std::string>(obj, "triangle_test", "scene"));
+  }
+
+  if (!config.triangle_test.empty()) {
+    triangle_test = triangle_test_from_string(config.triangle_test);
+  }
+
+  auto bvh_opts = BVHOptions();
+  if (obj.contains("bvh")) {
+    bvh_opts = BVHOptions::from_json(at(obj, "bvh").as_object());
+  }
+
+  // the scene picks its accelerator automatically unless it says otherwise
+  bvh_opts.accelerator = AcceleratorType::Auto;
+  if (obj.contains("accelerator")) {
+    bvh_opts.accelerator = accelerator_type_from_string(
+        get<std::string>(obj, "accelerator", "scene"));
+  }
+
+  if (!config.accelerator.empty()) {
+    bvh_opts.accelerator = accelerator_type_from_string(config.accelerator);
+  }
+
+  if (!config.bvh_split.empty()) {
+    bvh_opts.split_method = split_method_from_string(config.bvh_split);
+  }
+
+  if (config.bvh_width != 0) {
+    bvh_opts.width = config.bvh_width;
+  }
+
+  if (!config.bvh_nodes.empty()) {
+    bvh_opts.node_format = node_format_from_string(config.bvh_nodes);
+  }
+
+  // the render threads are idle until the BVH is built, so the build can use
+  // all of them
+  bvh_opts.build_threads = config.threads;
+
+  // the prototypes are built in the order they're declared, so a prototype
+  // can contain instances of the ones before it
+  prototype_map protos;
+  if (obj.contains("prototypes")) {
+    for (const auto &jv : at(obj, "prototypes").as_object()) {
+      const std::string key = jv.key_c_str();
+      std::vector<std::shared_ptr<Primitive>> proto_prims;
+      std::vector<std::shared_ptr<TriangleMesh>> proto_meshes;
+      std::vector<Object> proto_objs;
+      primitives_from_json(
+          at(jv.value().as_object(), "primitives", "prototypes").as_array(),
+          nullptr, triangle_test, protos, &proto_prims, &proto_meshes,
+          &proto_objs);
+      protos.insert({key, std::make_shared<Prototype>(
+                              std::move(proto_prims), std::move(proto_meshes),
+                              std::move(proto_objs), bvh_opts)});
+    }
+  }
+
   const auto json_objs = at(obj, "objects").as_array();
+  std::vector<std::shared_ptr<Primitive>> prims;
+  std::vector<std::shared_ptr<TriangleMesh>> meshes;
   std::vector<Object> objs;
+  prims.reserve(json_objs.size());
   objs.reserve(json_objs.size());
 
   for (const auto &o : json_objs) {
@@ -178,17 +332,20 @@ Scene Scene::from_json(const object &obj, const float aspect_r) {
                                material_key + "\"");
     }
 
-    const auto material = mats.at(material_key);
-    const auto primitives = at(o_as_obj, "primitives", "objects");
+    const auto material = mats.at(material_key).get();
+    primitives_from_json(at(o_as_obj, "primitives", "objects").as_array(),
+                         material, triangle_test, protos, &prims, &meshes,
+                         &objs);
+  }
 
-    for (const auto &p : primitives.as_array()) {
-      const auto primitive = Primitive::from_json(p.as_object());
-      objs.push_back({.primitive = primitive, .material = material});
-    }
+  auto bvh_cache = std::string();
+  if (!config.bvh_cache.empty()) {
+    bvh_cache =
+        bvh_cache_path(config.bvh_cache, obj, triangle_test, bvh_opts);
   }
 
   const auto cam = Camera(at(obj, "camera").as_object(), aspect_r);
-  return Scene(objs, mats, cam);
+  return Scene(prims, objs, mats, cam, bvh_opts, meshes, protos, bvh_cache);
 }
 
 // this function is nearly identical to the multithreaded function
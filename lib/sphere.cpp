@@ -30,41 +30,13 @@ Sphere::Sphere(const object &obj) {
   radius = rad;
 }
 
-std::optional<Intersection> Sphere::hit(const Ray &r, const float t_min,
-                                        const float t_max) const {
-  Vec3 oc = r.origin() - center;
-  const auto a = r.direction().length_squared();
-  const auto half_b = oc.dot(r.direction());
-  const auto c = oc.length_squared() - radius * radius;
-
-  const auto discriminant = half_b * half_b - a * c;
-
-  if (discriminant < 0) {
-    return std::nullopt;
-  }
-
-  const auto sqrtd = sqrtf(discriminant);
-
-  // Find the nearest root that lies in the acceptable range.
-  auto root = (-half_b - sqrtd) / a;
-  if (root < t_min || t_max < root) {
-    root = (-half_b + sqrtd) / a;
-    if (root < t_min || t_max < root) {
-      return std::nullopt;
-    }
-  }
-
-  const auto point = r.point_at_parameter(root);
-  return {{
-      .point = point,
-      .normal = (point - center) / radius,
-      .t = root,
-  }};
-}
-
 AABB Sphere::aabb() const {
   return AABB(center - Vec3(radius, radius, radius),
               center + Vec3(radius, radius, radius));
 }
 
+std::optional<SphereData> Sphere::sphere_data() const {
+  return {{.center = center, .radius = radius}};
+}
+
 } // namespace ronald
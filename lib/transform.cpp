@@ -0,0 +1,65 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "transform.hpp"
+
+#include <cmath>
+#include <stdexcept>
+
+namespace ronald {
+
+AABB Transform::aabb(const AABB &box) const {
+  auto ret = AABB::empty();
+  for (size_t corner = 0; corner < 8; ++corner) {
+    const auto p = Vec3(corner & 1 ? box.max.x() : box.min.x(),
+                        corner & 2 ? box.max.y() : box.min.y(),
+                        corner & 4 ? box.max.z() : box.min.z());
+    const auto q = point(p);
+    ret = AABB::surrounding_box(ret, AABB(q, q));
+  }
+  return ret;
+}
+
+Transform Transform::inverse() const {
+  // the inverse of the linear part is its adjugate over its determinant
+  const auto c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+  const auto c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+  const auto c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+  const auto det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+  if (!std::isnormal(det)) {
+    throw std::runtime_error("Transform is not invertible");
+  }
+
+  const auto inv_det = 1.0f / det;
+  std::array<std::array<float, 4>, 3> inv = {{
+      {c00 * inv_det, (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det,
+       (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det, 0},
+      {c01 * inv_det, (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det,
+       (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det, 0},
+      {c02 * inv_det, (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det,
+       (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det, 0},
+  }};
+
+  // undo the translation after undoing the linear part
+  auto ret = Transform(inv);
+  const auto t = ret.vector(Vec3(m[0][3], m[1][3], m[2][3]));
+  for (size_t row = 0; row < 3; ++row) {
+    ret.m[row][3] = -t[row];
+  }
+  return ret;
+}
+
+} // namespace ronald
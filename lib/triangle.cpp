@@ -20,6 +20,10 @@
 
 namespace ronald {
 
+// The bboxes of triangles are padded by this much to prevent zero-volume
+// bboxes when the triangle is axis-aligned
+constexpr float AABB_PADDING = 0.0001f;
+
 Triangle::Triangle(const Vec3 &v0_a, const Vec3 &v1_a, const Vec3 &v2_a,
                    const float normal_a) {
   v0 = v0_a;
@@ -44,51 +48,7 @@ Triangle::Triangle(const object &obj) {
   normal = edge1.cross(edge2).normalize() * norm;
 }
 
-/**
- * Möller–Trumbore algorithm for triangle intersection
- * https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
- */
-std::optional<Intersection> Triangle::hit(const Ray &r, const float t_min,
-                                          const float t_max) const {
-  const auto h = r.direction().cross(edge2);
-  const auto a = edge1.dot(h);
-
-  if (a > -EPSILON && a < EPSILON) {
-    return std::nullopt;
-  }
-
-  const auto f = 1 / a;
-  const auto s = r.origin() - v0;
-  const auto u = f * s.dot(h);
-
-  // TODO: this branch might be unpredictable, should profile this
-  if (u < 0.0 || u > 1.0) {
-    return std::nullopt;
-  }
-
-  const auto q = s.cross(edge1);
-  const auto v = f * r.direction().dot(q);
-
-  // TODO: this might also be unpredictable, check it
-  if (v < 0.0 || u + v > 1.0) {
-    return std::nullopt;
-  }
-
-  const auto t = f * edge2.dot(q);
-
-  if (t > EPSILON && t > t_min && t < t_max) {
-    const auto point = r.origin() + r.direction() * t;
-    return {{
-        point,
-        normal,
-        t,
-    }};
-  }
-
-  return std::nullopt;
-}
-
-AABB Triangle::aabb() const {
+AABB triangle_aabb(const Vec3 &v0, const Vec3 &v1, const Vec3 &v2) {
   const auto min_x =
       std::min(std::min(v0.x(), v1.x()), std::min(v1.x(), v2.x()));
   const auto min_y =
@@ -102,11 +62,112 @@ AABB Triangle::aabb() const {
   const auto max_z =
       std::max(std::max(v0.z(), v1.z()), std::max(v1.z(), v2.z()));
 
-  // we will add `EPSILON` padding to the bbox to prevent zero-volume bboxes
-  // when the triangle is axis-aligned
-  constexpr float ep = 0.0001f;
+  constexpr float ep = AABB_PADDING;
   return AABB(Vec3(min_x - ep, min_y - ep, min_z - ep),
               Vec3(max_x + ep, max_y + ep, max_z + ep));
 }
 
+/**
+ * Sutherland–Hodgman clipping of the polygon against each of the six planes
+ * of the box in turn. Each plane can add at most one vertex to a convex
+ * polygon, so clipping a quad leaves at most ten vertices
+ *
+ * https://en.wikipedia.org/wiki/Sutherland%E2%80%93Hodgman_algorithm
+ */
+AABB polygon_clipped_aabb(std::span<const Vec3> vertices, const AABB &box) {
+  constexpr size_t MAX_VERTICES = 4;
+  if (vertices.size() > MAX_VERTICES) {
+    throw std::runtime_error("Can only clip polygons with up to 4 vertices");
+  }
+
+  std::array<Vec3, MAX_VERTICES + 6> poly;
+  std::array<Vec3, MAX_VERTICES + 6> clipped;
+  std::copy(vertices.begin(), vertices.end(), poly.begin());
+  size_t n = vertices.size();
+
+  for (size_t axis = 0; axis < 3 && n > 0; ++axis) {
+    for (const auto side : {-1.0f, 1.0f}) {
+      // a point is inside the plane when `inside` is non-negative
+      const auto plane = side < 0 ? box.min[axis] : box.max[axis];
+      const auto inside = [&](const Vec3 &p) { return (plane - p[axis]) * side; };
+
+      size_t m = 0;
+      for (size_t i = 0; i < n; ++i) {
+        const auto &a = poly[i];
+        const auto &b = poly[(i + 1) % n];
+        const auto da = inside(a);
+        const auto db = inside(b);
+
+        if (da >= 0) {
+          clipped[m++] = a;
+        }
+        if ((da >= 0) != (db >= 0)) {
+          clipped[m++] = a + (b - a) * (da / (da - db));
+        }
+      }
+
+      poly = clipped;
+      n = m;
+      if (n == 0) {
+        break;
+      }
+    }
+  }
+
+  auto bounds = AABB::empty();
+  for (size_t i = 0; i < n; ++i) {
+    bounds = AABB::surrounding_box(bounds, AABB(poly[i], poly[i]));
+  }
+
+  if (bounds.is_empty()) {
+    return bounds;
+  }
+
+  // pad the bounds like the unclipped bbox. the box is padded as well so the
+  // bounds of the pieces on either side of a split overlap slightly, and a
+  // ray hitting the polygon right on the split plane can't slip between them
+  constexpr float ep = AABB_PADDING;
+  const auto pad = Vec3(ep, ep, ep);
+  return AABB::intersection(AABB(bounds.min - pad, bounds.max + pad),
+                            AABB(box.min - pad, box.max + pad));
+}
+
+AABB triangle_clipped_aabb(const Vec3 &v0, const Vec3 &v1, const Vec3 &v2,
+                           const AABB &box) {
+  const std::array<Vec3, 3> vertices = {v0, v1, v2};
+  return polygon_clipped_aabb(vertices, box);
+}
+
+AABB Triangle::aabb() const { return triangle_aabb(v0, v1, v2); }
+
+AABB Triangle::clipped_aabb(const AABB &box) const {
+  return triangle_clipped_aabb(v0, v1, v2, box);
+}
+
+std::optional<TriangleData> Triangle::triangle_data() const {
+  return {{.v0 = v0, .edge1 = edge1, .edge2 = edge2, .normal = normal}};
+}
+
+WatertightTriangle::WatertightTriangle(const Vec3 &v0_a, const Vec3 &v1_a,
+                                       const Vec3 &v2_a, const float normal_a)
+    : v0(v0_a), v1(v1_a), v2(v2_a),
+      normal((v1_a - v0_a).cross(v2_a - v0_a).normalize() * normal_a) {}
+
+WatertightTriangle::WatertightTriangle(const object &obj) {
+  const auto norm = get<float>(obj, "normal", "primitive");
+  const auto vertices =
+      get<std::array<std::array<float, 3>, 3>>(obj, "vertices", "primitive");
+
+  v0 = Vec3(vertices[0]);
+  v1 = Vec3(vertices[1]);
+  v2 = Vec3(vertices[2]);
+  normal = (v1 - v0).cross(v2 - v0).normalize() * norm;
+}
+
+AABB WatertightTriangle::aabb() const { return triangle_aabb(v0, v1, v2); }
+
+AABB WatertightTriangle::clipped_aabb(const AABB &box) const {
+  return triangle_clipped_aabb(v0, v1, v2, box);
+}
+
 } // namespace ronald
@@ -0,0 +1,596 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bvh.hpp"
+#include "common.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <immintrin.h>
+
+namespace ronald {
+
+/**
+ * The ray in the form used by the slab test against the children of a wide
+ * node. The inverse direction is not normalized so that the distances from
+ * the slab test are in the same units as the primitive hits, which lets us
+ * cull children that are further away than the closest hit found so far
+ */
+struct WideRay {
+  __m256 inv_x;
+  __m256 inv_y;
+  __m256 inv_z;
+  __m256 ori_x;
+  __m256 ori_y;
+  __m256 ori_z;
+
+  // depending on the sign of the ray direction, either the min or the max
+  // plane of each slab is the one the ray enters through
+  bool neg_x;
+  bool neg_y;
+  bool neg_z;
+
+  explicit WideRay(const Ray &r) {
+    const auto inv_dir = 1.0f / r.direction();
+    const auto ori = r.origin();
+    inv_x = _mm256_set1_ps(inv_dir.x());
+    inv_y = _mm256_set1_ps(inv_dir.y());
+    inv_z = _mm256_set1_ps(inv_dir.z());
+    ori_x = _mm256_set1_ps(ori.x());
+    ori_y = _mm256_set1_ps(ori.y());
+    ori_z = _mm256_set1_ps(ori.z());
+    neg_x = inv_dir.x() < 0.0f;
+    neg_y = inv_dir.y() < 0.0f;
+    neg_z = inv_dir.z() < 0.0f;
+  }
+};
+
+/**
+ * Test the ray against the bounds of the eight children of a node at once.
+ * The distance to the near plane of each child is written to `t_near`, and
+ * the returned mask has a bit set for every child hit between `t_min` and
+ * `t_max`
+ */
+inline uint32_t slab_test(const WideBounds &b, const WideRay &ray,
+                          const __m256 t_min, const __m256 t_max,
+                          __m256 *t_near) {
+  // the (bound - origin) * inv_dir form is used over a fused multiply-add
+  // because it produces correct infinities for directions with a zero
+  // component. the only NaN case (origin exactly on the plane of an
+  // axis-parallel ray) is ignored by the max/min below, which return their
+  // second operand when the first one is NaN
+  const auto tn_x = _mm256_mul_ps(
+      _mm256_sub_ps(ray.neg_x ? b.max_x : b.min_x, ray.ori_x), ray.inv_x);
+  const auto tn_y = _mm256_mul_ps(
+      _mm256_sub_ps(ray.neg_y ? b.max_y : b.min_y, ray.ori_y), ray.inv_y);
+  const auto tn_z = _mm256_mul_ps(
+      _mm256_sub_ps(ray.neg_z ? b.max_z : b.min_z, ray.ori_z), ray.inv_z);
+  const auto tf_x = _mm256_mul_ps(
+      _mm256_sub_ps(ray.neg_x ? b.min_x : b.max_x, ray.ori_x), ray.inv_x);
+  const auto tf_y = _mm256_mul_ps(
+      _mm256_sub_ps(ray.neg_y ? b.min_y : b.max_y, ray.ori_y), ray.inv_y);
+  const auto tf_z = _mm256_mul_ps(
+      _mm256_sub_ps(ray.neg_z ? b.min_z : b.max_z, ray.ori_z), ray.inv_z);
+
+  *t_near = _mm256_max_ps(tn_x,
+                          _mm256_max_ps(tn_y, _mm256_max_ps(tn_z, t_min)));
+  const auto t_far =
+      _mm256_min_ps(tf_x, _mm256_min_ps(tf_y, _mm256_min_ps(tf_z, t_max)));
+
+  return static_cast<uint32_t>(
+      _mm256_movemask_ps(_mm256_cmp_ps(*t_near, t_far, _CMP_LE_OQ)));
+}
+
+WideBounds WideBVH::WideBVHNode::bounds() const {
+  return {.min_x = _mm256_load_ps(min_x),
+          .min_y = _mm256_load_ps(min_y),
+          .min_z = _mm256_load_ps(min_z),
+          .max_x = _mm256_load_ps(max_x),
+          .max_y = _mm256_load_ps(max_y),
+          .max_z = _mm256_load_ps(max_z)};
+}
+
+uint32_t WideBVH::WideBVHNode::child_offset(const uint32_t child) const {
+  return offset[child];
+}
+
+uint32_t WideBVH::WideBVHNode::count(const uint32_t child) const {
+  return nObjects[child];
+}
+
+BVHLeaves::LeafKind
+WideBVH::WideBVHNode::leaf_kind(const uint32_t child) const {
+  return static_cast<BVHLeaves::LeafKind>(kind[child]);
+}
+
+/**
+ * Get the scale of the quantized bounds for the given exponent. The exponent
+ * is kept in the range of normal floats, so the scale can be built directly
+ * from its bits
+ */
+inline float quantization_scale(const int exponent) {
+  return std::bit_cast<float>(static_cast<uint32_t>(exponent + 127) << 23);
+}
+
+/**
+ * Decode the eight quantized values of one plane of the children of a node
+ */
+inline __m256 decode_plane(const uint8_t *q, const __m256 scale,
+                           const __m256 origin) {
+  const auto bytes =
+      _mm_loadl_epi64(reinterpret_cast<const __m128i *>(q));
+  return _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes)),
+                         scale, origin);
+}
+
+WideBounds WideBVH::CompressedWideBVHNode::bounds() const {
+  const auto s_x = _mm256_set1_ps(quantization_scale(exponent[0]));
+  const auto s_y = _mm256_set1_ps(quantization_scale(exponent[1]));
+  const auto s_z = _mm256_set1_ps(quantization_scale(exponent[2]));
+  const auto o_x = _mm256_set1_ps(origin[0]);
+  const auto o_y = _mm256_set1_ps(origin[1]);
+  const auto o_z = _mm256_set1_ps(origin[2]);
+  return {.min_x = decode_plane(q_min_x, s_x, o_x),
+          .min_y = decode_plane(q_min_y, s_y, o_y),
+          .min_z = decode_plane(q_min_z, s_z, o_z),
+          .max_x = decode_plane(q_max_x, s_x, o_x),
+          .max_y = decode_plane(q_max_y, s_y, o_y),
+          .max_z = decode_plane(q_max_z, s_z, o_z)};
+}
+
+uint32_t
+WideBVH::CompressedWideBVHNode::child_offset(const uint32_t child) const {
+  // the unused slots are all at the end, so every slot before a child that
+  // was hit is in use, and the ones with no objects are internal
+  if (meta[child] == 0) {
+    uint32_t rank = 0;
+    for (uint32_t i = 0; i < child; ++i) {
+      rank += meta[i] == 0;
+    }
+    return child_base + rank;
+  }
+
+  const auto kind = leaf_kind(child);
+  auto offset = static_cast<size_t>(leaf_base[static_cast<size_t>(kind)]);
+  for (uint32_t i = 0; i < child; ++i) {
+    if (meta[i] != 0 && leaf_kind(i) == kind) {
+      offset += BVHLeaves::leaf_size(kind, count(i));
+    }
+  }
+  return static_cast<uint32_t>(offset);
+}
+
+uint32_t WideBVH::CompressedWideBVHNode::count(const uint32_t child) const {
+  return meta[child] & MAX_COUNT;
+}
+
+BVHLeaves::LeafKind
+WideBVH::CompressedWideBVHNode::leaf_kind(const uint32_t child) const {
+  return static_cast<BVHLeaves::LeafKind>(meta[child] >> COUNT_BITS);
+}
+
+/**
+ * Find the exponent of the smallest power of two scale for which 255 steps
+ * from `lo` reach at least `hi`. The decoded value is computed exactly like
+ * the traversal does, so the rounding of the addition is accounted for. The
+ * steps also always have to move away from `lo`, even when the bounds are
+ * flat, so that the inverted bounds of the unused slots stay inverted
+ */
+int8_t quantization_exponent(const float lo, const float hi) {
+  constexpr int MIN_EXPONENT = -126;
+  constexpr int MAX_EXPONENT = 127;
+
+  // start from an estimate a little below the answer and step up from there
+  int extent_exponent = MIN_EXPONENT;
+  int lo_exponent = MIN_EXPONENT;
+  if (hi > lo) {
+    std::frexp((hi - lo) / 255.0f, &extent_exponent);
+  }
+  if (lo != 0.0f) {
+    std::frexp(lo, &lo_exponent);
+  }
+  auto exponent = std::max({extent_exponent - 1, lo_exponent - 32,
+                            MIN_EXPONENT});
+
+  const auto top = [&]() {
+    return std::fma(255.0f, quantization_scale(exponent), lo);
+  };
+  while (top() < hi || top() <= lo) {
+    if (++exponent > MAX_EXPONENT) {
+      throw std::runtime_error("BVH bounds are too large to quantize");
+    }
+  }
+  return static_cast<int8_t>(exponent);
+}
+
+/**
+ * Quantize the lower bound of a child, rounding down so that the decoded
+ * bound is never above the real one
+ */
+uint8_t quantize_min(const float x, const float origin, const float scale) {
+  auto q = std::clamp(std::floor((x - origin) / scale), 0.0f, 255.0f);
+  while (q > 0.0f && std::fma(q, scale, origin) > x) {
+    q -= 1.0f;
+  }
+  return static_cast<uint8_t>(q);
+}
+
+/**
+ * Quantize the upper bound of a child, rounding up so that the decoded bound
+ * is never below the real one
+ */
+uint8_t quantize_max(const float x, const float origin, const float scale) {
+  auto q = std::clamp(std::ceil((x - origin) / scale), 0.0f, 255.0f);
+  while (q < 255.0f && std::fma(q, scale, origin) < x) {
+    q += 1.0f;
+  }
+  return static_cast<uint8_t>(q);
+}
+
+WideBVH::WideBVH(std::vector<Object> &objs, const BVHOptions &opts)
+    : format(opts.node_format) {
+  if (format == NodeFormat::Compressed &&
+      opts.max_leaf_size > CompressedWideBVHNode::MAX_COUNT) {
+    throw std::runtime_error(
+        "Compressed BVH nodes hold at most " +
+        std::to_string(CompressedWideBVHNode::MAX_COUNT) +
+        " objects per leaf, lower the BVH `max_leaf_size`");
+  }
+
+  size_t total_nodes = 0;
+  const auto bvh = BVH::build_bvh(objs, &total_nodes, opts);
+
+  // the collapsed tree has at most as many nodes as the binary tree has
+  // internal nodes, usually far fewer
+  if (format == NodeFormat::Full) {
+    nodes.reserve(total_nodes / 2 + 1);
+  } else {
+    compressed_nodes.reserve(total_nodes / 2 + 1);
+  }
+  recursive_collapse(bvh, allocate_nodes(1), 1);
+}
+
+uint32_t WideBVH::allocate_nodes(const size_t count) {
+  const auto size = format == NodeFormat::Full ? nodes.size()
+                                               : compressed_nodes.size();
+  if (size + count > std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("too many BVH nodes");
+  }
+
+  if (format == NodeFormat::Full) {
+    nodes.resize(size + count);
+  } else {
+    compressed_nodes.resize(size + count);
+  }
+  return static_cast<uint32_t>(size);
+}
+
+void WideBVH::recursive_collapse(const BVH &node, const uint32_t index,
+                                 const size_t depth) {
+  // only the largest internal child is opened up at each step, so a branch
+  // with smaller children can keep most of its binary depth
+  max_depth = std::max(max_depth, depth);
+
+  // gather up to WIDTH children for the new node. we start with the node
+  // itself and keep replacing the internal child with the largest surface
+  // area by its two children, since that is the child most likely to be
+  // traversed by a ray
+  std::vector<const BVH *> children = {&node};
+  while (children.size() < WIDTH) {
+    auto largest = children.end();
+    auto largest_area = -1.0f;
+    for (auto it = children.begin(); it != children.end(); ++it) {
+      const auto area = (*it)->aabb().surface_area();
+      if ((*it)->node_type() == NodeType::Internal && area > largest_area) {
+        largest = it;
+        largest_area = area;
+      }
+    }
+
+    if (largest == children.end()) {
+      break;
+    }
+
+    const auto &[left, right] = std::get<BVHPair>((*largest)->get_data());
+    *largest = left.get();
+    children.push_back(right.get());
+  }
+
+  std::vector<WideChild> wide;
+  wide.reserve(children.size());
+  size_t n_internal = 0;
+  for (const auto *child : children) {
+    if (child->node_type() == NodeType::Leaf) {
+      const auto &objs = std::get<std::vector<Object>>(child->get_data());
+      const auto leaf = leaves.add(objs);
+      wide.push_back({.bounds = child->aabb(),
+                      .offset = leaf.offset,
+                      .count = static_cast<uint16_t>(objs.size()),
+                      .kind = leaf.kind});
+    } else {
+      n_internal += 1;
+      wide.push_back({.bounds = child->aabb(),
+                      .offset = 0,
+                      .count = 0,
+                      .kind = BVHLeaves::LeafKind::Entries});
+    }
+  }
+
+  auto next = allocate_nodes(n_internal);
+  for (auto &child : wide) {
+    if (child.count == 0) {
+      child.offset = next++;
+    }
+  }
+  store_node(index, wide);
+
+  for (size_t i = 0; i < children.size(); ++i) {
+    if (wide[i].count == 0) {
+      recursive_collapse(*children[i], wide[i].offset, depth + 1);
+    }
+  }
+}
+
+void WideBVH::store_node(const uint32_t index,
+                         std::span<const WideChild> children) {
+  if (format == NodeFormat::Full) {
+    // every slot starts out empty with inverted bounds. with those bounds the
+    // near plane of the slab test is always +inf and the far plane is always
+    // -inf, regardless of the ray direction, so empty slots never get hit
+    constexpr auto inf = std::numeric_limits<float>::infinity();
+    auto &n = nodes[index];
+    std::fill(std::begin(n.min_x), std::end(n.min_x), inf);
+    std::fill(std::begin(n.min_y), std::end(n.min_y), inf);
+    std::fill(std::begin(n.min_z), std::end(n.min_z), inf);
+    std::fill(std::begin(n.max_x), std::end(n.max_x), -inf);
+    std::fill(std::begin(n.max_y), std::end(n.max_y), -inf);
+    std::fill(std::begin(n.max_z), std::end(n.max_z), -inf);
+    std::fill(std::begin(n.offset), std::end(n.offset), 0);
+    std::fill(std::begin(n.nObjects), std::end(n.nObjects), 0);
+    std::fill(std::begin(n.kind), std::end(n.kind), 0);
+
+    for (size_t i = 0; i < children.size(); ++i) {
+      const auto &bb = children[i].bounds;
+      n.min_x[i] = bb.min.x();
+      n.min_y[i] = bb.min.y();
+      n.min_z[i] = bb.min.z();
+      n.max_x[i] = bb.max.x();
+      n.max_y[i] = bb.max.y();
+      n.max_z[i] = bb.max.z();
+      n.offset[i] = children[i].offset;
+      n.nObjects[i] = children[i].count;
+      n.kind[i] = static_cast<uint8_t>(children[i].kind);
+    }
+    return;
+  }
+
+  auto bounds = AABB::empty();
+  for (const auto &child : children) {
+    bounds = AABB::surrounding_box(bounds, child.bounds);
+  }
+
+  // the empty slots are inverted, with the min at the top of the node and
+  // the max at the bottom, so like with the full nodes they are never hit
+  auto &n = compressed_nodes[index];
+  n = {};
+  uint8_t *q_min[3] = {n.q_min_x, n.q_min_y, n.q_min_z};
+  uint8_t *q_max[3] = {n.q_max_x, n.q_max_y, n.q_max_z};
+  float scale[3] = {};
+  for (size_t axis = 0; axis < 3; ++axis) {
+    n.origin[axis] = bounds.min[axis];
+    n.exponent[axis] = quantization_exponent(bounds.min[axis],
+                                             bounds.max[axis]);
+    scale[axis] = quantization_scale(n.exponent[axis]);
+    std::fill(q_min[axis], q_min[axis] + WIDTH, 255);
+    std::fill(q_max[axis], q_max[axis] + WIDTH, 0);
+  }
+
+  bool has_internal = false;
+  bool has_leaf[3] = {};
+  for (size_t i = 0; i < children.size(); ++i) {
+    const auto &child = children[i];
+    for (size_t axis = 0; axis < 3; ++axis) {
+      q_min[axis][i] =
+          quantize_min(child.bounds.min[axis], n.origin[axis], scale[axis]);
+      q_max[axis][i] =
+          quantize_max(child.bounds.max[axis], n.origin[axis], scale[axis]);
+    }
+
+    if (child.count == 0) {
+      if (!has_internal) {
+        n.child_base = child.offset;
+        has_internal = true;
+      }
+      continue;
+    }
+
+    const auto kind = static_cast<size_t>(child.kind);
+    if (!has_leaf[kind]) {
+      n.leaf_base[kind] = child.offset;
+      has_leaf[kind] = true;
+    }
+    n.meta[i] = static_cast<uint8_t>(
+        (kind << CompressedWideBVHNode::COUNT_BITS) | child.count);
+
+    // the offsets aren't stored, so they had better be where the traversal
+    // is going to look for them
+    assert(n.child_offset(static_cast<uint32_t>(i)) == child.offset);
+  }
+}
+
+template <typename Node>
+std::optional<Hit> WideBVH::intersect_nodes(const std::vector<Node> &ns,
+                                            const Ray &r, const float t_min,
+                                            const float t_max) const {
+  // only the distance and primitive of the closest hit are tracked during
+  // traversal, its surface is computed once at the end
+  BVHLeaves::LeafHit closest = {};
+  bool found = false;
+
+  auto min_so_far = t_max;
+
+  const auto ray = WideRay(r);
+  const auto t_min_v = _mm256_set1_ps(t_min);
+
+  struct StackEntry {
+    uint32_t node;
+    float t_near;
+  };
+
+  // each node visit can push at most WIDTH - 1 entries more than it pops,
+  // and only the nodes above the deepest level push anything
+  const auto capacity = 1 + (WIDTH - 1) * max_depth;
+  StackEntry fixed_stack[STACK_SIZE];
+  std::vector<StackEntry> heap_stack(capacity > STACK_SIZE ? capacity : 0);
+  auto *stack = heap_stack.empty() ? fixed_stack : heap_stack.data();
+  size_t stack_size = 1;
+  stack[0] = {.node = 0, .t_near = t_min};
+
+  while (stack_size > 0) {
+    const auto entry = stack[--stack_size];
+
+    // a closer hit may have been found since this node was pushed
+    if (entry.t_near > min_so_far) {
+      continue;
+    }
+
+    const auto &node = ns[entry.node];
+
+    __m256 t_near;
+    auto mask = slab_test(node.bounds(), ray, t_min_v,
+                          _mm256_set1_ps(min_so_far), &t_near);
+
+    if (mask == 0) {
+      continue;
+    }
+
+    alignas(32) float t_nears[WIDTH];
+    _mm256_store_ps(t_nears, t_near);
+
+    // sort the children that were hit front to back. there are at most
+    // eight of them so a simple insertion sort is the fastest option
+    uint32_t order[WIDTH];
+    size_t n_hit = 0;
+    while (mask != 0) {
+      const auto child = static_cast<uint32_t>(__builtin_ctz(mask));
+      mask &= mask - 1;
+
+      auto j = n_hit++;
+      while (j > 0 && t_nears[order[j - 1]] > t_nears[child]) {
+        order[j] = order[j - 1];
+        --j;
+      }
+      order[j] = child;
+    }
+
+    // intersect the leaves right away, nearest first, so that the closest
+    // hit shrinks as quickly as possible...
+    for (size_t i = 0; i < n_hit; ++i) {
+      const auto child = order[i];
+      const auto count = node.count(child);
+      if (count == 0 || t_nears[child] > min_so_far) {
+        continue;
+      }
+
+      found = leaves.intersect(node.child_offset(child), count,
+                               node.leaf_kind(child), r, t_min, &min_so_far,
+                               &closest) ||
+              found;
+    }
+
+    // ...then push the internal children in back-to-front order so that the
+    // nearest one gets popped first
+    for (size_t i = n_hit; i > 0; --i) {
+      const auto child = order[i - 1];
+      if (node.count(child) == 0 && t_nears[child] <= min_so_far) {
+        stack[stack_size++] = {.node = node.child_offset(child),
+                               .t_near = t_nears[child]};
+      }
+    }
+  }
+
+  if (!found) {
+    return std::nullopt;
+  }
+  return leaves.surface(r, closest);
+}
+
+template <typename Node>
+bool WideBVH::occluded_nodes(const std::vector<Node> &ns, const Ray &r,
+                             const float t_min, const float t_max) const {
+  const auto ray = WideRay(r);
+  const auto t_min_v = _mm256_set1_ps(t_min);
+  const auto t_max_v = _mm256_set1_ps(t_max);
+
+  // any hit will do, so the stack only needs the nodes and the children
+  // don't have to be sorted. `t_max` never shrinks, so nothing that was
+  // pushed can be culled later either. the stack is sized like the one of
+  // `intersect_nodes`
+  const auto capacity = 1 + (WIDTH - 1) * max_depth;
+  uint32_t fixed_stack[STACK_SIZE];
+  std::vector<uint32_t> heap_stack(capacity > STACK_SIZE ? capacity : 0);
+  auto *stack = heap_stack.empty() ? fixed_stack : heap_stack.data();
+  size_t stack_size = 1;
+  stack[0] = 0;
+
+  while (stack_size > 0) {
+    const auto &node = ns[stack[--stack_size]];
+
+    __m256 t_near;
+    auto mask = slab_test(node.bounds(), ray, t_min_v, t_max_v, &t_near);
+
+    while (mask != 0) {
+      const auto child = static_cast<uint32_t>(__builtin_ctz(mask));
+      mask &= mask - 1;
+
+      const auto count = node.count(child);
+      if (count == 0) {
+        stack[stack_size++] = node.child_offset(child);
+      } else if (leaves.occluded(node.child_offset(child), count,
+                                 node.leaf_kind(child), r, t_min, t_max)) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+std::optional<Hit> WideBVH::intersect(const Ray &r, const float t_min,
+                                      const float t_max) const {
+  if (format == NodeFormat::Compressed) {
+    return intersect_nodes(compressed_nodes, r, t_min, t_max);
+  }
+  return intersect_nodes(nodes, r, t_min, t_max);
+}
+
+bool WideBVH::occluded(const Ray &r, const float t_min,
+                       const float t_max) const {
+  if (format == NodeFormat::Compressed) {
+    return occluded_nodes(compressed_nodes, r, t_min, t_max);
+  }
+  return occluded_nodes(nodes, r, t_min, t_max);
+}
+
+AcceleratorMemory WideBVH::memory() const {
+  return {.nodes = nodes.size() * sizeof(WideBVHNode) +
+                   compressed_nodes.size() * sizeof(CompressedWideBVHNode),
+          .leaves = leaves.memory()};
+}
+
+} // namespace ronald
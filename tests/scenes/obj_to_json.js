@@ -122,39 +122,23 @@ const data = {
   ],
 };
 
+// the monkey is stored as a mesh so that vertices shared between faces are
+// only written out once. quads are split into two triangles
+const indices = [];
 for (let i = 0; i < faces.length; i++) {
-  if (faces[i].length === 3) {
-    data.objects[0].primitives.push({
-      type: "triangle",
-      vertices: [
-        vertexes[faces[i][0][0] - 1],
-        vertexes[faces[i][1][0] - 1],
-        vertexes[faces[i][2][0] - 1],
-      ],
-      normal: 1,
-    });
-  } else {
-    data.objects[0].primitives.push({
-      type: "triangle",
-      vertices: [
-        vertexes[faces[i][0][0] - 1],
-        vertexes[faces[i][1][0] - 1],
-        vertexes[faces[i][2][0] - 1],
-      ],
-      normal: 1,
-    });
-    data.objects[0].primitives.push({
-      type: "triangle",
-      vertices: [
-        vertexes[faces[i][0][0] - 1],
-        vertexes[faces[i][2][0] - 1],
-        vertexes[faces[i][3][0] - 1],
-      ],
-      normal: 1,
-    });
+  indices.push([faces[i][0][0] - 1, faces[i][1][0] - 1, faces[i][2][0] - 1]);
+  if (faces[i].length === 4) {
+    indices.push([faces[i][0][0] - 1, faces[i][2][0] - 1, faces[i][3][0] - 1]);
   }
 }
 
+data.objects[0].primitives.push({
+  type: "mesh",
+  normal: 1,
+  vertices: vertexes,
+  indices,
+});
+
 for (let i = 0; i < 10; i++) {
   const radius = 0.1;
   const angle = (i / 10) * 2 * Math.PI;
@@ -100,6 +100,23 @@ TEST_CASE("AABB Sphere intersection test", "[aabb]") {
   REQUIRE(aabb.hit(ray, inv_dir, t_min, t_max));
 }
 
+TEST_CASE("AABB diagonal miss test", "[aabb]") {
+  const auto aabb = AABB(Vec3(0, 0, 0), Vec3(1, 1, 1));
+  const auto t_min = 0;
+  const auto t_max = 10000000000;
+
+  // this ray passes through the x slab for t in [1, 2] and through the y slab
+  // for t in [2.5, 5], so it never is inside both at the same time
+  auto ray = Ray(Vec3(-1, 2, 0.5), Vec3(1, -0.4f, 0));
+  auto inv_dir = 1.0f / ray.direction();
+  REQUIRE(!aabb.hit(ray, inv_dir, t_min, t_max));
+
+  // a slightly steeper ray clips the corner of the box
+  ray = Ray(Vec3(-1, 2, 0.5), Vec3(1, -0.6f, 0));
+  inv_dir = 1.0f / ray.direction();
+  REQUIRE(aabb.hit(ray, inv_dir, t_min, t_max));
+}
+
 TEST_CASE("AABB surrounding_box test", "[aabb]") {
   const auto s1 = Sphere(Vec3(3, 3, 0), 5.0f);
   const auto s2 = Sphere(Vec3(-3, -3, 0), 2.0f);
@@ -19,18 +19,30 @@
 #include "material.hpp"
 #include "primitive.hpp"
 #include "ray.hpp"
+#include "scene.hpp"
 #include "vec3_tests.hpp"
 
 #include <catch2/catch.hpp>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <unordered_map>
 
 using ronald::AABB;
 using ronald::BVH;
+using ronald::BVHLeaves;
+using ronald::BVHOptions;
+using ronald::Box;
 using ronald::Dielectric;
+using ronald::FlatBVH;
 using ronald::NodeType;
 using ronald::Object;
+using ronald::Quad;
 using ronald::Ray;
 using ronald::Sphere;
+using ronald::Triangle;
 using ronald::Vec3;
+using ronald::WideBVH;
 
 constexpr auto T_MIN = 0;
 constexpr auto T_MAX = 10000000000;
@@ -41,9 +53,8 @@ TEST_CASE("Basic BVH construction test", "[bvh]") {
   const auto mat =
       std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
 
-  std::vector<Object> objs = {
-      {.primitive = std::make_shared<Sphere>(s1), .material = mat},
-      {.primitive = std::make_shared<Sphere>(s2), .material = mat}};
+  std::vector<Object> objs = {{.primitive = &s1, .material = mat.get()},
+                              {.primitive = &s2, .material = mat.get()}};
 
   size_t total_nodes = 0;
   const auto bvh = BVH::build_bvh(objs, &total_nodes);
@@ -60,9 +71,8 @@ TEST_CASE("Basic BVH intersection test", "[bvh]") {
   const auto mat =
       std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
 
-  std::vector<Object> objs = {
-      {.primitive = std::make_shared<Sphere>(s1), .material = mat},
-      {.primitive = std::make_shared<Sphere>(s2), .material = mat}};
+  std::vector<Object> objs = {{.primitive = &s1, .material = mat.get()},
+                              {.primitive = &s2, .material = mat.get()}};
 
   size_t total_nodes = 0;
   const auto bvh = BVH::build_bvh(objs, &total_nodes);
@@ -110,3 +120,1394 @@ TEST_CASE("Basic BVH intersection test", "[bvh]") {
   bvh_hit_result = bvh.intersect(ray, T_MIN, T_MAX);
   REQUIRE(!bvh_hit_result.has_value());
 }
+
+TEST_CASE("BVH split methods match brute force", "[bvh][sah]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  std::vector<Sphere> spheres;
+  for (int i = 0; i < 200; i++) {
+    const auto center = Vec3::rand() * 100;
+    const auto radius = ronald::random_float() * 3.0f + 0.1f;
+    spheres.emplace_back(center, radius);
+  }
+
+  std::vector<Object> objs;
+  for (const auto &s : spheres) {
+    objs.push_back({.primitive = &s, .material = mat.get()});
+  }
+
+  for (const auto method :
+       {ronald::SplitMethod::SAH, ronald::SplitMethod::Middle,
+        ronald::SplitMethod::LBVH, ronald::SplitMethod::SBVH}) {
+    for (const size_t max_leaf_size : {1, 8}) {
+      const auto opts = BVHOptions{.split_method = method,
+                                   .max_leaf_size = max_leaf_size};
+
+      auto bvh_objs = objs;
+      size_t total_nodes = 0;
+      const auto bvh = BVH::build_bvh(bvh_objs, &total_nodes, opts);
+      // the SAH only groups objects into a leaf when it's estimated to be
+      // cheaper, but the middle split always fills leaves up to the limit
+      if (max_leaf_size == 1) {
+        REQUIRE(total_nodes == 2 * objs.size() - 1);
+      } else if (method == ronald::SplitMethod::Middle) {
+        REQUIRE(total_nodes < 2 * objs.size() - 1);
+      }
+
+      auto flat_objs = objs;
+      const auto flat_bvh = FlatBVH(flat_objs, opts);
+
+      auto wide_objs = objs;
+      const auto wide_bvh = WideBVH(wide_objs, opts);
+
+      auto compressed_opts = opts;
+      compressed_opts.node_format = ronald::NodeFormat::Compressed;
+      auto compressed_objs = objs;
+      const auto compressed_bvh = WideBVH(compressed_objs, compressed_opts);
+
+      for (int i = 0; i < 200; i++) {
+        // the directions are deliberately not normalized since the renderer
+        // doesn't normalize its rays either
+        const auto origin = Vec3::rand() * 100;
+        const auto dir = (Vec3::rand() - Vec3(0.5, 0.5, 0.5)).normalize();
+        const auto scale = ronald::random_float() * 50 + 0.01f;
+        const auto ray = Ray(origin, dir * scale);
+
+        std::optional<float> expected_t = std::nullopt;
+        for (const auto &o : objs) {
+          const auto hit = o.primitive->hit(ray, T_MIN, T_MAX);
+          if (hit.has_value() && (!expected_t || hit->t < *expected_t)) {
+            expected_t = hit->t;
+          }
+        }
+
+        const auto bvh_hit = bvh.intersect(ray, T_MIN, T_MAX);
+        const auto flat_hit = flat_bvh.intersect(ray, T_MIN, T_MAX);
+        const auto wide_hit = wide_bvh.intersect(ray, T_MIN, T_MAX);
+        const auto compressed_hit = compressed_bvh.intersect(ray, T_MIN, T_MAX);
+        REQUIRE(bvh_hit.has_value() == expected_t.has_value());
+        REQUIRE(flat_hit.has_value() == expected_t.has_value());
+        REQUIRE(wide_hit.has_value() == expected_t.has_value());
+        REQUIRE(compressed_hit.has_value() == expected_t.has_value());
+        if (expected_t.has_value()) {
+          REQUIRE(bvh_hit->hit.t == Approx(*expected_t));
+          REQUIRE(flat_hit->hit.t == Approx(*expected_t));
+          REQUIRE(wide_hit->hit.t == Approx(*expected_t));
+          REQUIRE(compressed_hit->hit.t == Approx(*expected_t));
+        }
+      }
+    }
+  }
+}
+
+TEST_CASE("Parallel BVH build matches the serial build", "[bvh][parallel]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  // enough spheres that the builder actually hands subtrees off to threads
+  std::vector<Sphere> spheres;
+  for (int i = 0; i < 20000; i++) {
+    const auto center = Vec3::rand() * 100;
+    const auto radius = ronald::random_float() * 0.5f + 0.05f;
+    spheres.emplace_back(center, radius);
+  }
+
+  std::vector<Object> objs;
+  for (const auto &s : spheres) {
+    objs.push_back({.primitive = &s, .material = mat.get()});
+  }
+
+  for (const auto method :
+       {ronald::SplitMethod::SAH, ronald::SplitMethod::Middle,
+        ronald::SplitMethod::LBVH}) {
+    auto serial_objs = objs;
+    size_t serial_nodes = 0;
+    const auto serial = BVH::build_bvh(
+        serial_objs, &serial_nodes,
+        BVHOptions{.split_method = method, .build_threads = 1});
+
+    auto parallel_objs = objs;
+    size_t parallel_nodes = 0;
+    const auto parallel = BVH::build_bvh(
+        parallel_objs, &parallel_nodes,
+        BVHOptions{.split_method = method, .build_threads = 4});
+
+    REQUIRE(serial_nodes == parallel_nodes);
+    REQUIRE(serial.aabb().min == parallel.aabb().min);
+    REQUIRE(serial.aabb().max == parallel.aabb().max);
+
+    for (int i = 0; i < 500; i++) {
+      const auto origin = Vec3::rand() * 100;
+      const auto dir = (Vec3::rand() - Vec3(0.5, 0.5, 0.5)).normalize();
+      const auto ray = Ray(origin, dir);
+
+      const auto serial_hit = serial.intersect(ray, T_MIN, T_MAX);
+      const auto parallel_hit = parallel.intersect(ray, T_MIN, T_MAX);
+      REQUIRE(serial_hit.has_value() == parallel_hit.has_value());
+      if (serial_hit.has_value()) {
+        REQUIRE(serial_hit->hit.t == parallel_hit->hit.t);
+      }
+    }
+  }
+}
+
+TEST_CASE("LBVH with identical Morton codes", "[bvh][lbvh]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  // concentric spheres all share a centroid, so every Morton code is the
+  // same and the builder has to fall back to splitting the range in half
+  std::vector<Sphere> spheres;
+  for (int i = 0; i < 50; i++) {
+    spheres.emplace_back(Vec3(1, 2, 3), static_cast<float>(i + 1));
+  }
+
+  std::vector<Object> objs;
+  for (const auto &s : spheres) {
+    objs.push_back({.primitive = &s, .material = mat.get()});
+  }
+
+  size_t total_nodes = 0;
+  const auto bvh = BVH::build_bvh(
+      objs, &total_nodes,
+      BVHOptions{.split_method = ronald::SplitMethod::LBVH,
+                 .max_leaf_size = 1});
+  REQUIRE(total_nodes == 2 * objs.size() - 1);
+
+  const auto ray = Ray(Vec3(1, 2, -100), Vec3(0, 0, 1));
+  const auto hit = bvh.intersect(ray, T_MIN, T_MAX);
+  REQUIRE(hit.has_value());
+  REQUIRE(hit->hit.t == Approx(103 - 50));
+}
+
+TEST_CASE("SBVH with long thin triangles", "[bvh][sbvh]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  // long slivers spanning the whole scene diagonally, mixed in with small
+  // triangles. the slivers' bboxes overlap almost everything
+  std::vector<ronald::Triangle> triangles;
+  for (int i = 0; i < 20; i++) {
+    const auto a = Vec3::rand() * 5;
+    const auto b = Vec3(100, 100, 100) - Vec3::rand() * 5;
+    triangles.emplace_back(a, b, b + Vec3::rand(), 1.0f);
+  }
+  for (int i = 0; i < 300; i++) {
+    const auto a = Vec3::rand() * 100;
+    triangles.emplace_back(a, a + Vec3::rand() * 2, a + Vec3::rand() * 2,
+                           1.0f);
+  }
+
+  std::vector<Object> objs;
+  for (const auto &t : triangles) {
+    objs.push_back({.primitive = &t, .material = mat.get()});
+  }
+
+  for (const auto max_duplication : {0.0f, 0.3f, 10.0f}) {
+    const auto opts = BVHOptions{.split_method = ronald::SplitMethod::SBVH,
+                                 .max_duplication = max_duplication};
+
+    auto bvh_objs = objs;
+    size_t total_nodes = 0;
+    const auto bvh = BVH::build_bvh(bvh_objs, &total_nodes, opts);
+
+    auto flat_objs = objs;
+    const auto flat_bvh = FlatBVH(flat_objs, opts);
+
+    auto wide_objs = objs;
+    const auto wide_bvh = WideBVH(wide_objs, opts);
+
+    for (int i = 0; i < 500; i++) {
+      const auto origin = Vec3::rand() * 100;
+      const auto target = Vec3::rand() * 100;
+      const auto ray = Ray(origin, target - origin);
+
+      std::optional<float> expected_t = std::nullopt;
+      for (const auto &o : objs) {
+        const auto hit = o.primitive->hit(ray, T_MIN, T_MAX);
+        if (hit.has_value() && (!expected_t || hit->t < *expected_t)) {
+          expected_t = hit->t;
+        }
+      }
+
+      const auto bvh_hit = bvh.intersect(ray, T_MIN, T_MAX);
+      const auto flat_hit = flat_bvh.intersect(ray, T_MIN, T_MAX);
+      const auto wide_hit = wide_bvh.intersect(ray, T_MIN, T_MAX);
+      REQUIRE(bvh_hit.has_value() == expected_t.has_value());
+      REQUIRE(flat_hit.has_value() == expected_t.has_value());
+      REQUIRE(wide_hit.has_value() == expected_t.has_value());
+      if (expected_t.has_value()) {
+        // the flattened trees intersect the triangles with the SIMD kernel,
+        // which rounds differently. rays hitting the slivers at grazing
+        // angles are badly conditioned enough for that to show up in `t`
+        REQUIRE(bvh_hit->hit.t == Approx(*expected_t));
+        REQUIRE(flat_hit->hit.t == Approx(*expected_t).epsilon(1e-3));
+        REQUIRE(wide_hit->hit.t == Approx(*expected_t).epsilon(1e-3));
+      }
+    }
+  }
+}
+
+TEST_CASE("Wide BVH single object and axis-parallel rays", "[bvh][wide]") {
+  const auto s1 = Sphere(Vec3(0, 0, 0), 1.0f);
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  for (const auto format :
+       {ronald::NodeFormat::Full, ronald::NodeFormat::Compressed}) {
+    std::vector<Object> objs = {{.primitive = &s1, .material = mat.get()}};
+    const auto bvh = WideBVH(objs, BVHOptions{.node_format = format});
+
+    // rays parallel to the axes have infinite inverse direction components
+    auto ray = Ray(Vec3(0, 0, -10), Vec3(0, 0, 1));
+    auto hit = bvh.intersect(ray, T_MIN, T_MAX);
+    REQUIRE(hit.has_value());
+    REQUIRE(hit->hit.point == Vec3(0, 0, -1));
+
+    ray = Ray(Vec3(0, 5, 0), Vec3(0, -1, 0));
+    hit = bvh.intersect(ray, T_MIN, T_MAX);
+    REQUIRE(hit.has_value());
+    REQUIRE(hit->hit.point == Vec3(0, 1, 0));
+
+    ray = Ray(Vec3(2, 5, 0), Vec3(0, -1, 0));
+    REQUIRE(!bvh.intersect(ray, T_MIN, T_MAX).has_value());
+
+    // the sphere is behind the ray
+    ray = Ray(Vec3(0, 0, 10), Vec3(0, 0, 1));
+    REQUIRE(!bvh.intersect(ray, T_MIN, T_MAX).has_value());
+  }
+}
+
+/**
+ * A primitive type the BVH leaves don't know about, which has to go through
+ * the virtual interface
+ */
+class OffsetSphere : public ronald::Primitive {
+  Sphere sphere;
+
+public:
+  explicit OffsetSphere(const Vec3 &center) : sphere(center, 0.5f) {}
+
+  [[nodiscard]] std::optional<ronald::PrimitiveHit>
+  intersect(const Ray &r, float t_min, float t_max) const override {
+    return sphere.intersect(r, t_min, t_max);
+  }
+  [[nodiscard]] ronald::Intersection
+  surface(const Ray &r, const ronald::PrimitiveHit &h) const override {
+    return sphere.surface(r, h);
+  }
+  [[nodiscard]] AABB aabb() const override { return sphere.aabb(); }
+};
+
+TEST_CASE("BVH leaves group primitives by type", "[bvh]") {
+  const auto mat1 =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto mat2 =
+      std::make_shared<Dielectric>(Dielectric(1.33f, Vec3::ones()));
+
+  const auto sphere = Sphere(Vec3(0, 0, 0), 1.0f);
+  const auto triangle = ronald::Triangle(Vec3(-2, -2, 1), Vec3(2, -2, 1),
+                                         Vec3(0, 2, 1), 1.0f);
+  const auto watertight = ronald::WatertightTriangle(
+      Vec3(-2, -2, -1), Vec3(2, -2, -1), Vec3(0, 2, -1), 1.0f);
+  const auto mesh = ronald::TriangleMesh(
+      {Vec3(-2, -2, 2), Vec3(2, -2, 2), Vec3(0, 2, 2)}, {0, 1, 2}, 1.0f);
+  const auto other = OffsetSphere(Vec3(0, 0, -2));
+
+  const std::vector<Object> objs = {
+      {.primitive = &sphere, .material = mat1.get()},
+      {.primitive = &triangle, .material = mat2.get()},
+      {.primitive = &watertight, .material = mat1.get()},
+      {.primitive = &mesh.triangle(0), .material = mat2.get()},
+      {.primitive = &other, .material = mat1.get()},
+  };
+
+  auto leaves = BVHLeaves();
+  const auto leaf = leaves.add(objs);
+  REQUIRE(leaf.kind == BVHLeaves::LeafKind::Entries);
+  REQUIRE(leaves.count(BVHLeaves::PrimitiveType::Sphere) == 1);
+  REQUIRE(leaves.count(BVHLeaves::PrimitiveType::Triangle) == 1);
+  REQUIRE(leaves.count(BVHLeaves::PrimitiveType::WatertightTriangle) == 1);
+  REQUIRE(leaves.count(BVHLeaves::PrimitiveType::MeshTriangle) == 1);
+  REQUIRE(leaves.count(BVHLeaves::PrimitiveType::Other) == 1);
+
+  for (int i = 0; i < 1000; i++) {
+    const auto origin = Vec3::rand() * 10 - Vec3(5, 5, 5);
+    const auto r = Ray(origin, Vec3::rand() - Vec3(0.5, 0.5, 0.5) - origin);
+
+    auto expected_t = 1000.0f;
+    auto expected = ronald::Hit{.hit = {}, .material = nullptr};
+    ronald::intersect_leaf(objs.data(), objs.size(), r, 0, &expected_t,
+                           &expected);
+
+    auto actual_t = 1000.0f;
+    auto closest = BVHLeaves::LeafHit{};
+    const auto found = leaves.intersect(leaf.offset, objs.size(), leaf.kind,
+                                        r, 0, &actual_t, &closest);
+
+    REQUIRE(actual_t == expected_t);
+    REQUIRE(found == (expected.material != nullptr));
+    if (found) {
+      const auto actual = leaves.surface(r, closest);
+      REQUIRE(actual.material == expected.material);
+      REQUIRE(actual.hit.t == expected.hit.t);
+      REQUIRE(actual.hit.normal == expected.hit.normal);
+    }
+  }
+}
+
+TEST_CASE("BVH leaves pack spheres into blocks", "[bvh][sphere]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  // more spheres than fit in one block
+  std::vector<Sphere> spheres;
+  for (size_t i = 0; i < 11; ++i) {
+    spheres.emplace_back(Vec3::rand() * 4 - Vec3(2, 2, 2), 0.5f);
+  }
+  std::vector<Object> objs;
+  for (const auto &s : spheres) {
+    objs.push_back({.primitive = &s, .material = mat.get()});
+  }
+
+  auto leaves = BVHLeaves();
+  const auto leaf = leaves.add(objs);
+  REQUIRE(leaf.kind == BVHLeaves::LeafKind::Spheres);
+  REQUIRE(leaves.count(BVHLeaves::PrimitiveType::Sphere) == 0);
+
+  for (int i = 0; i < 200; i++) {
+    const auto r = Ray(Vec3::rand() * 10 - Vec3(5, 5, 5),
+                       Vec3::rand() - Vec3(0.5f, 0.5f, 0.5f));
+
+    auto expected_t = 1000.0f;
+    auto expected = ronald::Hit{.hit = {}, .material = nullptr};
+    ronald::intersect_leaf(objs.data(), objs.size(), r, 0, &expected_t,
+                           &expected);
+
+    auto actual_t = 1000.0f;
+    auto closest = BVHLeaves::LeafHit{};
+    const auto found = leaves.intersect(leaf.offset, objs.size(), leaf.kind,
+                                        r, 0, &actual_t, &closest);
+
+    REQUIRE(actual_t == Approx(expected_t).epsilon(1e-4));
+    REQUIRE(found == (expected.material != nullptr));
+    if (found) {
+      const auto actual = leaves.surface(r, closest);
+      REQUIRE(actual.material == expected.material);
+      REQUIRE(actual.hit.normal == expected.hit.normal);
+    }
+  }
+}
+
+TEST_CASE("BVH leaves pack quads with triangles", "[bvh][quad][box]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  // the walls of an open box, and a solid box inside of it
+  std::vector<Quad> quads;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    auto u = Vec3::zeros();
+    auto v = Vec3::zeros();
+    u[(axis + 1) % 3] = 4.0f;
+    v[(axis + 2) % 3] = 4.0f;
+    quads.emplace_back(Vec3(-2, -2, -2), u, v, 1);
+  }
+  const auto box = Box(Vec3(-1, -1, -1), Vec3(1, 0.5f, 1));
+
+  std::vector<Object> objs;
+  for (const auto &q : quads) {
+    objs.push_back({.primitive = &q, .material = mat.get()});
+  }
+
+  auto leaves = BVHLeaves();
+  const auto quad_leaf = leaves.add(objs);
+  REQUIRE(quad_leaf.kind == BVHLeaves::LeafKind::Triangles);
+  REQUIRE(leaves.count(BVHLeaves::PrimitiveType::Quad) == 0);
+
+  // the box can't go in a block, so the quads in its leaf are entries
+  objs.push_back({.primitive = &box, .material = mat.get()});
+  const auto mixed_leaf = leaves.add(objs);
+  REQUIRE(mixed_leaf.kind == BVHLeaves::LeafKind::Entries);
+  REQUIRE(leaves.count(BVHLeaves::PrimitiveType::Quad) == quads.size());
+  REQUIRE(leaves.count(BVHLeaves::PrimitiveType::Box) == 1);
+  REQUIRE(leaves.count(BVHLeaves::PrimitiveType::Other) == 0);
+
+  for (int i = 0; i < 200; i++) {
+    const auto r = Ray(Vec3::rand() * 10 - Vec3(5, 5, 5),
+                       Vec3::rand() - Vec3(0.5f, 0.5f, 0.5f));
+
+    for (const auto leaf : {quad_leaf, mixed_leaf}) {
+      const auto count =
+          leaf.kind == BVHLeaves::LeafKind::Triangles ? quads.size()
+                                                      : objs.size();
+      auto expected_t = 1000.0f;
+      auto expected = ronald::Hit{.hit = {}, .material = nullptr};
+      ronald::intersect_leaf(objs.data(), count, r, 0, &expected_t, &expected);
+
+      auto actual_t = 1000.0f;
+      auto closest = BVHLeaves::LeafHit{};
+      const auto found = leaves.intersect(leaf.offset, count, leaf.kind, r, 0,
+                                          &actual_t, &closest);
+
+      REQUIRE(actual_t == Approx(expected_t).epsilon(1e-3));
+      REQUIRE(found == (expected.material != nullptr));
+      if (found) {
+        REQUIRE(leaves.surface(r, closest).hit.normal == expected.hit.normal);
+      }
+    }
+  }
+}
+
+/**
+ * A mix of spheres, triangles and boxes, so that the occlusion tests cover
+ * both kinds of blocks as well as the leaves of entries
+ */
+struct OcclusionScene {
+  std::vector<Sphere> spheres;
+  std::vector<Triangle> triangles;
+  std::vector<Box> boxes;
+  std::vector<Object> objs;
+
+  OcclusionScene(const size_t n, const ronald::Material *mat) {
+    for (size_t i = 0; i < n; ++i) {
+      const auto p = Vec3::rand() * 100;
+      spheres.emplace_back(p, ronald::random_float() * 2.0f + 0.1f);
+      triangles.emplace_back(p, p + Vec3::rand() * 4, p + Vec3::rand() * 4, 1);
+      boxes.emplace_back(p + Vec3(2, 2, 2), p + Vec3(2, 2, 2) + Vec3::rand());
+    }
+    for (size_t i = 0; i < n; ++i) {
+      objs.push_back({.primitive = &spheres[i], .material = mat});
+      objs.push_back({.primitive = &triangles[i], .material = mat});
+      objs.push_back({.primitive = &boxes[i], .material = mat});
+    }
+  }
+};
+
+TEST_CASE("BVH occlusion matches brute force", "[bvh][occluded]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto scene = OcclusionScene(300, mat.get());
+
+  for (const auto method :
+       {ronald::SplitMethod::SAH, ronald::SplitMethod::Middle}) {
+    const auto opts = BVHOptions{.split_method = method};
+    auto flat_objs = scene.objs;
+    const auto flat_bvh = FlatBVH(flat_objs, opts);
+    auto wide_objs = scene.objs;
+    const auto wide_bvh = WideBVH(wide_objs, opts);
+    auto compressed_opts = opts;
+    compressed_opts.node_format = ronald::NodeFormat::Compressed;
+    auto compressed_objs = scene.objs;
+    const auto compressed_bvh = WideBVH(compressed_objs, compressed_opts);
+
+    size_t n_occluded = 0;
+    for (int i = 0; i < 1000; i++) {
+      // shadow rays between two points, so t_max is 1 like it would be for a
+      // ray towards a light
+      const auto from = Vec3::rand() * 100;
+      const auto to = Vec3::rand() * 100;
+      const auto ray = Ray(from, to - from);
+      const auto t_max = ronald::random_float() < 0.5f ? 1.0f : T_MAX;
+
+      const auto expected =
+          ronald::occluded_objects(scene.objs, ray, T_MIN, t_max);
+      n_occluded += expected ? 1 : 0;
+
+      REQUIRE(flat_bvh.occluded(ray, T_MIN, t_max) == expected);
+      REQUIRE(wide_bvh.occluded(ray, T_MIN, t_max) == expected);
+      REQUIRE(compressed_bvh.occluded(ray, T_MIN, t_max) == expected);
+      REQUIRE(flat_bvh.intersect(ray, T_MIN, t_max).has_value() == expected);
+    }
+
+    // make sure both outcomes are actually being tested
+    REQUIRE(n_occluded > 100);
+    REQUIRE(n_occluded < 900);
+  }
+}
+
+TEST_CASE("Occlusion benchmark", "[.][benchmark][bvh][occluded]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto scene = OcclusionScene(20000, mat.get());
+
+  std::vector<Ray> rays;
+  for (int i = 0; i < 10000; i++) {
+    const auto from = Vec3::rand() * 100;
+    const auto to = Vec3::rand() * 100;
+    rays.emplace_back(from, to - from);
+  }
+
+  using Config = std::pair<BVHOptions, std::string>;
+  for (const auto &[opts, name] :
+       {Config{BVHOptions{.width = 2}, "2-wide"},
+        Config{BVHOptions{.width = 8}, "8-wide"},
+        Config{BVHOptions{.accelerator = ronald::AcceleratorType::Grid},
+               "grid"}}) {
+    auto objs = scene.objs;
+    const auto bvh = ronald::Accelerator::build(objs, opts);
+    const auto suffix = " (" + name + ")";
+
+    BENCHMARK("Closest hit" + suffix) {
+      size_t n = 0;
+      for (const auto &r : rays) {
+        n += bvh->intersect(r, T_MIN, 1.0f).has_value() ? 1 : 0;
+      }
+      return n;
+    };
+
+    BENCHMARK("Any hit" + suffix) {
+      size_t n = 0;
+      for (const auto &r : rays) {
+        n += bvh->occluded(r, T_MIN, 1.0f) ? 1 : 0;
+      }
+      return n;
+    };
+  }
+}
+
+TEST_CASE("Compressed wide BVH nodes", "[bvh][wide][compressed]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto scene = OcclusionScene(2000, mat.get());
+
+  auto full_objs = scene.objs;
+  const auto full = WideBVH(full_objs);
+  auto compressed_objs = scene.objs;
+  const auto compressed = WideBVH(
+      compressed_objs, BVHOptions{.node_format = ronald::NodeFormat::Compressed});
+
+  // the leaves are the same, only the nodes shrink
+  const auto full_mem = full.memory();
+  const auto compressed_mem = compressed.memory();
+  REQUIRE(compressed_mem.leaves == full_mem.leaves);
+  REQUIRE(compressed_mem.nodes * 2 < full_mem.nodes);
+
+  size_t n_hits = 0;
+  for (int i = 0; i < 2000; i++) {
+    const auto from = Vec3::rand() * 100;
+    const auto to = Vec3::rand() * 100;
+    const auto ray = Ray(from, to - from);
+
+    const auto expected = full.intersect(ray, T_MIN, T_MAX);
+    const auto hit = compressed.intersect(ray, T_MIN, T_MAX);
+    REQUIRE(hit.has_value() == expected.has_value());
+    if (expected.has_value()) {
+      n_hits += 1;
+      REQUIRE(hit->hit.t == Approx(expected->hit.t));
+      REQUIRE(hit->hit.point == expected->hit.point);
+    }
+  }
+  REQUIRE(n_hits > 1000);
+
+  SECTION("Flat nodes") {
+    // every node of a grid of triangles in the z = 1 plane is flat along z,
+    // which must still leave the unused slots of the nodes inverted
+    std::vector<Triangle> tris;
+    for (int x = 0; x < 40; x++) {
+      for (int y = 0; y < 40; y++) {
+        const auto p = Vec3(static_cast<float>(x), static_cast<float>(y), 1);
+        tris.emplace_back(p, p + Vec3(1, 0, 0), p + Vec3(0, 1, 0), 1);
+        tris.emplace_back(p + Vec3(1, 0, 0), p + Vec3(1, 1, 0),
+                          p + Vec3(0, 1, 0), 1);
+      }
+    }
+    std::vector<Object> objs;
+    for (const auto &t : tris) {
+      objs.push_back({.primitive = &t, .material = mat.get()});
+    }
+    const auto bvh = WideBVH(
+        objs, BVHOptions{.node_format = ronald::NodeFormat::Compressed});
+
+    for (int i = 0; i < 500; i++) {
+      const auto x = ronald::random_float() * 40;
+      const auto y = ronald::random_float() * 40;
+
+      const auto down = Ray(Vec3(x, y, 5), Vec3(0, 0, -1));
+      const auto hit = bvh.intersect(down, T_MIN, T_MAX);
+      REQUIRE(hit.has_value());
+      REQUIRE(hit->hit.t == Approx(4.0f));
+      REQUIRE(bvh.occluded(down, T_MIN, T_MAX));
+
+      const auto above = Ray(Vec3(-1, y, 2), Vec3(1, 0, 0));
+      REQUIRE(!bvh.intersect(above, T_MIN, T_MAX).has_value());
+      REQUIRE(!bvh.occluded(above, T_MIN, T_MAX));
+    }
+  }
+
+  SECTION("Unsupported options") {
+    auto objs = scene.objs;
+    REQUIRE_THROWS(
+        WideBVH(objs, BVHOptions{.max_leaf_size = 64,
+                                 .node_format = ronald::NodeFormat::Compressed}));
+    REQUIRE_THROWS(ronald::Accelerator::build(
+        objs, BVHOptions{.width = 2,
+                         .node_format = ronald::NodeFormat::Compressed}));
+  }
+}
+
+TEST_CASE("Compressed node benchmark", "[.][benchmark][bvh][compressed]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto scene = OcclusionScene(20000, mat.get());
+
+  std::vector<Ray> rays;
+  for (int i = 0; i < 10000; i++) {
+    const auto from = Vec3::rand() * 100;
+    const auto to = Vec3::rand() * 100;
+    rays.emplace_back(from, to - from);
+  }
+
+  for (const auto format :
+       {ronald::NodeFormat::Full, ronald::NodeFormat::Compressed}) {
+    auto objs = scene.objs;
+    const auto bvh =
+        ronald::Accelerator::build(objs, BVHOptions{.node_format = format});
+    const auto suffix = std::string(
+        format == ronald::NodeFormat::Full ? " (full)" : " (compressed)");
+
+    BENCHMARK("Closest hit" + suffix) {
+      size_t n = 0;
+      for (const auto &r : rays) {
+        n += bvh->intersect(r, T_MIN, 1.0f).has_value() ? 1 : 0;
+      }
+      return n;
+    };
+
+    BENCHMARK("Any hit" + suffix) {
+      size_t n = 0;
+      for (const auto &r : rays) {
+        n += bvh->occluded(r, T_MIN, 1.0f) ? 1 : 0;
+      }
+      return n;
+    };
+  }
+}
+
+/**
+ * A fully associative cache with least recently used eviction. The BVH
+ * layout tests feed it the cache lines or pages of the nodes visited by the
+ * traversal to count how many of the visits would miss
+ */
+class LRUCache {
+  size_t capacity;
+  std::list<uint64_t> order;
+  std::unordered_map<uint64_t, std::list<uint64_t>::iterator> entries;
+
+public:
+  explicit LRUCache(const size_t _capacity) : capacity(_capacity) {}
+
+  /**
+   * Access the given key, returning whether it missed
+   */
+  bool access(const uint64_t key) {
+    const auto it = entries.find(key);
+    if (it != entries.end()) {
+      order.splice(order.begin(), order, it->second);
+      return false;
+    }
+
+    if (entries.size() == capacity) {
+      entries.erase(order.back());
+      order.pop_back();
+    }
+    order.push_front(key);
+    entries[key] = order.begin();
+    return true;
+  }
+};
+
+/**
+ * The average number of cache line and page misses per ray of the node
+ * visits of a FlatBVH, for a 32 KiB cache of 64 byte lines and a TLB with 64
+ * entries of 4 KiB pages
+ */
+struct LayoutMisses {
+  double lines = 0.0;
+  double pages = 0.0;
+};
+
+LayoutMisses layout_misses(const FlatBVH &bvh, const std::vector<Ray> &rays) {
+  // the nodes are 32 bytes and start on a cache line. the node storage isn't
+  // page aligned, so the pages are approximated by runs of 128 nodes. the
+  // real pages are offset from these by the same amount for both layouts
+  constexpr uint64_t NODES_PER_LINE = 2;
+  constexpr uint64_t NODES_PER_PAGE = 128;
+
+  auto lines = LRUCache(512);
+  auto pages = LRUCache(64);
+  size_t line_misses = 0;
+  size_t page_misses = 0;
+  std::vector<uint32_t> visited;
+  for (const auto &r : rays) {
+    visited.clear();
+    (void)bvh.trace(r, T_MIN, T_MAX, &visited);
+    for (const auto index : visited) {
+      line_misses += lines.access(index / NODES_PER_LINE) ? 1 : 0;
+      page_misses += pages.access(index / NODES_PER_PAGE) ? 1 : 0;
+    }
+  }
+
+  const auto n = static_cast<double>(rays.size());
+  return {.lines = static_cast<double>(line_misses) / n,
+          .pages = static_cast<double>(page_misses) / n};
+}
+
+/**
+ * Primary rays of a pinhole camera looking at the middle of a scene spanning
+ * [0, 100] on each axis, in scanline order
+ */
+std::vector<Ray> camera_rays(const size_t width, const size_t height) {
+  const auto eye = Vec3(50, 50, -60);
+  std::vector<Ray> rays;
+  for (size_t y = 0; y < height; ++y) {
+    for (size_t x = 0; x < width; ++x) {
+      const auto target =
+          Vec3(100.0f * static_cast<float>(x) / static_cast<float>(width),
+               100.0f * static_cast<float>(y) / static_cast<float>(height),
+               50.0f);
+      rays.emplace_back(eye, target - eye);
+    }
+  }
+  return rays;
+}
+
+TEST_CASE("FlatBVH node layouts", "[bvh][layout]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  // enough objects that the nodes don't all fit in the simulated TLB
+  const auto scene = OcclusionScene(10000, mat.get());
+
+  auto df_objs = scene.objs;
+  const auto depth_first = FlatBVH(
+      df_objs, BVHOptions{.node_layout = ronald::NodeLayout::DepthFirst});
+  auto treelet_objs = scene.objs;
+  const auto treelet = FlatBVH(
+      treelet_objs, BVHOptions{.node_layout = ronald::NodeLayout::Treelet});
+
+  std::vector<Ray> rays;
+  for (int i = 0; i < 2000; i++) {
+    const auto from = Vec3::rand() * 100;
+    const auto to = Vec3::rand() * 100;
+    rays.emplace_back(from, to - from);
+  }
+
+  // the layout only moves the nodes around, the same nodes are visited
+  std::vector<uint32_t> df_visited;
+  std::vector<uint32_t> treelet_visited;
+  for (const auto &r : rays) {
+    df_visited.clear();
+    treelet_visited.clear();
+    const auto expected = depth_first.trace(r, T_MIN, T_MAX, &df_visited);
+    const auto hit = treelet.trace(r, T_MIN, T_MAX, &treelet_visited);
+    REQUIRE(hit.has_value() == expected.has_value());
+    if (expected.has_value()) {
+      REQUIRE(hit->hit.t == expected->hit.t);
+    }
+    REQUIRE(treelet_visited.size() == df_visited.size());
+    REQUIRE(treelet.intersect(r, T_MIN, T_MAX).has_value() == hit.has_value());
+  }
+
+  const auto df_misses = layout_misses(depth_first, rays);
+  const auto treelet_misses = layout_misses(treelet, rays);
+  REQUIRE(treelet_misses.pages < df_misses.pages);
+}
+
+TEST_CASE("FlatBVH node layout benchmark", "[.][benchmark][bvh][layout]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto scene = OcclusionScene(100000, mat.get());
+
+  // primary rays are very coherent, while the rays between random points are
+  // closer to the bounces of a path tracer
+  const auto primary = camera_rays(256, 256);
+  std::vector<Ray> random;
+  for (int i = 0; i < 65536; i++) {
+    const auto from = Vec3::rand() * 100;
+    const auto to = Vec3::rand() * 100;
+    random.emplace_back(from, to - from);
+  }
+
+  for (const auto layout :
+       {ronald::NodeLayout::DepthFirst, ronald::NodeLayout::Treelet}) {
+    auto objs = scene.objs;
+    const auto bvh = FlatBVH(objs, BVHOptions{.node_layout = layout});
+    const auto name = std::string(
+        layout == ronald::NodeLayout::DepthFirst ? "depth first" : "treelet");
+
+    using RaySet = std::pair<const std::vector<Ray> *, std::string>;
+    for (const auto &[rays, kind] :
+         {RaySet{&primary, "primary"}, RaySet{&random, "random"}}) {
+      const auto misses = layout_misses(bvh, *rays);
+      WARN(name << ", " << kind << " rays: " << misses.lines
+                << " line misses and " << misses.pages
+                << " page misses per ray");
+
+      BENCHMARK("Closest hit (" + name + ", " + kind + ")") {
+        size_t n = 0;
+        for (const auto &r : *rays) {
+          n += bvh.intersect(r, T_MIN, T_MAX).has_value() ? 1 : 0;
+        }
+        return n;
+      };
+    }
+  }
+}
+
+/**
+ * A scene of primitives that can be moved after the BVH is built. The mesh is
+ * a flat grid that the animation turns into a bumpy one
+ */
+struct AnimatedScene {
+  OcclusionScene scene;
+  ronald::TriangleMesh mesh;
+  std::vector<Object> objs;
+
+  static std::vector<uint32_t> grid_indices(const uint32_t n) {
+    std::vector<uint32_t> indices;
+    for (uint32_t z = 0; z < n; ++z) {
+      for (uint32_t x = 0; x < n; ++x) {
+        const auto i = z * (n + 1) + x;
+        indices.insert(indices.end(), {i, i + 1, i + n + 1});
+        indices.insert(indices.end(), {i + 1, i + n + 2, i + n + 1});
+      }
+    }
+    return indices;
+  }
+
+  static std::vector<Vec3> grid_positions(const uint32_t n) {
+    std::vector<Vec3> positions;
+    for (uint32_t z = 0; z <= n; ++z) {
+      for (uint32_t x = 0; x <= n; ++x) {
+        positions.emplace_back(
+            static_cast<float>(x) * 100.0f / static_cast<float>(n), 50.0f,
+            static_cast<float>(z) * 100.0f / static_cast<float>(n));
+      }
+    }
+    return positions;
+  }
+
+  AnimatedScene(const size_t n, const ronald::Material *mat)
+      : scene(n, mat), mesh(grid_positions(16), grid_indices(16), 1),
+        objs(scene.objs) {
+    for (size_t i = 0; i < mesh.size(); ++i) {
+      objs.push_back({.primitive = &mesh.triangle(i), .material = mat});
+    }
+  }
+
+  /**
+   * Move every object by a random offset of up to `distance` on each axis
+   */
+  void animate(const float distance) {
+    const auto offset = [&]() {
+      return (Vec3::rand() - Vec3(0.5f, 0.5f, 0.5f)) * 2.0f * distance;
+    };
+    for (auto &s : scene.spheres) {
+      const auto data = *s.sphere_data();
+      s = Sphere(data.center + offset(), data.radius);
+    }
+    for (auto &t : scene.triangles) {
+      const auto data = *t.triangle_data();
+      const auto v0 = data.v0 + offset();
+      t = Triangle(v0, v0 + data.edge1, v0 + data.edge2, 1);
+    }
+    for (auto &b : scene.boxes) {
+      const auto d = offset();
+      b = Box(b.aabb().min + d, b.aabb().max + d);
+    }
+    for (size_t i = 0; i < mesh.n_vertices(); ++i) {
+      auto p = mesh.position(i);
+      p[1] += offset().y();
+      mesh.set_position(i, p);
+    }
+  }
+};
+
+TEST_CASE("FlatBVH refit matches brute force", "[bvh][refit]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  for (const auto method :
+       {ronald::SplitMethod::SAH, ronald::SplitMethod::SBVH}) {
+    for (const auto threshold : {0.0f, 1.5f}) {
+      auto scene = AnimatedScene(300, mat.get());
+      auto bvh_objs = scene.objs;
+      auto bvh = FlatBVH(bvh_objs, BVHOptions{.split_method = method});
+
+      // the second refit goes over the subtrees rebuilt by the first
+      size_t rebuilt = 0;
+      for (int frame = 0; frame < 2; ++frame) {
+        scene.animate(20.0f);
+        rebuilt += bvh.refit(threshold);
+
+        for (int i = 0; i < 500; i++) {
+          const auto from = Vec3::rand() * 100;
+          const auto to = Vec3::rand() * 100;
+          const auto ray = Ray(from, to - from);
+
+          std::optional<float> expected_t = std::nullopt;
+          for (const auto &o : scene.objs) {
+            const auto hit = o.primitive->hit(ray, T_MIN, T_MAX);
+            if (hit.has_value() && (!expected_t || hit->t < *expected_t)) {
+              expected_t = hit->t;
+            }
+          }
+
+          const auto hit = bvh.intersect(ray, T_MIN, T_MAX);
+          REQUIRE(hit.has_value() == expected_t.has_value());
+          if (expected_t.has_value()) {
+            REQUIRE(hit->hit.t == Approx(*expected_t).epsilon(1e-3));
+          }
+          REQUIRE(bvh.occluded(ray, T_MIN, 1.0f) ==
+                  ronald::occluded_objects(scene.objs, ray, T_MIN, 1.0f));
+        }
+      }
+
+      if (threshold > 0.0f) {
+        REQUIRE(rebuilt > 0);
+      } else {
+        REQUIRE(rebuilt == 0);
+      }
+    }
+  }
+}
+
+TEST_CASE("FlatBVH refit without motion", "[bvh][refit]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  // the spatial split builder clips the bounds of its leaves, which a refit
+  // can't do. that alone must not look like the tree degraded
+  for (const auto method :
+       {ronald::SplitMethod::SAH, ronald::SplitMethod::SBVH}) {
+    auto scene = AnimatedScene(300, mat.get());
+    auto objs = scene.objs;
+    auto bvh = FlatBVH(objs, BVHOptions{.split_method = method});
+    REQUIRE(bvh.refit(1.0f) == 0);
+    REQUIRE(bvh.refit(1.0f) == 0);
+  }
+}
+
+TEST_CASE("FlatBVH refit benchmark", "[.][benchmark][bvh][refit]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  auto scene = AnimatedScene(30000, mat.get());
+
+  std::vector<Ray> rays;
+  for (int i = 0; i < 20000; i++) {
+    const auto from = Vec3::rand() * 100;
+    const auto to = Vec3::rand() * 100;
+    rays.emplace_back(from, to - from);
+  }
+
+  auto objs = scene.objs;
+  const auto before = FlatBVH(objs, BVHOptions{});
+  scene.animate(2.0f);
+
+  BENCHMARK("Full rebuild") {
+    auto rebuild_objs = scene.objs;
+    return FlatBVH(rebuild_objs, BVHOptions{}).memory().nodes;
+  };
+
+  // a refit changes the tree, so every run starts from its own copy of the
+  // tree built before the objects moved
+  using Threshold = std::pair<float, std::string>;
+  const auto thresholds = {Threshold{0.0f, "no rebuilds"},
+                           Threshold{1.1f, "threshold 1.1"},
+                           Threshold{1.2f, "threshold 1.2"}};
+  for (const auto &[threshold, name] : thresholds) {
+    BENCHMARK_ADVANCED("Refit (" + name + ")")
+    (Catch::Benchmark::Chronometer meter) {
+      std::vector<FlatBVH> bvhs(static_cast<size_t>(meter.runs()), before);
+      meter.measure([&](const int i) {
+        return bvhs[static_cast<size_t>(i)].refit(threshold);
+      });
+    };
+  }
+
+  auto rebuilt_objs = scene.objs;
+  const auto rebuilt = FlatBVH(rebuilt_objs, BVHOptions{});
+  const auto trace = [&](const FlatBVH &bvh) {
+    size_t n = 0;
+    for (const auto &r : rays) {
+      n += bvh.intersect(r, T_MIN, T_MAX).has_value() ? 1 : 0;
+    }
+    return n;
+  };
+  BENCHMARK("Closest hit (rebuilt)") { return trace(rebuilt); };
+
+  for (const auto &[threshold, name] : thresholds) {
+    auto bvh = before;
+    WARN(name << ": " << bvh.refit(threshold) << " subtrees rebuilt");
+    BENCHMARK("Closest hit (" + name + ")") { return trace(bvh); };
+  }
+}
+
+TEST_CASE("FlatBVH cache files", "[bvh][cache]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto scene = OcclusionScene(300, mat.get());
+  const auto path =
+      (std::filesystem::temp_directory_path() / "ronald_test_cache.bvh")
+          .string();
+  std::filesystem::remove(path);
+
+  // the spatial splits put some objects in more than one leaf
+  const auto opts = BVHOptions{.split_method = ronald::SplitMethod::SBVH};
+  auto objs = scene.objs;
+  const auto built = FlatBVH(objs, opts);
+  built.save(path, scene.objs);
+
+  SECTION("Loaded BVH matches the built one") {
+    const auto loaded = FlatBVH::load(path, scene.objs, opts);
+    REQUIRE(loaded != nullptr);
+    REQUIRE(loaded->memory().nodes == built.memory().nodes);
+
+    for (int i = 0; i < 1000; i++) {
+      const auto from = Vec3::rand() * 100;
+      const auto to = Vec3::rand() * 100;
+      const auto ray = Ray(from, to - from);
+
+      const auto expected = built.intersect(ray, T_MIN, T_MAX);
+      const auto hit = loaded->intersect(ray, T_MIN, T_MAX);
+      REQUIRE(hit.has_value() == expected.has_value());
+      if (expected.has_value()) {
+        REQUIRE(hit->hit.t == expected->hit.t);
+        REQUIRE(hit->hit.normal == expected->hit.normal);
+      }
+      REQUIRE(loaded->occluded(ray, T_MIN, 1.0f) ==
+              built.occluded(ray, T_MIN, 1.0f));
+    }
+  }
+
+  SECTION("Invalid files are ignored") {
+    REQUIRE(FlatBVH::load(path + ".missing", scene.objs, opts) == nullptr);
+
+    auto fewer = scene.objs;
+    fewer.pop_back();
+    REQUIRE(FlatBVH::load(path, fewer, opts) == nullptr);
+
+    const auto size = std::filesystem::file_size(path);
+    std::filesystem::resize_file(path, size / 2);
+    REQUIRE(FlatBVH::load(path, scene.objs, opts) == nullptr);
+
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << "not a BVH";
+    REQUIRE(FlatBVH::load(path, scene.objs, opts) == nullptr);
+  }
+
+  SECTION("Corrupt child offsets are rejected") {
+    // the root is internal, and its child offset follows its bounds. the
+    // largest offset wraps around to zero when one is added to it in 32 bits
+    constexpr size_t HEADER_SIZE = 40;
+    const uint32_t offset = std::numeric_limits<uint32_t>::max();
+    {
+      auto file = std::fstream(path, std::ios::binary | std::ios::in |
+                                         std::ios::out);
+      file.seekp(HEADER_SIZE + sizeof(ronald::AABB));
+      file.write(reinterpret_cast<const char *>(&offset), sizeof(offset));
+    }
+    REQUIRE(FlatBVH::load(path, scene.objs, opts) == nullptr);
+  }
+
+  SECTION("Accelerator writes and then reads the cache") {
+    std::filesystem::remove(path);
+    auto first_objs = scene.objs;
+    const auto first = ronald::Accelerator::build(
+        first_objs, BVHOptions{.width = 2}, path);
+    REQUIRE(std::filesystem::exists(path));
+
+    auto second_objs = scene.objs;
+    const auto second = ronald::Accelerator::build(
+        second_objs, BVHOptions{.width = 2}, path);
+    REQUIRE(second->memory().nodes == first->memory().nodes);
+  }
+
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("BVH cache keys", "[bvh][cache]") {
+  const auto scene = [](const std::string &material,
+                        const std::string &radius) {
+    return parse(R"({"objects": [{"material": ")" + material +
+                 R"(", "primitives": [{"type": "sphere", "center": [0, 0, 0],
+                 "radius": )" +
+                 radius + "}]}]}")
+        .as_object();
+  };
+
+  const auto test = ronald::TriangleTest::MollerTrumbore;
+  const auto key = ronald::bvh_cache_path("cache", scene("red", "1"), test, {});
+  REQUIRE(std::filesystem::path(key).parent_path() == "cache");
+
+  // the materials don't affect the BVH
+  REQUIRE(ronald::bvh_cache_path("cache", scene("blue", "1"), test, {}) ==
+          key);
+
+  REQUIRE(ronald::bvh_cache_path("cache", scene("red", "2"), test, {}) != key);
+  REQUIRE(ronald::bvh_cache_path("cache", scene("red", "1"),
+                                 ronald::TriangleTest::Watertight, {}) != key);
+  REQUIRE(ronald::bvh_cache_path(
+              "cache", scene("red", "1"), test,
+              BVHOptions{.split_method = ronald::SplitMethod::SBVH}) != key);
+}
+
+TEST_CASE("BVH cache benchmark", "[.][benchmark][bvh][cache]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto scene = OcclusionScene(100000, mat.get());
+  const auto path =
+      (std::filesystem::temp_directory_path() / "ronald_bench_cache.bvh")
+          .string();
+
+  for (const auto method :
+       {ronald::SplitMethod::SAH, ronald::SplitMethod::SBVH}) {
+    const auto opts = BVHOptions{.split_method = method};
+    const auto name = std::string(
+        method == ronald::SplitMethod::SAH ? "SAH" : "SBVH");
+
+    BENCHMARK("Build (" + name + ")") {
+      auto objs = scene.objs;
+      return FlatBVH(objs, opts).memory().nodes;
+    };
+
+    auto objs = scene.objs;
+    FlatBVH(objs, opts).save(path, scene.objs);
+    WARN(name << " cache file: " << std::filesystem::file_size(path)
+              << " bytes");
+
+    BENCHMARK("Load (" + name + ")") {
+      return FlatBVH::load(path, scene.objs, opts)->memory().nodes;
+    };
+  }
+
+  std::filesystem::remove(path);
+}
+
+/**
+ * The SAH cost of a subtree of the pointer-based BVH, before dividing by the
+ * area of the root
+ */
+double subtree_sah(const BVH &node, const BVHOptions &opts) {
+  const auto area = static_cast<double>(node.aabb().surface_area());
+  if (node.node_type() == NodeType::Leaf) {
+    const auto &objs = std::get<std::vector<Object>>(node.get_data());
+    return opts.intersection_cost * static_cast<double>(objs.size()) * area;
+  }
+  const auto &[left, right] = std::get<ronald::BVHPair>(node.get_data());
+  return opts.traversal_cost * area + subtree_sah(*left, opts) +
+         subtree_sah(*right, opts);
+}
+
+/**
+ * Count the leaves of a tree dumped to JSON by `FlatBVH::dump_json`
+ */
+size_t count_json_leaves(const boost::json::object &node) {
+  if (node.contains("objects")) {
+    return 1;
+  }
+  size_t n = 0;
+  for (const auto &child : node.at("children").as_array()) {
+    n += count_json_leaves(child.as_object());
+  }
+  return n;
+}
+
+TEST_CASE("FlatBVH statistics", "[bvh][stats]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto scene = OcclusionScene(300, mat.get());
+
+  double sah_cost = 0.0;
+  double middle_cost = 0.0;
+  for (const auto method :
+       {ronald::SplitMethod::SAH, ronald::SplitMethod::Middle}) {
+    const auto opts = BVHOptions{.split_method = method};
+    auto objs = scene.objs;
+    size_t total_nodes = 0;
+    const auto tree = BVH::build_bvh(objs, &total_nodes, opts);
+    auto flat_objs = scene.objs;
+    const auto bvh = FlatBVH(flat_objs, opts);
+    const auto stats = bvh.stats();
+
+    REQUIRE(stats.internal_nodes + stats.leaves == total_nodes);
+    REQUIRE(stats.leaves == stats.internal_nodes + 1);
+    REQUIRE((size_t{1} << stats.max_depth) >= stats.leaves);
+    REQUIRE(stats.average_depth <= static_cast<double>(stats.max_depth));
+    REQUIRE(stats.memory.nodes == bvh.memory().nodes);
+
+    size_t n_leaves = 0;
+    size_t n_objects = 0;
+    for (size_t i = 0; i < stats.leaf_sizes.size(); ++i) {
+      n_leaves += stats.leaf_sizes[i];
+      n_objects += i * stats.leaf_sizes[i];
+    }
+    REQUIRE(n_leaves == stats.leaves);
+    REQUIRE(n_objects == scene.objs.size());
+    REQUIRE(stats.leaf_sizes.size() <= opts.max_leaf_size + 1);
+
+    const auto root_area = static_cast<double>(tree.aabb().surface_area());
+    REQUIRE(stats.sah_cost ==
+            Approx(subtree_sah(tree, opts) / root_area).epsilon(1e-4));
+    REQUIRE(stats.sibling_overlap > 0.0);
+
+    std::ostringstream dump;
+    bvh.dump_json(dump);
+    const auto json = boost::json::parse(dump.str()).as_object();
+    REQUIRE(count_json_leaves(json) == stats.leaves);
+
+    (method == ronald::SplitMethod::SAH ? sah_cost : middle_cost) =
+        stats.sah_cost;
+  }
+
+  REQUIRE(sah_cost < middle_cost);
+}
+
+TEST_CASE("Stackless FlatBVH traversal", "[bvh][stackless]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  SECTION("Matches the stack traversal") {
+    const auto scene = OcclusionScene(300, mat.get());
+    for (const auto method :
+         {ronald::SplitMethod::SAH, ronald::SplitMethod::Middle,
+          ronald::SplitMethod::LBVH, ronald::SplitMethod::SBVH}) {
+      for (const auto layout :
+           {ronald::NodeLayout::DepthFirst, ronald::NodeLayout::Treelet}) {
+        auto stack_objs = scene.objs;
+        const auto stack = FlatBVH(
+            stack_objs,
+            BVHOptions{.split_method = method, .node_layout = layout});
+        auto stackless_objs = scene.objs;
+        const auto stackless =
+            FlatBVH(stackless_objs,
+                    BVHOptions{.split_method = method,
+                               .node_layout = layout,
+                               .traversal = ronald::Traversal::Stackless});
+
+        for (int i = 0; i < 500; i++) {
+          const auto from = Vec3::rand() * 100;
+          const auto to = Vec3::rand() * 100;
+          const auto ray = Ray(from, to - from);
+          const auto t_max = ronald::random_float() < 0.5f ? 1.0f : T_MAX;
+
+          const auto expected = stack.intersect(ray, T_MIN, t_max);
+          const auto hit = stackless.intersect(ray, T_MIN, t_max);
+          REQUIRE(hit.has_value() == expected.has_value());
+          if (expected.has_value()) {
+            REQUIRE(hit->hit.t == expected->hit.t);
+          }
+          REQUIRE(stackless.occluded(ray, T_MIN, t_max) ==
+                  stack.occluded(ray, T_MIN, t_max));
+        }
+      }
+    }
+  }
+
+  SECTION("Trees deeper than the stack") {
+    // with only two buckets, the SAH split peels off one sphere at a time
+    // when each sphere is more than twice as far from the origin as the last.
+    // the resulting chain is too deep for the stack, so the tree has to fall
+    // back to the stackless traversal even though it wasn't asked to
+    std::vector<Sphere> spheres;
+    for (int i = -45; i <= 24; i++) {
+      const auto x = std::pow(2.5f, static_cast<float>(i));
+      spheres.emplace_back(Vec3(x, 0, 0), 0.25f * x);
+    }
+    std::vector<Object> objs;
+    for (const auto &s : spheres) {
+      objs.push_back({.primitive = &s, .material = mat.get()});
+    }
+
+    auto bvh_objs = objs;
+    const auto bvh =
+        FlatBVH(bvh_objs, BVHOptions{.sah_buckets = 2, .max_leaf_size = 1});
+    REQUIRE(bvh.stats().max_depth > 64);
+
+    // the collapsed 8-wide trees are just as lopsided, so their traversal
+    // stacks have to be sized for the depth of the tree too
+    auto full_objs = objs;
+    const auto full = WideBVH(
+        full_objs, BVHOptions{.sah_buckets = 2, .max_leaf_size = 1});
+    auto compressed_objs = objs;
+    const auto compressed =
+        WideBVH(compressed_objs,
+                BVHOptions{.sah_buckets = 2,
+                           .max_leaf_size = 1,
+                           .node_format = ronald::NodeFormat::Compressed});
+
+    for (const auto &s : spheres) {
+      const auto sphere = *s.sphere_data();
+      const auto origin = sphere.center + Vec3(0, 2 * sphere.radius, 0);
+      const auto ray = Ray(origin, Vec3(0, -1, 0));
+
+      std::optional<float> expected_t = std::nullopt;
+      for (const auto &o : objs) {
+        const auto hit = o.primitive->hit(ray, T_MIN, T_MAX);
+        if (hit.has_value() && (!expected_t || hit->t < *expected_t)) {
+          expected_t = hit->t;
+        }
+      }
+
+      const auto hit = bvh.intersect(ray, T_MIN, T_MAX);
+      REQUIRE(expected_t.has_value());
+      REQUIRE(hit.has_value());
+      REQUIRE(hit->hit.t == Approx(*expected_t).epsilon(1e-3));
+      REQUIRE(bvh.occluded(ray, T_MIN, T_MAX));
+      REQUIRE(bvh.occluded(ray, T_MIN, *expected_t * 0.5f) ==
+              ronald::occluded_objects(objs, ray, T_MIN, *expected_t * 0.5f));
+
+      for (const auto *wide : {&full, &compressed}) {
+        const auto wide_hit = wide->intersect(ray, T_MIN, T_MAX);
+        REQUIRE(wide_hit.has_value());
+        REQUIRE(wide_hit->hit.t == Approx(*expected_t).epsilon(1e-3));
+        REQUIRE(wide->occluded(ray, T_MIN, T_MAX));
+        REQUIRE(wide->occluded(ray, T_MIN, *expected_t * 0.5f) ==
+                ronald::occluded_objects(objs, ray, T_MIN,
+                                         *expected_t * 0.5f));
+      }
+    }
+  }
+}
+
+TEST_CASE("Stackless traversal benchmark", "[.][benchmark][bvh][stackless]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto scene = OcclusionScene(100000, mat.get());
+
+  const auto primary = camera_rays(256, 256);
+  std::vector<Ray> random;
+  for (int i = 0; i < 65536; i++) {
+    const auto from = Vec3::rand() * 100;
+    const auto to = Vec3::rand() * 100;
+    random.emplace_back(from, to - from);
+  }
+
+  for (const auto traversal :
+       {ronald::Traversal::Stack, ronald::Traversal::Stackless}) {
+    auto objs = scene.objs;
+    const auto bvh = FlatBVH(objs, BVHOptions{.traversal = traversal});
+    const auto name = std::string(
+        traversal == ronald::Traversal::Stack ? "stack" : "stackless");
+
+    using RaySet = std::pair<const std::vector<Ray> *, std::string>;
+    for (const auto &[rays, kind] :
+         {RaySet{&primary, "primary"}, RaySet{&random, "random"}}) {
+      BENCHMARK("Closest hit (" + name + ", " + kind + ")") {
+        size_t n = 0;
+        for (const auto &r : *rays) {
+          n += bvh.intersect(r, T_MIN, T_MAX).has_value() ? 1 : 0;
+        }
+        return n;
+      };
+
+      BENCHMARK("Any hit (" + name + ", " + kind + ")") {
+        size_t n = 0;
+        for (const auto &r : *rays) {
+          n += bvh.occluded(r, T_MIN, 1.0f) ? 1 : 0;
+        }
+        return n;
+      };
+    }
+  }
+}
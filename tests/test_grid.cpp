@@ -0,0 +1,296 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "accelerator.hpp"
+#include "bvh.hpp"
+#include "common.hpp"
+#include "grid.hpp"
+#include "material.hpp"
+#include "primitive.hpp"
+#include "scene.hpp"
+#include "vec3_tests.hpp"
+
+#include <catch2/catch.hpp>
+
+using ronald::AcceleratorType;
+using ronald::BVHOptions;
+using ronald::Box;
+using ronald::Dielectric;
+using ronald::FlatBVH;
+using ronald::Grid;
+using ronald::Object;
+using ronald::Quad;
+using ronald::Ray;
+using ronald::Sphere;
+using ronald::Triangle;
+using ronald::Vec3;
+
+constexpr auto T_MIN = 0.0005f;
+constexpr auto T_MAX = std::numeric_limits<float>::max();
+
+/**
+ * Spheres, triangles and boxes of similar sizes scattered over [0, 100] on
+ * each axis
+ */
+struct GridScene {
+  std::vector<Sphere> spheres;
+  std::vector<Triangle> triangles;
+  std::vector<Box> boxes;
+  std::vector<Object> objs;
+
+  GridScene(const size_t n, const ronald::Material *mat) {
+    for (size_t i = 0; i < n; ++i) {
+      const auto p = Vec3::rand() * 100;
+      spheres.emplace_back(p, ronald::random_float() * 2.0f + 0.1f);
+      triangles.emplace_back(p, p + Vec3::rand() * 4, p + Vec3::rand() * 4, 1);
+      boxes.emplace_back(p + Vec3(2, 2, 2), p + Vec3(2, 2, 2) + Vec3::rand());
+    }
+    for (size_t i = 0; i < n; ++i) {
+      objs.push_back({.primitive = &spheres[i], .material = mat});
+      objs.push_back({.primitive = &triangles[i], .material = mat});
+      objs.push_back({.primitive = &boxes[i], .material = mat});
+    }
+  }
+};
+
+/**
+ * Check the closest hit and the occlusion query of the grid against brute
+ * force for the given ray
+ */
+void check_ray(const Grid &grid, const std::vector<Object> &objs,
+               const Ray &ray) {
+  const auto expected = ronald::hit_objects(objs, ray);
+  const auto actual = grid.intersect(ray, T_MIN, T_MAX);
+
+  REQUIRE(actual.has_value() == expected.has_value());
+  if (expected.has_value()) {
+    REQUIRE(actual->hit.t == Approx(expected->hit.t).epsilon(1e-3));
+
+    // cells of mixed objects and brute force may intersect a sphere with
+    // different kernels. the rays aren't normalized, so the tiny difference
+    // in `t` moves the hit point enough to visibly tilt the normal of a
+    // small sphere
+    REQUIRE(actual->hit.normal.dot(expected->hit.normal) > 0.99f);
+
+    // stopping the ray halfway to the closest hit leaves nothing to hit
+    const auto half = expected->hit.t * 0.5f;
+    REQUIRE(grid.occluded(ray, T_MIN, half) ==
+            ronald::occluded_objects(objs, ray, T_MIN, half));
+  }
+  REQUIRE(grid.occluded(ray, T_MIN, T_MAX) == expected.has_value());
+}
+
+TEST_CASE("Grid matches brute force", "[grid]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto scene = GridScene(300, mat.get());
+
+  for (const auto density : {0.5f, 4.0f, 16.0f}) {
+    const auto grid = Grid(scene.objs, BVHOptions{.grid_density = density});
+    const auto &dims = grid.dimensions();
+    REQUIRE(dims[0] * dims[1] * dims[2] > 1);
+
+    for (int i = 0; i < 500; i++) {
+      // rays starting outside of the grid, and inside of it
+      const auto outside = Vec3::rand() * 300 - Vec3(100, 100, 100);
+      const auto inside = Vec3::rand() * 100;
+      const auto target = Vec3::rand() * 100;
+      check_ray(grid, scene.objs, Ray(outside, target - outside));
+      check_ray(grid, scene.objs, Ray(inside, target - inside));
+    }
+
+    // rays along the axes, which never cross the cell boundaries of the
+    // other two axes
+    for (int i = 0; i < 100; i++) {
+      const auto p = Vec3::rand() * 100;
+      for (size_t axis = 0; axis < 3; ++axis) {
+        auto dir = Vec3::zeros();
+        dir[axis] = 1.0f;
+        auto from = p;
+        from[axis] = -10.0f;
+        check_ray(grid, scene.objs, Ray(from, dir));
+        from[axis] = 110.0f;
+        check_ray(grid, scene.objs, Ray(from, -dir));
+      }
+    }
+  }
+}
+
+TEST_CASE("Grid over a flat scene", "[grid]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  // a checkerboard of quads in the y = 0 plane, so the grid has no height
+  std::vector<Quad> quads;
+  for (int x = 0; x < 20; x++) {
+    for (int z = 0; z < 20; z++) {
+      if ((x + z) % 2 == 0) {
+        const auto origin =
+            Vec3(static_cast<float>(x), 0, static_cast<float>(z));
+        quads.emplace_back(origin, Vec3(1, 0, 0), Vec3(0, 0, 1), 1);
+      }
+    }
+  }
+  std::vector<Object> objs;
+  for (const auto &q : quads) {
+    objs.push_back({.primitive = &q, .material = mat.get()});
+  }
+
+  const auto grid = Grid(objs);
+  REQUIRE(grid.dimensions()[1] == 1);
+
+  for (int i = 0; i < 1000; i++) {
+    const auto from = Vec3::rand() * 20 + Vec3(0, 1, 0);
+    const auto to = Vec3::rand() * 20 - Vec3(0, 10, 0);
+    check_ray(grid, objs, Ray(from, to - from));
+  }
+
+  // a ray skimming along the plane of the quads
+  check_ray(grid, objs, Ray(Vec3(-1, 0, 0.5f), Vec3(1, 0, 0)));
+}
+
+TEST_CASE("Grid with one object and with none", "[grid]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto sphere = Sphere(Vec3(1, 2, 3), 1.0f);
+  const std::vector<Object> objs = {
+      {.primitive = &sphere, .material = mat.get()}};
+
+  const auto grid = Grid(objs);
+  check_ray(grid, objs, Ray(Vec3(1, 2, -5), Vec3(0, 0, 1)));
+  check_ray(grid, objs, Ray(Vec3(1, 2, 3), Vec3(0.3f, -1, 0.2f)));
+  check_ray(grid, objs, Ray(Vec3(5, 2, -5), Vec3(0, 0, 1)));
+
+  const auto empty = Grid(std::vector<Object>{});
+  const auto ray = Ray(Vec3::zeros(), Vec3(1, 0, 0));
+  REQUIRE(!empty.intersect(ray, T_MIN, T_MAX).has_value());
+  REQUIRE(!empty.occluded(ray, T_MIN, T_MAX));
+}
+
+TEST_CASE("Accelerator selection", "[grid]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+  const auto scene = GridScene(300, mat.get());
+  REQUIRE(ronald::prefer_grid(scene.objs, {}));
+
+  // too few objects for the grid to pay off
+  const auto small = std::vector<Object>(scene.objs.begin(),
+                                         scene.objs.begin() + 100);
+  REQUIRE(!ronald::prefer_grid(small, {}));
+
+  // one huge object, like the ground sphere of a sphere field
+  const auto ground = Sphere(Vec3(50, -1000, 50), 1000.0f);
+  auto with_ground = scene.objs;
+  with_ground.push_back({.primitive = &ground, .material = mat.get()});
+  REQUIRE(!ronald::prefer_grid(with_ground, {}));
+
+  // two far apart clusters of small spheres. the cells are spread evenly
+  // between them, so the spheres crowd into a few of the cells
+  std::vector<Sphere> clustered_spheres;
+  for (const auto center : {Vec3(0, 0, 0), Vec3(100, 100, 100)}) {
+    for (int i = 0; i < 500; i++) {
+      clustered_spheres.emplace_back(center + Vec3::rand() * 2, 0.1f);
+    }
+  }
+  std::vector<Object> clustered;
+  for (const auto &s : clustered_spheres) {
+    clustered.push_back({.primitive = &s, .material = mat.get()});
+  }
+  REQUIRE(Grid::mean_occupancy(clustered) >
+          Grid::mean_occupancy(scene.objs) * 4);
+  REQUIRE(!ronald::prefer_grid(clustered, {}));
+
+  REQUIRE(ronald::accelerator_type_from_string("grid") ==
+          AcceleratorType::Grid);
+  REQUIRE(ronald::accelerator_type_from_string("auto") ==
+          AcceleratorType::Auto);
+  REQUIRE_THROWS(ronald::accelerator_type_from_string("kd-tree"));
+
+  for (const auto type :
+       {AcceleratorType::BVH, AcceleratorType::Grid, AcceleratorType::Auto}) {
+    auto objs = with_ground;
+    const auto accel = ronald::Accelerator::build(
+        objs, BVHOptions{.accelerator = type, .width = 2});
+    const auto is_grid = dynamic_cast<const Grid *>(accel.get()) != nullptr;
+    REQUIRE(is_grid == (type == AcceleratorType::Grid));
+    REQUIRE(is_grid ==
+            (dynamic_cast<const FlatBVH *>(accel.get()) == nullptr));
+  }
+
+  auto objs = scene.objs;
+  const auto accel = ronald::Accelerator::build(
+      objs, BVHOptions{.accelerator = AcceleratorType::Auto});
+  REQUIRE(dynamic_cast<const Grid *>(accel.get()) != nullptr);
+}
+
+TEST_CASE("Grid benchmark", "[.][benchmark][grid]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  // a field of small spheres, the kind of scene the grid is meant for
+  std::vector<Sphere> spheres;
+  std::vector<Object> field;
+  spheres.reserve(100000);
+  for (int i = 0; i < 100000; i++) {
+    spheres.emplace_back(Vec3::rand() * 100,
+                         ronald::random_float() * 0.3f + 0.2f);
+  }
+  for (const auto &s : spheres) {
+    field.push_back({.primitive = &s, .material = mat.get()});
+  }
+
+  std::vector<Ray> rays;
+  for (int i = 0; i < 65536; i++) {
+    const auto from = Vec3::rand() * 100;
+    const auto to = Vec3::rand() * 100;
+    rays.emplace_back(from, to - from);
+  }
+
+  // the LBVH is the fastest of the BVH builders
+  BENCHMARK("Build (LBVH)") {
+    auto objs = field;
+    return FlatBVH(objs, BVHOptions{.split_method = ronald::SplitMethod::LBVH})
+        .memory()
+        .nodes;
+  };
+
+  BENCHMARK("Build (grid)") { return Grid(field).memory().nodes; };
+
+  using Config = std::pair<BVHOptions, std::string>;
+  for (const auto &[opts, name] :
+       {Config{BVHOptions{.width = 2}, "2-wide BVH"},
+        Config{BVHOptions{.width = 8}, "8-wide BVH"},
+        Config{BVHOptions{.accelerator = AcceleratorType::Grid}, "grid"}}) {
+    auto objs = field;
+    const auto accel = ronald::Accelerator::build(objs, opts);
+
+    BENCHMARK("Closest hit (" + name + ")") {
+      size_t n = 0;
+      for (const auto &r : rays) {
+        n += accel->intersect(r, T_MIN, T_MAX).has_value() ? 1 : 0;
+      }
+      return n;
+    };
+
+    BENCHMARK("Any hit (" + name + ")") {
+      size_t n = 0;
+      for (const auto &r : rays) {
+        n += accel->occluded(r, T_MIN, 1.0f) ? 1 : 0;
+      }
+      return n;
+    };
+  }
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright © 2022 Jayden Chan. All rights reserved.
+ *
+ * Ronald is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3
+ * as published by the Free Software Foundation.
+ *
+ * Ronald is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ronald. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bvh.hpp"
+#include "common.hpp"
+#include "instance.hpp"
+#include "material.hpp"
+#include "math.hpp"
+#include "primitive.hpp"
+#include "transform.hpp"
+#include "vec3_tests.hpp"
+
+#include <catch2/catch.hpp>
+
+using ronald::Dielectric;
+using ronald::FlatBVH;
+using ronald::Instance;
+using ronald::Object;
+using ronald::Primitive;
+using ronald::Prototype;
+using ronald::random_float;
+using ronald::Ray;
+using ronald::Transform;
+using ronald::Triangle;
+using ronald::Vec3;
+
+/**
+ * A rotation about the y axis followed by a non-uniform scale and a
+ * translation
+ */
+Transform test_transform(const float angle, const Vec3 &scale,
+                         const Vec3 &offset) {
+  const auto c = std::cos(angle);
+  const auto s = std::sin(angle);
+  return Transform({{{scale.x() * c, 0, scale.x() * s, offset.x()},
+                     {0, scale.y(), 0, offset.y()},
+                     {-scale.z() * s, 0, scale.z() * c, offset.z()}}});
+}
+
+TEST_CASE("Transform inverse", "[instance][transform]") {
+  const auto t = test_transform(0.7f, Vec3(2, 0.5f, 3), Vec3(1, -2, 5));
+  const auto inv = t.inverse();
+
+  for (int i = 0; i < 100; i++) {
+    const auto p = Vec3::rand() * 10 - Vec3(5, 5, 5);
+    REQUIRE(inv.point(t.point(p)) == p);
+    REQUIRE(t.point(inv.point(p)) == p);
+    REQUIRE(inv.vector(t.vector(p)) == p);
+  }
+
+  const auto id = Transform::identity();
+  REQUIRE(id.point(Vec3(1, 2, 3)) == Vec3(1, 2, 3));
+  REQUIRE(id.inverse().point(Vec3(1, 2, 3)) == Vec3(1, 2, 3));
+
+  // scaling an axis to zero can't be undone
+  REQUIRE_THROWS(test_transform(0, Vec3(1, 0, 1), Vec3::zeros()).inverse());
+
+  // the corners of a box stay inside of its transformed bounds
+  const auto box = ronald::AABB(Vec3(-1, 0, 2), Vec3(1, 3, 4));
+  const auto bounds = t.aabb(box);
+  for (int i = 0; i < 100; i++) {
+    const auto p = t.point(box.min + Vec3::rand() * (box.max - box.min));
+    for (size_t axis = 0; axis < 3; ++axis) {
+      REQUIRE(p[axis] >= bounds.min[axis] - 1e-4f);
+      REQUIRE(p[axis] <= bounds.max[axis] + 1e-4f);
+    }
+  }
+}
+
+TEST_CASE("Octahedral normal encoding", "[instance]") {
+  const std::vector<Vec3> axes = {Vec3(1, 0, 0),  Vec3(-1, 0, 0),
+                                  Vec3(0, 1, 0),  Vec3(0, -1, 0),
+                                  Vec3(0, 0, 1),  Vec3(0, 0, -1)};
+  for (const auto &n : axes) {
+    const auto [u, v] = ronald::octahedral_encode(n);
+    REQUIRE(ronald::octahedral_decode(u, v) == n);
+  }
+
+  for (int i = 0; i < 1000; i++) {
+    const auto n = ronald::random_on_unit_sphere();
+    const auto [u, v] = ronald::octahedral_encode(n);
+    REQUIRE(std::abs(u) <= 1.0f);
+    REQUIRE(std::abs(v) <= 1.0f);
+
+    const auto decoded = ronald::octahedral_decode(u, v);
+    REQUIRE(decoded.dot(n) / decoded.length() == Approx(n.length()));
+  }
+}
+
+TEST_CASE("Instances match transformed geometry", "[instance][bvh]") {
+  const auto mat =
+      std::make_shared<Dielectric>(Dielectric(1.52f, Vec3::ones()));
+
+  // a few random triangles shared by every instance
+  std::vector<std::array<Vec3, 3>> vertices;
+  std::vector<std::shared_ptr<Primitive>> prims;
+  std::vector<Object> proto_objs;
+  for (size_t i = 0; i < 20; ++i) {
+    const auto v0 = Vec3::rand() * 2 - Vec3::ones();
+    vertices.push_back({v0, v0 + Vec3::rand() * 0.5f, v0 + Vec3::rand() * 0.5f});
+    prims.push_back(std::make_shared<Triangle>(vertices.back()[0],
+                                               vertices.back()[1],
+                                               vertices.back()[2], 1));
+    proto_objs.push_back({.primitive = prims.back().get(), .material = nullptr});
+  }
+  const auto proto = Prototype(prims, {}, proto_objs, {});
+  REQUIRE(proto.size() == 20);
+
+  // a grid of instances, and the same triangles expanded in world space
+  std::vector<Instance> instances;
+  std::vector<Triangle> expanded;
+  for (int x = 0; x < 4; ++x) {
+    for (int z = 0; z < 4; ++z) {
+      const auto t = test_transform(
+          static_cast<float>(x * 4 + z), Vec3(1, 0.5f + random_float(), 1.5f),
+          Vec3(static_cast<float>(x) * 3, 0, static_cast<float>(z) * 3));
+      instances.emplace_back(&proto, t);
+      for (const auto &v : vertices) {
+        expanded.emplace_back(t.point(v[0]), t.point(v[1]), t.point(v[2]), 1);
+      }
+    }
+  }
+
+  std::vector<Object> instance_objs;
+  for (const auto &inst : instances) {
+    instance_objs.push_back({.primitive = &inst, .material = mat.get()});
+  }
+  std::vector<Object> expanded_objs;
+  for (const auto &tri : expanded) {
+    expanded_objs.push_back({.primitive = &tri, .material = mat.get()});
+  }
+
+  const auto two_level = FlatBVH(instance_objs);
+  const auto flat = FlatBVH(expanded_objs);
+
+  size_t n_hits = 0;
+  for (int i = 0; i < 2000; i++) {
+    // aim at a point near one of the triangles so most rays hit something
+    const auto &target = expanded[static_cast<size_t>(i) % expanded.size()];
+    const auto origin = Vec3(4.5f, 5, 4.5f) + Vec3::rand() * 4 - Vec3(2, 2, 2);
+    const auto aabb = target.aabb();
+    const auto r =
+        Ray(origin, aabb.min + Vec3::rand() * (aabb.max - aabb.min) - origin);
+
+    const auto expected = flat.intersect(r, 0.0005f, 1000);
+    const auto actual = two_level.intersect(r, 0.0005f, 1000);
+    REQUIRE(actual.has_value() == expected.has_value());
+    if (expected.has_value()) {
+      n_hits++;
+      REQUIRE(actual->hit.t == Approx(expected->hit.t).epsilon(1e-3));
+      REQUIRE(actual->hit.point == expected->hit.point);
+      REQUIRE(actual->hit.normal.dot(expected->hit.normal) > 0.995f);
+      REQUIRE(actual->material == mat.get());
+    }
+  }
+  REQUIRE(n_hits > 500);
+}
@@ -18,13 +18,25 @@
 
 #include "primitive.hpp"
 #include "ray.hpp"
+#include "sphere_block.hpp"
+#include "triangle_block.hpp"
 #include "vec3.hpp"
 #include "vec3_tests.hpp"
 
+using ronald::Box;
+using ronald::Quad;
+using ronald::random_float;
 using ronald::Ray;
 using ronald::Sphere;
+using ronald::SphereBlock;
+using ronald::SphereBlocks;
+using ronald::SphereData;
 using ronald::Triangle;
+using ronald::TriangleBlock;
+using ronald::TriangleMesh;
+using ronald::TriangleTest;
 using ronald::Vec3;
+using ronald::WatertightTriangle;
 
 TEST_CASE("Ray/Sphere intersection", "[primitive][ray][sphere]") {
   // Sphere at the origin on the XY plane
@@ -181,3 +193,592 @@ TEST_CASE("Ray/Triangle intersection", "[primitive][ray][triangle]") {
     REQUIRE(!hit);
   }
 }
+
+TEST_CASE("Triangle barycentrics locate the hit",
+          "[primitive][ray][triangle]") {
+  const auto v0 = Vec3(-1, -1, 0);
+  const auto v1 = Vec3(2, -1, 0.5f);
+  const auto v2 = Vec3(0, 2, -0.5f);
+  const auto triangle = Triangle(v0, v1, v2, 1);
+  const auto watertight = WatertightTriangle(v0, v1, v2, 1);
+
+  for (int i = 0; i < 500; i++) {
+    const auto origin = Vec3::rand() * 10 - Vec3(5, 5, 5);
+    const auto r = Ray(origin, Vec3::rand() - Vec3(0.5f, 0.5f, 0.5f) - origin);
+
+    const auto mt = triangle.intersect(r, 0, 1000);
+    const auto wt = watertight.intersect(r, 0, 1000);
+    for (const auto &h : {mt, wt}) {
+      if (!h.has_value()) {
+        continue;
+      }
+      REQUIRE(h->u >= 0);
+      REQUIRE(h->v >= 0);
+      REQUIRE(h->u + h->v <= 1.0001f);
+      const auto p = v0 * (1 - h->u - h->v) + v1 * h->u + v2 * h->v;
+      REQUIRE(p == r.point_at_parameter(h->t));
+    }
+  }
+}
+
+TEST_CASE("Triangle clipped AABB", "[primitive][triangle][aabb]") {
+  const auto triangle =
+      Triangle(Vec3(0, 0, 0), Vec3(10, 0, 0), Vec3(0, 10, 0), 1);
+  const auto full = triangle.aabb();
+
+  // only the corner of the triangle past x = 5 is left, which is at most 5
+  // units tall
+  auto box = full;
+  box.min = Vec3(5, full.min.y(), full.min.z());
+  auto clipped = triangle.clipped_aabb(box);
+  REQUIRE(!clipped.is_empty());
+  REQUIRE(clipped.min.x() == Approx(5).margin(0.001));
+  REQUIRE(clipped.max.x() == Approx(10).margin(0.001));
+  REQUIRE(clipped.max.y() == Approx(5).margin(0.001));
+
+  // the triangle doesn't pass through the corner of its bbox opposite the
+  // right angle
+  box.min = Vec3(8, 8, full.min.z());
+  clipped = triangle.clipped_aabb(box);
+  REQUIRE(clipped.is_empty());
+
+  // clipping to the triangle's own bbox changes nothing
+  clipped = triangle.clipped_aabb(full);
+  REQUIRE(clipped.min == full.min);
+  REQUIRE(clipped.max == full.max);
+}
+
+TEST_CASE("Triangle mesh matches standalone triangles",
+          "[primitive][ray][triangle][mesh]") {
+  // a unit cube, with the vertices shared between its twelve triangles
+  const std::vector<Vec3> positions = {
+      Vec3(0, 0, 0), Vec3(1, 0, 0), Vec3(1, 1, 0), Vec3(0, 1, 0),
+      Vec3(0, 0, 1), Vec3(1, 0, 1), Vec3(1, 1, 1), Vec3(0, 1, 1)};
+  const std::vector<uint32_t> indices = {
+      0, 1, 2, 0, 2, 3, 4, 6, 5, 4, 7, 6, 0, 4, 5, 0, 5, 1,
+      3, 2, 6, 3, 6, 7, 0, 3, 7, 0, 7, 4, 1, 5, 6, 1, 6, 2};
+  const auto mesh = TriangleMesh(positions, indices, -1);
+  REQUIRE(mesh.size() == 12);
+
+  for (size_t i = 0; i < mesh.size(); ++i) {
+    const auto triangle =
+        Triangle(positions[indices[3 * i]], positions[indices[3 * i + 1]],
+                 positions[indices[3 * i + 2]], -1);
+    const auto &mesh_triangle = mesh.triangle(i);
+
+    REQUIRE(mesh_triangle.aabb().min == triangle.aabb().min);
+    REQUIRE(mesh_triangle.aabb().max == triangle.aabb().max);
+
+    for (int j = 0; j < 50; j++) {
+      const auto origin = Vec3::rand() * 4 - Vec3(1.5, 1.5, 1.5);
+      const auto r = Ray(origin, Vec3(0.5, 0.5, 0.5) - origin);
+      const auto expected = triangle.hit(r, 0, 1000);
+      const auto actual = mesh_triangle.hit(r, 0, 1000);
+
+      REQUIRE(actual.has_value() == expected.has_value());
+      if (expected.has_value()) {
+        REQUIRE(actual->t == expected->t);
+        REQUIRE(actual->normal == expected->normal);
+      }
+    }
+  }
+
+  REQUIRE_THROWS(TriangleMesh(positions, {0, 1, 8}, 1));
+  REQUIRE_THROWS(TriangleMesh(positions, {0, 1}, 1));
+}
+
+TEST_CASE("Quad matches its two triangles", "[primitive][ray][quad]") {
+  const auto origin = Vec3(1, -2, 3);
+  const auto u = Vec3(4, 1, 0);
+  const auto v = Vec3(-1, 3, 2);
+  const auto quad = Quad(origin, u, v, -1);
+  const auto t0 = Triangle(origin, origin + u, origin + v, -1);
+  const auto t1 = Triangle(origin + u + v, origin + v, origin + u, -1);
+
+  const auto center = origin + (u + v) * 0.5f;
+  for (int i = 0; i < 1000; i++) {
+    const auto ray_origin = center + Vec3::rand() * 20 - Vec3(10, 10, 10);
+    const auto target = origin + u * (random_float() * 1.4f - 0.2f) +
+                        v * (random_float() * 1.4f - 0.2f);
+    const auto r = Ray(ray_origin, target - ray_origin);
+
+    // the rounding error of the hit distance grows as the ray gets closer
+    // to the plane of the quad, so the tolerance grows along with it
+    const auto n = u.cross(v).normalize();
+    const auto cos_theta = std::abs(r.direction().normalize().dot(n));
+    const auto epsilon = 1e-4 / std::max(cos_theta, 1e-3f);
+
+    const auto actual = quad.hit(r, 0, 1000);
+    auto expected = t0.hit(r, 0, 1000);
+    if (!expected.has_value()) {
+      expected = t1.hit(r, 0, 1000);
+    }
+
+    REQUIRE(actual.has_value() == expected.has_value());
+    if (expected.has_value()) {
+      REQUIRE(actual->t == Approx(expected->t).epsilon(epsilon));
+      REQUIRE(actual->normal == expected->normal);
+    }
+  }
+}
+
+TEST_CASE("Quad AABB", "[primitive][quad][aabb]") {
+  const auto quad = Quad(Vec3(0, 0, 0), Vec3(10, 0, 0), Vec3(0, 10, 0), 1);
+  const auto full = quad.aabb();
+  REQUIRE(full.min.x() == Approx(0).margin(0.001));
+  REQUIRE(full.min.y() == Approx(0).margin(0.001));
+  REQUIRE(full.max.x() == Approx(10).margin(0.001));
+  REQUIRE(full.max.y() == Approx(10).margin(0.001));
+
+  // unlike the triangle, the quad covers the whole corner of its bbox
+  auto box = full;
+  box.min = Vec3(8, 8, full.min.z());
+  auto clipped = quad.clipped_aabb(box);
+  REQUIRE(!clipped.is_empty());
+  REQUIRE(clipped.min.x() == Approx(8).margin(0.001));
+  REQUIRE(clipped.min.y() == Approx(8).margin(0.001));
+  REQUIRE(clipped.max.x() == Approx(10).margin(0.001));
+  REQUIRE(clipped.max.y() == Approx(10).margin(0.001));
+
+  clipped = quad.clipped_aabb(full);
+  REQUIRE(clipped.min == full.min);
+  REQUIRE(clipped.max == full.max);
+}
+
+TEST_CASE("Ray/Box intersection", "[primitive][ray][box]") {
+  const auto box = Box(Vec3(-1, -2, -3), Vec3(1, 2, 3));
+
+  // from outside, the ray enters through the near face
+  auto hit = box.hit(Ray(Vec3(0, 0, 10), Vec3(0, 0, -1)), 0, 1000);
+  REQUIRE(hit.has_value());
+  REQUIRE(hit->t == Approx(7));
+  REQUIRE(hit->normal == Vec3(0, 0, 1));
+
+  // from inside, it leaves through the far face and the normal still points
+  // out of the box
+  hit = box.hit(Ray(Vec3(0, 0, 0), Vec3(1, 0, 0)), 0, 1000);
+  REQUIRE(hit.has_value());
+  REQUIRE(hit->t == Approx(1));
+  REQUIRE(hit->normal == Vec3(1, 0, 0));
+
+  // the near face is past t_max
+  REQUIRE(!box.hit(Ray(Vec3(0, 0, 10), Vec3(0, 0, -1)), 0, 5).has_value());
+
+  // misses to the side and behind
+  REQUIRE(!box.hit(Ray(Vec3(5, 0, 10), Vec3(0, 0, -1)), 0, 1000).has_value());
+  REQUIRE(!box.hit(Ray(Vec3(0, 0, 10), Vec3(0, 0, 1)), 0, 1000).has_value());
+
+  // an axis-aligned ray in the plane of a face doesn't produce NaNs
+  hit = box.hit(Ray(Vec3(-5, 0, 3), Vec3(1, 0, 0)), 0, 1000);
+  REQUIRE((!hit.has_value() || !std::isnan(hit->t)));
+
+  REQUIRE(box.aabb().min == Vec3(-1, -2, -3));
+  REQUIRE(box.aabb().max == Vec3(1, 2, 3));
+  REQUIRE_THROWS(Box(Vec3(1, 0, 0), Vec3(0, 1, 1)));
+}
+
+TEST_CASE("Box matches its six faces", "[primitive][ray][box][quad]") {
+  const auto min = Vec3(-1, 0, 2);
+  const auto max = Vec3(2, 1, 4);
+  const auto box = Box(min, max);
+  const auto size = max - min;
+
+  // one quad per face, with the normal flipped to point out of the box
+  std::vector<Quad> faces;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    auto u = Vec3::zeros();
+    auto v = Vec3::zeros();
+    u[(axis + 1) % 3] = size[(axis + 1) % 3];
+    v[(axis + 2) % 3] = size[(axis + 2) % 3];
+    auto offset = Vec3::zeros();
+    offset[axis] = size[axis];
+
+    // u x v points along +axis
+    faces.emplace_back(min, u, v, -1);
+    faces.emplace_back(min + offset, u, v, 1);
+  }
+
+  const auto center = (min + max) * 0.5f;
+  for (int i = 0; i < 1000; i++) {
+    // half of the rays start inside the box
+    const auto spread = i % 2 == 0 ? 10.0f : 0.9f;
+    const auto ray_origin =
+        center + (Vec3::rand() * 2 - Vec3::ones()) * size * (spread * 0.5f);
+    const auto target = min + Vec3::rand() * size * 1.4f - size * 0.2f;
+    const auto r = Ray(ray_origin, target - ray_origin);
+
+    std::optional<ronald::Intersection> expected;
+    for (const auto &face : faces) {
+      const auto t_max = expected.has_value() ? expected->t : 1000.0f;
+      const auto face_hit = face.hit(r, 0, t_max);
+      if (face_hit.has_value()) {
+        expected = face_hit;
+      }
+    }
+
+    const auto actual = box.hit(r, 0, 1000);
+    REQUIRE(actual.has_value() == expected.has_value());
+    if (expected.has_value()) {
+      REQUIRE(actual->t == Approx(expected->t).epsilon(1e-4));
+      REQUIRE(actual->normal == expected->normal);
+    }
+  }
+}
+
+TEST_CASE("Triangle block matches scalar triangles",
+          "[primitive][ray][triangle][simd]") {
+  // five random triangles, leaving the last three lanes of the block empty
+  std::vector<Triangle> triangles;
+  auto block = TriangleBlock();
+  for (size_t i = 0; i < 5; ++i) {
+    const auto v0 = Vec3::rand() * 4 - Vec3(2, 2, 2);
+    triangles.emplace_back(v0, v0 + Vec3::rand(), v0 + Vec3::rand(), 1);
+    block.set(i, *triangles.back().triangle_data());
+  }
+
+  for (int j = 0; j < 500; j++) {
+    // aim at the centroid of one of the triangles so most rays hit something
+    const auto &target = triangles[static_cast<size_t>(j) % triangles.size()];
+    const auto tri = *target.triangle_data();
+    const auto origin = Vec3::rand() * 10 - Vec3(5, 5, 5);
+    const auto r = Ray(origin, tri.v0 + (tri.edge1 + tri.edge2) / 3 - origin);
+
+    int expected_lane = -1;
+    auto expected_t = 1000.0f;
+    for (size_t i = 0; i < triangles.size(); ++i) {
+      const auto hit = triangles[i].hit(r, 0, expected_t);
+      if (hit.has_value()) {
+        expected_lane = static_cast<int>(i);
+        expected_t = hit->t;
+      }
+    }
+
+    // the kernel rounds differently to the scalar test, which is noticeable
+    // in `t` when the ray hits a triangle at a grazing angle
+    const auto actual = intersect_triangle_block(block, r, 0, 1000);
+    REQUIRE(actual.lane == expected_lane);
+    REQUIRE(actual.t == Approx(expected_t).epsilon(1e-3));
+    if (expected_lane >= 0) {
+      const auto lane = static_cast<size_t>(expected_lane);
+      REQUIRE(block.normal(lane) == triangles[lane].hit(r, 0, 1000)->normal);
+    }
+  }
+
+  // every triangle is at least 0.9 units along this ray, and an empty block
+  // is never hit
+  const auto tri = *triangles[0].triangle_data();
+  const auto origin = Vec3(0, 0, 100);
+  const auto r = Ray(origin, tri.v0 + (tri.edge1 + tri.edge2) / 3 - origin);
+  REQUIRE(intersect_triangle_block(block, r, 0, 1000).lane >= 0);
+  REQUIRE(intersect_triangle_block(block, r, 0, 0.9f).lane == -1);
+  REQUIRE(intersect_triangle_block(TriangleBlock(), r, 0, 1000).lane == -1);
+}
+
+TEST_CASE("Triangle block matches scalar quads",
+          "[primitive][ray][quad][simd]") {
+  // a quad and a triangle with the same edges share a block
+  const auto v0 = Vec3(-1, -1, 2);
+  const auto edge1 = Vec3(2, 0.5, 0);
+  const auto edge2 = Vec3(0.3f, 2, 0.5f);
+  const auto quad = Quad(v0, edge1, edge2, 1);
+  const auto triangle = Triangle(v0 + Vec3(0, 0, 1), v0 + Vec3(0, 0, 1) + edge1,
+                                 v0 + Vec3(0, 0, 1) + edge2, 1);
+  auto block = TriangleBlock();
+  block.set(0, *quad.triangle_data());
+  block.set(1, *triangle.triangle_data());
+
+  for (int j = 0; j < 500; j++) {
+    const auto origin = Vec3::rand() * 10 - Vec3(5, 5, 5) - Vec3(0, 0, 10);
+    const auto target =
+        v0 + edge1 * (random_float() * 1.4f - 0.2f) +
+        edge2 * (random_float() * 1.4f - 0.2f) + Vec3(0, 0, random_float());
+    const auto r = Ray(origin, target - origin);
+
+    int expected_lane = -1;
+    auto expected_t = 1000.0f;
+    if (const auto hit = quad.hit(r, 0, expected_t); hit.has_value()) {
+      expected_lane = 0;
+      expected_t = hit->t;
+    }
+    if (const auto hit = triangle.hit(r, 0, expected_t); hit.has_value()) {
+      expected_lane = 1;
+      expected_t = hit->t;
+    }
+
+    const auto actual = intersect_triangle_block(block, r, 0, 1000);
+    REQUIRE(actual.lane == expected_lane);
+    REQUIRE(actual.t == Approx(expected_t).epsilon(1e-3));
+  }
+}
+
+TEST_CASE("Sphere block matches scalar spheres",
+          "[primitive][ray][sphere][simd]") {
+  // five random spheres, leaving the last three lanes of the block empty. the
+  // last one has a negative radius, which flips its normals
+  std::vector<Sphere> spheres;
+  auto block = SphereBlock();
+  for (size_t i = 0; i < 5; ++i) {
+    const auto radius = (0.2f + random_float()) * (i == 4 ? -1.0f : 1.0f);
+    spheres.emplace_back(Vec3::rand() * 4 - Vec3(2, 2, 2), radius);
+    block.set(i, *spheres.back().sphere_data());
+  }
+
+  for (int j = 0; j < 500; j++) {
+    // start some of the rays inside a sphere so that the far root gets used
+    const auto &target = spheres[static_cast<size_t>(j) % spheres.size()];
+    const auto center = target.sphere_data()->center;
+    const auto origin =
+        j % 3 == 0 ? center : Vec3::rand() * 10 - Vec3(5, 5, 5);
+    const auto r = Ray(origin, center + Vec3::rand() * 0.1f - origin);
+
+    int expected_lane = -1;
+    auto expected_t = 1000.0f;
+    for (size_t i = 0; i < spheres.size(); ++i) {
+      const auto hit = spheres[i].hit(r, 0.001f, expected_t);
+      if (hit.has_value()) {
+        expected_lane = static_cast<int>(i);
+        expected_t = hit->t;
+      }
+    }
+
+    const auto actual = intersect_sphere_block(block, r, 0.001f, 1000);
+    REQUIRE(actual.lane == expected_lane);
+    REQUIRE(actual.t == Approx(expected_t).epsilon(1e-4));
+  }
+
+  // an empty block is never hit, even by a ray through the origin
+  const auto r = Ray(Vec3(0, 0, -10), Vec3(0, 0, 1));
+  REQUIRE(intersect_sphere_block(SphereBlock(), r, 0, 1000).lane == -1);
+}
+
+TEST_CASE("Sphere blocks match brute force", "[primitive][ray][sphere][simd]") {
+  const auto mat1 = std::make_shared<ronald::Dielectric>(
+      ronald::Dielectric(1.5f, Vec3::ones()));
+  const auto mat2 = std::make_shared<ronald::Dielectric>(
+      ronald::Dielectric(1.3f, Vec3::ones()));
+
+  // 101 spheres, so the last block is only partly filled
+  std::vector<Sphere> spheres;
+  std::vector<SphereData> data;
+  std::vector<const ronald::Material *> mats;
+  for (size_t i = 0; i < 101; ++i) {
+    spheres.emplace_back(Vec3::rand() * 20 - Vec3(10, 10, 10),
+                         0.1f + random_float());
+    data.push_back(*spheres.back().sphere_data());
+    mats.push_back(i % 2 == 0 ? mat1.get() : mat2.get());
+  }
+
+  auto blocks = SphereBlocks();
+  REQUIRE(blocks.add(data, mats) == 0);
+  REQUIRE(blocks.size() == 13);
+
+  for (int j = 0; j < 1000; j++) {
+    const auto r = Ray(Vec3::rand() * 30 - Vec3(15, 15, 15),
+                       Vec3::rand() - Vec3(0.5f, 0.5f, 0.5f));
+
+    std::optional<ronald::Intersection> expected = std::nullopt;
+    const ronald::Material *expected_mat = nullptr;
+    auto t_max = 1000.0f;
+    for (size_t i = 0; i < spheres.size(); ++i) {
+      const auto hit = spheres[i].hit(r, 0.001f, t_max);
+      if (hit.has_value()) {
+        expected = hit;
+        expected_mat = mats[i];
+        t_max = hit->t;
+      }
+    }
+
+    const auto actual = blocks.intersect(r, 0.001f, 1000);
+    REQUIRE(actual.has_value() == expected.has_value());
+    if (expected.has_value()) {
+      REQUIRE(actual->material == expected_mat);
+      REQUIRE(actual->hit.t == Approx(expected->t).epsilon(1e-4));
+      REQUIRE(actual->hit.normal == expected->normal);
+    }
+  }
+}
+
+TEST_CASE("Sphere block benchmark", "[.][benchmark][sphere]") {
+  std::vector<Sphere> spheres;
+  std::vector<SphereData> data;
+  std::vector<const ronald::Material *> mats;
+  for (size_t i = 0; i < 4096; ++i) {
+    spheres.emplace_back(Vec3::rand() * 100, 0.1f + random_float());
+    data.push_back(*spheres.back().sphere_data());
+    mats.push_back(nullptr);
+  }
+  auto blocks = SphereBlocks();
+  blocks.add(data, mats);
+
+  std::vector<Ray> rays;
+  for (int i = 0; i < 64; i++) {
+    rays.emplace_back(Vec3::rand() * 100,
+                      Vec3::rand() - Vec3(0.5f, 0.5f, 0.5f));
+  }
+
+  BENCHMARK("Scalar") {
+    auto total = 0.0f;
+    for (const auto &r : rays) {
+      auto t_max = 1000.0f;
+      for (const auto &s : spheres) {
+        const auto hit = s.hit(r, 0.001f, t_max);
+        t_max = hit.has_value() ? hit->t : t_max;
+      }
+      total += t_max;
+    }
+    return total;
+  };
+
+  BENCHMARK("Blocks") {
+    auto total = 0.0f;
+    for (const auto &r : rays) {
+      const auto hit = blocks.intersect(r, 0.001f, 1000);
+      total += hit.has_value() ? hit->hit.t : 1000.0f;
+    }
+    return total;
+  };
+}
+
+/**
+ * Build a flat mesh over the unit square in the xy plane, made of n x n
+ * cells with two triangles each
+ */
+TriangleMesh grid_mesh(const uint32_t n, const TriangleTest test) {
+  std::vector<Vec3> positions;
+  for (uint32_t y = 0; y <= n; ++y) {
+    for (uint32_t x = 0; x <= n; ++x) {
+      positions.emplace_back(static_cast<float>(x) / static_cast<float>(n),
+                             static_cast<float>(y) / static_cast<float>(n), 0);
+    }
+  }
+
+  std::vector<uint32_t> indices;
+  for (uint32_t y = 0; y < n; ++y) {
+    for (uint32_t x = 0; x < n; ++x) {
+      const auto i = y * (n + 1) + x;
+      indices.insert(indices.end(), {i, i + 1, i + n + 2});
+      indices.insert(indices.end(), {i, i + n + 2, i + n + 1});
+    }
+  }
+
+  return {std::move(positions), std::move(indices), 1, test};
+}
+
+TEST_CASE("Watertight triangle matches Möller–Trumbore",
+          "[primitive][ray][triangle][watertight]") {
+  for (int i = 0; i < 100; i++) {
+    const auto v0 = Vec3::rand() * 4 - Vec3(2, 2, 2);
+    const auto v1 = v0 + Vec3::rand();
+    const auto v2 = v0 + Vec3::rand();
+    const auto triangle = Triangle(v0, v1, v2, -1);
+    const auto watertight = WatertightTriangle(v0, v1, v2, -1);
+    REQUIRE(watertight.aabb().min == triangle.aabb().min);
+    REQUIRE(watertight.aabb().max == triangle.aabb().max);
+
+    for (int j = 0; j < 20; j++) {
+      // aim well inside or well outside of the triangle, where both tests
+      // are guaranteed to agree
+      auto u = random_float();
+      auto v = random_float();
+      if (j % 2 == 0) {
+        u = 0.1f + u * 0.4f;
+        v = 0.1f + v * 0.4f;
+      } else {
+        u = 1.0f + u;
+      }
+
+      const auto origin = Vec3::rand() * 10 - Vec3(5, 5, 5);
+      const auto target = v0 + (v1 - v0) * u + (v2 - v0) * v;
+      const auto r = Ray(origin, target - origin);
+      const auto expected = triangle.hit(r, 0, 1000);
+      const auto actual = watertight.hit(r, 0, 1000);
+
+      REQUIRE(actual.has_value() == expected.has_value());
+      if (expected.has_value()) {
+        REQUIRE(actual->t == Approx(expected->t).epsilon(1e-3));
+        REQUIRE(actual->normal == expected->normal);
+      }
+
+      // nothing is hit outside of the given range
+      REQUIRE(!watertight.hit(r, 0, 0.5f).has_value());
+    }
+  }
+}
+
+TEST_CASE("Watertight test doesn't leak through shared edges",
+          "[primitive][ray][triangle][watertight]") {
+  const uint32_t n = 16;
+  const auto nf = static_cast<float>(n);
+  const auto mesh = grid_mesh(n, TriangleTest::Watertight);
+
+  size_t misses = 0;
+  for (int i = 0; i < 20000; i++) {
+    // aim at a point on one of the interior grid lines or cell diagonals
+    const auto cell_x = std::floor(1 + random_float() * (nf - 1)) / nf;
+    const auto cell_y = std::floor(1 + random_float() * (nf - 1)) / nf;
+    const auto s = random_float() / nf;
+    const auto target = i % 3 == 0   ? Vec3(cell_x + s, cell_y, 0)
+                        : i % 3 == 1 ? Vec3(cell_x, cell_y + s, 0)
+                                     : Vec3(cell_x + s, cell_y + s, 0);
+
+    const auto origin = Vec3::rand() * 4 - Vec3(2, 2, -1);
+    const auto r = Ray(origin, target - origin);
+
+    bool hit = false;
+    for (size_t j = 0; j < mesh.size(); ++j) {
+      hit = hit || mesh.triangle(j).hit(r, 0, 1000).has_value();
+    }
+    misses += hit ? 0 : 1;
+  }
+
+  REQUIRE(misses == 0);
+}
+
+TEST_CASE("Triangle test benchmark", "[.][benchmark][triangle]") {
+  const uint32_t n = 32;
+  const auto nf = static_cast<float>(n);
+  const auto mt_mesh = grid_mesh(n, TriangleTest::MollerTrumbore);
+  const auto wt_mesh = grid_mesh(n, TriangleTest::Watertight);
+
+  std::vector<Ray> rays;
+  for (int i = 0; i < 256; i++) {
+    const auto origin = Vec3::rand() * 4 - Vec3(2, 2, -1);
+    rays.emplace_back(origin, Vec3(random_float(), random_float(), 0) - origin);
+  }
+
+  // count the rays that slip through the mesh even though they are aimed at
+  // it. every ray should hit, but the Möller–Trumbore test can miss the
+  // shared edges
+  const auto count_leaks = [&](const TriangleMesh &mesh) {
+    size_t leaks = 0;
+    for (int i = 0; i < 100000; i++) {
+      const auto x = std::floor(1 + random_float() * (nf - 1)) / nf;
+      const auto origin = Vec3::rand() * 4 - Vec3(2, 2, -1);
+      const auto r = Ray(origin, Vec3(x, random_float(), 0) - origin);
+      bool hit = false;
+      for (size_t j = 0; j < mesh.size() && !hit; ++j) {
+        hit = mesh.triangle(j).hit(r, 0, 1000).has_value();
+      }
+      leaks += hit ? 0 : 1;
+    }
+    return leaks;
+  };
+  WARN("Möller–Trumbore leaks: " << count_leaks(mt_mesh) << " / 100000");
+  WARN("Watertight leaks: " << count_leaks(wt_mesh) << " / 100000");
+
+  const auto closest_hit = [&](const TriangleMesh &mesh) {
+    auto total = 0.0f;
+    for (const auto &r : rays) {
+      auto t_max = 1000.0f;
+      for (size_t j = 0; j < mesh.size(); ++j) {
+        const auto hit = mesh.triangle(j).hit(r, 0, t_max);
+        t_max = hit.has_value() ? hit->t : t_max;
+      }
+      total += t_max;
+    }
+    return total;
+  };
+
+  BENCHMARK("Möller–Trumbore") { return closest_hit(mt_mesh); };
+  BENCHMARK("Watertight") { return closest_hit(wt_mesh); };
+}